@@ -0,0 +1,129 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * dwz alt files: distribution debuginfo moves what the objects of a
+ * package share (names, types, abstract origins) into one file, named
+ * by .gnu_debugaltlink and referred to by DW_FORM_GNU_ref_alt and
+ * DW_FORM_GNU_strp_alt. Without it most DIEs have no name.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <boost/unordered_map.hpp>
+#include <elfutils/libdwelf.h>
+#include <logging.hxx>
+
+// where debuginfo gets installed, by build-id
+#define DEBUG_DIR "/usr/lib/debug"
+
+struct AltFile {
+    Dwarf *mpDwarf; // NULL if there was none to be found
+    int    mnFd;
+};
+
+/*
+ * Every alt file is opened once, whichever of the modules (of every
+ * process) refers to it first, and stays open for the others.
+ */
+class AltFiles {
+    boost::unordered_map< std::string, AltFile > maFiles; // by build-id, in hex
+
+    static Dwarf *openFile (const std::string &rPath, const void *pBuildId,
+                            size_t nLength, int *pFd)
+    {
+        int fd = open (rPath.c_str(), O_RDONLY);
+        if (fd < 0)
+            return NULL;
+        Dwarf *pDwarf = dwarf_begin (fd, DWARF_C_READ);
+        const void *pId;
+        if (pDwarf &&
+            dwelf_elf_gnu_build_id (dwarf_getelf (pDwarf), &pId) == (ssize_t)nLength &&
+            !memcmp (pId, pBuildId, nLength))
+        {
+            *pFd = fd;
+            return pDwarf;
+        }
+        if (pDwarf) // another build
+            dwarf_end (pDwarf);
+        close (fd);
+        return NULL;
+    }
+
+  public:
+    ~AltFiles ()
+    {
+        for (boost::unordered_map< std::string, AltFile >::iterator it = maFiles.begin();
+             it != maFiles.end(); ++it)
+        {
+            if (!it->second.mpDwarf)
+                continue;
+            dwarf_end (it->second.mpDwarf);
+            close (it->second.mnFd);
+        }
+    }
+
+    void attach (Dwarf *pDwarf, const char *pDebugFile)
+    {
+        const char *pName;
+        const void *pBuildId;
+        ssize_t nLength = dwelf_dwarf_gnu_debugaltlink (pDwarf, &pName, &pBuildId);
+        if (nLength <= 0)
+            return; // no dwz
+
+        static const char aHex[] = "0123456789abcdef";
+        std::string aKey;
+        for (ssize_t i = 0; i < nLength; i++)
+        {
+            unsigned char c = ((const unsigned char *)pBuildId)[i];
+            aKey += aHex[c >> 4];
+            aKey += aHex[c & 0xf];
+        }
+
+        boost::unordered_map< std::string, AltFile >::iterator it = maFiles.find (aKey);
+        if (it == maFiles.end())
+        {
+            // as named (relative to the debug file), else by build-id
+            std::vector< std::string > aPaths;
+            if (pName[0] == '/')
+                aPaths.push_back (pName);
+            else if (pDebugFile && strrchr (pDebugFile, '/'))
+                aPaths.push_back (std::string (pDebugFile, strrchr (pDebugFile, '/') + 1) +
+                                  pName);
+            aPaths.push_back (DEBUG_DIR "/.build-id/" + aKey.substr (0, 2) + "/" +
+                              aKey.substr (2) + ".debug");
+
+            AltFile aFile = { NULL, -1 };
+            for (size_t i = 0; i < aPaths.size() && !aFile.mpDwarf; i++)
+                aFile.mpDwarf = openFile (aPaths[i], pBuildId, nLength, &aFile.mnFd);
+            if (!aFile.mpDwarf)
+                fprintf (stderr, "no dwz alt file '%s' (build-id %s)\n",
+                         pName, aKey.c_str());
+            it = maFiles.insert (std::make_pair (aKey, aFile)).first;
+        }
+        if (it->second.mpDwarf)
+            dwarf_setalt (pDwarf, it->second.mpDwarf);
+    }
+};
+
+AltFiles *alt_files_new ()
+{
+    return new AltFiles();
+}
+
+void alt_files_free (AltFiles *files)
+{
+    delete files;
+}
+
+void alt_files_attach (AltFiles *files, Dwarf *dwarf, const char *debug_file)
+{
+    files->attach (dwarf, debug_file);
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
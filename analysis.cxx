@@ -0,0 +1,1389 @@
+/*
+ * analysis.cxx - the analysis behind dwarfprofile: walks the DWARF of
+ * the modules of a Dwfl into a tree of size information.
+ *
+ * Copyright (C) 2013, Mark J. Wielaard  <mark@klomp.org>
+ *
+ * This file is free software.  You can redistribute it and/or modify
+ * it under the terms of the GNU General Public License (GPL); either
+ * version 3, or (at your option) any later version.
+ */
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <boost/unordered_set.hpp>
+
+#include <context.hxx>
+#include <workpool.hxx>
+
+// Older versions of elfutils/libdw dwarf.h don't define this one.
+#ifndef DW_TAG_GNU_call_site
+#define DW_TAG_GNU_call_site 0x4109
+#endif
+
+/* The allocated, non-code sections of the module being walked, by
+   address, for --data. */
+struct data_section
+{
+  GElf_Addr start;
+  GElf_Addr end;
+  const char *name;
+};
+
+/* What a DIE that is an instance of another (an inlined function, an
+   out-of-line definition) takes from that, cf. DIE_origin_what. */
+struct origin_info
+{
+  int tag;
+  Dwarf_Off die_off;
+  const char *name;
+  const char *file;
+  int line;
+  int col;
+};
+typedef boost::unordered_map<const void *, origin_info> origin_map;
+
+/* A walk of modules (or chunks of CUs of one) for a context, by one
+   thread. Everything that changes while walking is in here: a context
+   can have several walkers at once (cf. batch). */
+struct walker
+{
+  dwarfprofile_context *ctx;
+  const dwarfprofile_options *opts;
+  address_space *space;			// what the walk found so far
+  Dwarf_Files *files;			// file strings cache of the CU
+  InlineTable *inlines;			// or NULL
+  TemplateCache *templates;		// or NULL
+  PathCache *paths;			// canonical file paths
+  AltFiles *alts;			// dwz alt files, by build-id
+  boost::unordered_set<const void *> partial_units; // walked, of the module
+  origin_map origins;			// of the module, by DIE address
+
+  std::vector<data_section> data_sections;
+  Dwfl_Module *data_module;
+  GElf_Addr data_elf_bias;
+  Dwarf_Addr data_dwarf_bias;
+
+  walker (dwarfprofile_context *c, address_space *s)
+    : ctx (c), opts (&c->maOptions), space (s), files (NULL),
+      inlines (c->mpInlines ? inline_table_new (c->mpInlines) : NULL),
+      templates (c->mpTemplates ? template_cache_new (c->mpTemplates) : NULL),
+      paths (path_cache_new (c->maPrefixMap)), alts (c->mpAltFiles),
+      data_module (NULL), data_elf_bias (0), data_dwarf_bias (0) {}
+  ~walker () { path_cache_free (paths); }
+};
+
+/* Returns size of code described by this DIE. Returns zero if this
+   DIE doesn't cover any code. 1 is returned for DIEs that do describe
+   code by have unknown size. */
+static Dwarf_Word
+DIE_code_size (struct walker *w, Dwarf_Die *die)
+{
+  Dwarf_Addr base;
+  Dwarf_Addr begin;
+  Dwarf_Addr end;
+  ptrdiff_t off = 0;
+  Dwarf_Word size = 0;
+
+  do
+    {
+      // Also handles lowpc plus highpc as special one range case.
+      off = dwarf_ranges (die, off, &base, &begin, &end);
+      if (off > 0)
+	{
+	  size += (end - begin);
+	}
+    }
+  while (off > 0);
+
+  if (size == 0 && (dwarf_hasattr (die, DW_AT_entry_pc)
+                    || dwarf_hasattr (die, DW_AT_low_pc)))
+    size = w->opts->single_address_size;
+
+  return size;
+}
+
+/* Returns the tag of the DIE declaring the given DIE following
+   DW_AT_abstract_origin and DW_AT_specification, and its offset in
+   decl_off. */
+static int
+DIE_decl_tag (Dwarf_Die *die, Dwarf_Off *decl_off)
+{
+  Dwarf_Die decl = *die;
+  Dwarf_Die origin;
+  Dwarf_Attribute attr_mem;
+  Dwarf_Attribute *attr;
+
+  for (;;)
+    {
+      attr = dwarf_attr (&decl, DW_AT_abstract_origin, &attr_mem);
+      if (attr == NULL)
+	attr = dwarf_attr (&decl, DW_AT_specification, &attr_mem);
+      if (attr == NULL || dwarf_formref_die (attr, &origin) == NULL)
+	break;
+      decl = origin;
+    }
+
+  *decl_off = dwarf_dieoffset (&decl);
+  return dwarf_tag (&decl);
+}
+
+/* Fills in the what of a DIE that is an instance of another one
+   (DW_AT_abstract_origin, DW_AT_specification) from that origin,
+   except for what the DIE says itself, as dwarf_attr_integrate would.
+   Origins are shared by all inlined instances of a function and, with
+   dwz, live in the alt file: each is followed only once per module.
+   Returns false for a DIE that is no instance. */
+static bool
+DIE_origin_what (struct walker *w, Dwarf_Die *die, struct what_info *what,
+		 const char **file)
+{
+  Dwarf_Attribute attr_mem;
+  Dwarf_Attribute *attr = dwarf_attr (die, DW_AT_abstract_origin, &attr_mem);
+  if (attr == NULL)
+    attr = dwarf_attr (die, DW_AT_specification, &attr_mem);
+  Dwarf_Die origin;
+  if (attr == NULL || dwarf_formref_die (attr, &origin) == NULL)
+    return false;
+
+  std::pair<origin_map::iterator, bool> found
+    = w->origins.insert (origin_map::value_type (origin.addr, origin_info ()));
+  origin_info &info = found.first->second;
+  if (found.second)
+    {
+      info.tag = DIE_decl_tag (&origin, &info.die_off);
+      info.name = dwarf_diename (&origin);
+      info.file = dwarf_decl_file (&origin);
+      info.line = 0;
+      info.col = 0;
+      dwarf_decl_line (&origin, &info.line);
+      dwarf_decl_column (&origin, &info.col);
+    }
+
+  what->tag = info.tag;
+  what->die_off = info.die_off;
+  what->name = (dwarf_hasattr (die, DW_AT_name)
+		? dwarf_diename (die) : info.name);
+  *file = (dwarf_hasattr (die, DW_AT_decl_file)
+	   ? dwarf_decl_file (die) : info.file);
+  what->line = info.line;
+  what->col = info.col;
+  if (dwarf_hasattr (die, DW_AT_decl_line))
+    dwarf_decl_line (die, &what->line);
+  if (dwarf_hasattr (die, DW_AT_decl_column))
+    dwarf_decl_column (die, &what->col);
+  return true;
+}
+
+#if 0
+/* Returns a static constant string representation of the DIE tag.
+   Returns NULL when unknown. Would be nice if libdw had this. */
+static const char *
+TAG_name (int tag)
+{
+  /* Just recognize code/function DIEs. Add more if necessary. */
+  switch (tag)
+    {
+    case DW_TAG_compile_unit:
+      return "compile_unit";
+    case DW_TAG_subprogram:
+      return "subprogram";
+    case DW_TAG_catch_block:
+      return "catch_block";
+    case DW_TAG_inlined_subroutine:
+      return "inlined_subroutine";
+    case DW_TAG_lexical_block:
+      return "lexical_block";
+    case DW_TAG_module:
+      return "module";
+    case DW_TAG_partial_unit:
+      return "partial_unit";
+    case DW_TAG_try_block:
+      return "try_block";
+    case DW_TAG_with_stmt:
+      return "with_stmt";
+    case DW_TAG_GNU_call_site:
+      return "call_site";
+    case DW_TAG_label:
+      return "label";
+    default:
+      return NULL;
+    }
+}
+#endif
+
+/* Returns the mangled name of a function DIE, or NULL. */
+static const char *
+DIE_linkage_name (Dwarf_Die *die)
+{
+  Dwarf_Attribute attr_mem;
+  Dwarf_Attribute *attr = dwarf_attr_integrate (die, DW_AT_linkage_name,
+						&attr_mem);
+  if (attr == NULL)
+    attr = dwarf_attr_integrate (die, DW_AT_MIPS_linkage_name, &attr_mem);
+  return attr ? dwarf_formstring (attr) : NULL;
+}
+
+/* Returns the code size of the DIE and fills in the what and where
+   info if the size is greater than zero. */
+static Dwarf_Word
+DIE_what_where_size (struct walker *w, Dwarf_Die *die,
+		     struct what_info *what, struct where_info *where)
+{
+  Dwarf_Word size = DIE_code_size (w, die);
+  if (size > 0)
+    {
+      const char *what_file, *where_file;
+
+      what->instance = NULL;
+      bool instance = DIE_origin_what (w, die, what, &what_file);
+      if (!instance)
+	{
+	  what->tag = dwarf_tag (die);
+	  what->die_off = dwarf_dieoffset (die);
+	  what->name = dwarf_diename (die);
+	  what_file = dwarf_decl_file (die);
+	  what->line = 0;
+	  what->col = 0;
+	  dwarf_decl_line (die, &what->line);
+	  dwarf_decl_column (die, &what->col);
+
+	  where->tag = what->tag;
+	  where->die_off = what->die_off;
+	  where_file = what_file;
+	  where->line = what->line;
+	  where->col = what->col;
+	}
+      else
+	{
+	  where->tag = dwarf_tag (die);
+	  where->die_off = dwarf_dieoffset (die);
+
+	  Dwarf_Word value;
+	  Dwarf_Attribute attr_mem;
+	  where_file = what_file;
+	  if (dwarf_formudata (dwarf_attr (die, DW_AT_call_file, &attr_mem),
+			       &value) == 0)
+	    where_file = dwarf_filesrc (w->files, value, NULL, NULL);
+
+	  where->line = what->line;
+	  if (dwarf_formudata (dwarf_attr (die, DW_AT_call_line, &attr_mem),
+			       &value) == 0)
+	    where->line = value;
+
+	  where->col = what->col;
+	  if (dwarf_formudata (dwarf_attr (die, DW_AT_call_column, &attr_mem),
+			       &value) == 0)
+	    where->col = value;
+
+	  /* XXX is this really right or just cosmetics?  If all
+	     information of what and where are the same just pretend
+	     what == where anyway. Note we force the what die_off
+	     because all information can apparently be derived from
+	     the where. */
+	  if (where->tag == what->tag
+	      && where_file == what_file
+	      && where->line == what->line
+	      && where->col == what->col)
+	    what->die_off = where->die_off;
+
+	}
+      /* Template instances go by the name of their family, which
+	 needs the mangled name: the DIE name lacks the class. */
+      if (w->templates && (where->tag == DW_TAG_subprogram
+			   || where->tag == DW_TAG_inlined_subroutine))
+	{
+	  what->instance = template_lookup (w->templates,
+					    DIE_linkage_name (die),
+					    what->name);
+	  if (what->instance)
+	    what->name = template_family (what->instance);
+	}
+
+      where->size = size;
+      what->file = path_canonical (w->paths, what_file);
+      where->file = path_canonical (w->paths, where_file);
+
+      // Register these addresses cf. die-code-size etc.
+      {
+	Dwarf_Addr base;
+	Dwarf_Addr begin;
+	Dwarf_Addr end;
+	ptrdiff_t off = 0;
+	do
+	  {
+	    // Also handles lowpc plus highpc as special one range case.
+	    off = dwarf_ranges (die, off, &base, &begin, &end);
+	    if (off > 0)
+	      {
+		register_address_span (w->space, what, begin, end);
+	      }
+	  }
+	while (off > 0);
+
+	if (size == 0 && (dwarf_hasattr (die, DW_AT_entry_pc)
+			  || dwarf_hasattr (die, DW_AT_low_pc)) &&
+	    w->opts->single_address_size > 0)
+	  {
+	    fprintf (stderr, "test me - size zero die: 0x%ld", (long) base);
+	    register_address_span (w->space, what, base, base + 1);
+	  }
+
+      }
+    }
+  else
+    {
+      what->file = NULL;
+      what->instance = NULL;
+      where->file = NULL;
+    }
+
+  return size;
+}
+
+#if 0
+/* Returns a hopefully unique identifier for what code is being used
+   based on the definition tag, name, file, line and col if
+   known. String has to be freed by caller. */
+static char *
+what_identifier_string (const struct what_info *what)
+{
+  char *res;
+  int tag = what->tag;
+  const char *orig_name = what->name;
+  const char *file = what->file;
+  int line = what->line;
+  int col = what->col;
+  Dwarf_Word die_off = what->die_off;
+
+  if (orig_name != NULL)
+    {
+      char *name = escape_name (orig_name);
+      if (file != NULL)
+	{
+	  if (line != 0)
+	    {
+	      if (col != 0)
+		{
+		  if (asprintf (&res, "%s:%s:%s:%d:%d", TAG_name (tag),
+				name, file, line, col) < 0)
+		    res = NULL;
+		}
+	      else
+		{
+		  if (asprintf (&res, "%s:%s:%s:%d", TAG_name (tag),
+				name, file, line) < 0)
+		    res = NULL;
+		}
+	    }
+	  else
+	    {
+	      if (asprintf (&res, "%s:%s:%s", TAG_name (tag), name, file) < 0)
+		res = NULL;
+	    }
+	}
+      else
+	{
+	  if (asprintf (&res, "%s:%s", TAG_name (tag), name) < 0)
+	    res = NULL;
+	}
+      free (name);
+    }
+  else
+    {
+      // No name, use DIE offset to generate something (possibly non-unique).
+      if (asprintf (&res, "%s_%#lx", TAG_name (tag), (long)die_off) < 0)
+	res = NULL;
+    }
+
+  return res;
+}
+
+/* Returns a string describing the location where a DIE was used.
+   String has to be freed by caller. */
+static char *
+where_string (const struct where_info *where)
+{
+  char *res;
+  int tag = where->tag;
+  const char *file = where->file;
+  int line = where->line;
+  int col = where->col;
+
+  if (file != NULL)
+    {
+      if (line != 0)
+	{
+	  if (col != 0)
+	    {
+	      if (asprintf (&res, "%s:%s:%d:%d", TAG_name (tag),
+			    file, line, col) < 0)
+		res = NULL;
+	    }
+	  else
+	    {
+	      if (asprintf (&res, "%s:%s:%d", TAG_name (tag),
+			    file, line) < 0)
+		res = NULL;
+	    }
+	}
+      else
+	{
+	  if (asprintf (&res, "%s:%s", TAG_name (tag), file) < 0)
+	    res = NULL;
+	}
+    }
+  else
+    {
+      if (asprintf (&res, "%s", TAG_name (tag)) < 0)
+	res = NULL;
+    }
+
+  return res;
+}
+#endif
+
+/* We treat nested subprograms as "inlines", keep track of how deep we nest. */
+// static int in_top_level_subprogram = 0;
+
+static void
+output_die_begin (struct what_info *what, struct where_info *where, int indent)
+{
+}
+
+static void
+output_die_end (struct what_info *pwhat, struct where_info *pwhere,
+                struct what_info *what, struct where_info *where,
+		Dwarf_Word children_size, int indent)
+{
+}
+
+/* Walks all (code) children of the given DIE and returns the total
+   code size. caller is the name of the innermost function (real or
+   inlined) the DIE is part of, if any. */
+static Dwarf_Word
+walk_children (struct walker *w, Dwarf_Die *die, int indent,
+	       const char *caller)
+{
+  Dwarf_Word total = 0;
+  if (! dwarf_haschildren (die))
+    return total;
+
+  struct what_info pwhat;
+  struct where_info pwhere;
+  DIE_what_where_size (w, die, &pwhat, &pwhere);
+
+  Dwarf_Die child;
+  if (dwarf_child (die, &child) == 0)
+    {
+      do
+	{
+	  struct what_info what;
+	  struct where_info where;
+
+	  /* Partial units are walked as units of their own (cf.
+	     walk_partial_unit), and those of the dwz alt file hold no
+	     code: an import adds nothing. */
+	  if (dwarf_tag (&child) == DW_TAG_imported_unit)
+	    continue;
+
+	  /* Only DIEs with a code size have children with code and
+	     the code size of a DIE >= the sum of the code size of the
+	     children. */
+	  Dwarf_Word size = DIE_what_where_size (w, &child, &what, &where);
+	  if (size > 0)
+	    {
+	      /* Even if we don't use this DIE because it doesn't have
+		 a name, we still want to walk the children. */
+	      bool use_die = ((what.name != NULL) || (! w->opts->ignore_no_name));
+
+	      if (use_die)
+		{
+		  /* Note we add the whole DIE size, which include the
+		     size of all children. So only add children_size
+		     below if we don't report this DIE. */
+		  total += size;
+
+		  output_die_begin (&what, &where, indent);
+		}
+
+	      if (w->inlines && where.tag == DW_TAG_inlined_subroutine)
+		register_inline (w->inlines, &what, size, caller);
+	      if (what.instance)
+		template_add_size (what.instance, size);
+
+	      bool function = (where.tag == DW_TAG_subprogram
+			       || where.tag == DW_TAG_inlined_subroutine);
+	      Dwarf_Word children_size
+		= walk_children (w, &child, indent + 1,
+				 function && what.name ? what.name : caller);
+
+	      if (use_die)
+		output_die_end (&pwhat, &pwhere, &what, &where, children_size, indent);
+	      else
+		total += children_size;
+	    }
+	}
+      while (dwarf_siblingof (&child, &child) == 0);
+    }
+
+  return total;
+}
+
+static bool
+section_before (const data_section &a, const data_section &b)
+{
+  return a.start < b.start;
+}
+
+static void
+data_begin_module (struct walker *w, Dwfl_Module *mod)
+{
+  w->data_module = mod;
+  w->data_sections.clear ();
+
+  size_t shstrndx;
+  Elf *elf = dwfl_module_getelf (mod, &w->data_elf_bias);
+  if (elf == NULL || elf_getshdrstrndx (elf, &shstrndx) != 0
+      || dwfl_module_getdwarf (mod, &w->data_dwarf_bias) == NULL)
+    return;
+
+  Elf_Scn *scn = NULL;
+  while ((scn = elf_nextscn (elf, scn)) != NULL)
+    {
+      GElf_Shdr shdr_mem;
+      GElf_Shdr *shdr = gelf_getshdr (scn, &shdr_mem);
+      if (shdr == NULL || !(shdr->sh_flags & SHF_ALLOC)
+	  || (shdr->sh_flags & SHF_EXECINSTR) || shdr->sh_size == 0)
+	continue;
+
+      data_section section;
+      section.start = shdr->sh_addr;
+      section.end = shdr->sh_addr + shdr->sh_size;
+      section.name = elf_strptr (elf, shstrndx, shdr->sh_name);
+      if (section.name != NULL)
+	w->data_sections.push_back (section);
+    }
+  std::sort (w->data_sections.begin (), w->data_sections.end (),
+	     section_before);
+}
+
+/* Returns the section an (ELF) address is in, or NULL. */
+static const char *
+data_section_name (struct walker *w, GElf_Addr addr)
+{
+  data_section key;
+  key.start = addr;
+  std::vector<data_section>::const_iterator it
+    = std::upper_bound (w->data_sections.begin (), w->data_sections.end (),
+			key, section_before);
+  if (it == w->data_sections.begin () || addr >= (--it)->end)
+    return NULL;
+  return it->name;
+}
+
+/* Size of the symbol at an (ELF) address, 0 if there is none. */
+static Dwarf_Word
+data_symbol_size (struct walker *w, GElf_Addr addr)
+{
+  GElf_Sym sym;
+  const char *name = dwfl_module_addrsym (w->data_module,
+					  addr + w->data_elf_bias, &sym, NULL);
+  if (name == NULL || sym.st_value != addr + w->data_elf_bias)
+    return 0;
+  return sym.st_size;
+}
+
+/* Accounts a variable if it lives at a fixed address: sized by its
+   type if that is complete, or else by its symbol. */
+static void
+handle_variable (struct walker *w, Dwarf_Die *die)
+{
+  Dwarf_Attribute attr_mem;
+  Dwarf_Op *expr;
+  size_t len;
+  Dwarf_Attribute *attr = dwarf_attr (die, DW_AT_location, &attr_mem);
+  if (attr == NULL || dwarf_getlocation (attr, &expr, &len) != 0
+      || len != 1 || expr[0].atom != DW_OP_addr)
+    return; // not static storage (or TLS, which has an offset)
+
+  GElf_Addr addr = expr[0].number + w->data_dwarf_bias - w->data_elf_bias;
+  const char *section = data_section_name (w, addr);
+  if (section == NULL)
+    return;
+
+  Dwarf_Word size = 0;
+  Dwarf_Die type_mem;
+  Dwarf_Die *type = dwarf_formref_die (dwarf_attr_integrate (die, DW_AT_type,
+							     &attr_mem),
+				       &type_mem);
+  if (type == NULL || dwarf_aggregate_size (type, &size) != 0 || size == 0)
+    size = data_symbol_size (w, addr);
+  if (size == 0)
+    return;
+
+  /* a definition outside its class has the name on the declaration it
+     is the DW_AT_specification of */
+  const char *name = dwarf_formstring (dwarf_attr_integrate (die, DW_AT_name,
+							      &attr_mem));
+  const char *file = path_canonical (w->paths, dwarf_decl_file (die));
+  register_data (w->space, section, file, name, addr, size);
+}
+
+/* Finds the variables of a CU: at the top, in namespaces and as
+   function statics. */
+static void
+walk_data (struct walker *w, Dwarf_Die *die)
+{
+  Dwarf_Die child;
+  if (dwarf_child (die, &child) != 0)
+    return;
+
+  do
+    {
+      switch (dwarf_tag (&child))
+	{
+	case DW_TAG_variable:
+	  handle_variable (w, &child);
+	  break;
+	case DW_TAG_namespace:
+	case DW_TAG_module:
+	case DW_TAG_subprogram:
+	case DW_TAG_lexical_block:
+	case DW_TAG_inlined_subroutine:
+	  walk_data (w, &child);
+	  break;
+	}
+    }
+  while (dwarf_siblingof (&child, &child) == 0);
+}
+
+static void
+output_cu_begin (struct what_info *what, struct where_info *where)
+{
+  output_die_begin (what, where, 2); // indent 2 (dwarfprofile + module).
+}
+
+static void
+output_cu_end (struct what_info *what, struct where_info *where,
+	       Dwarf_Word children_size)
+{
+  output_die_end (NULL, NULL, what, where, children_size, 2);
+}
+
+/* --lines: the line table of the CU, to split the code of functions
+   and files by source line when it gets swept. */
+static void
+walk_lines (struct walker *w, Dwarf_Die *cu)
+{
+  Dwarf_Lines *lines;
+  size_t nlines;
+  if (dwarf_getsrclines (cu, &lines, &nlines) != 0)
+    return;
+
+  const char *src = NULL;
+  const char *file = NULL;
+  for (size_t i = 0; i < nlines; i++)
+    {
+      Dwarf_Line *line = dwarf_onesrcline (lines, i);
+      Dwarf_Addr addr;
+      if (line == NULL || dwarf_lineaddr (line, &addr) != 0)
+	continue;
+
+      bool end_sequence = false;
+      dwarf_lineendsequence (line, &end_sequence);
+      if (end_sequence)
+	{
+	  register_line (w->space, addr, NULL, 0);
+	  continue;
+	}
+
+      /* Rows come in runs of the same file, look it up once per
+	 run. */
+      const char *s = dwarf_linesrc (line, NULL, NULL);
+      if (s != src)
+	{
+	  file = path_canonical (w->paths, s);
+	  src = s;
+	}
+      int lineno = 0;
+      dwarf_lineno (line, &lineno);
+      register_line (w->space, addr, file, lineno);
+    }
+}
+
+static const char *
+unit_comp_dir (Dwarf_Die *unit)
+{
+  Dwarf_Attribute attr;
+  return dwarf_formstring (dwarf_attr (unit, DW_AT_comp_dir, &attr));
+}
+
+/* Partial units (dwz, LTO) hold DIEs shared by the units that import
+   them (DW_TAG_imported_unit). Their code is walked once per module,
+   as a unit by itself, however many units import it: the tree goes by
+   address, so an import adds nothing of the importer's own, and
+   walking it again for each would only count its inlines and template
+   instances again. Those of the dwz alt file are not walked at all:
+   shared between objects, they have no addresses of any. */
+static void
+walk_partial_unit (struct walker *w, Dwarf_Die *unit)
+{
+  if (!w->partial_units.insert (unit->addr).second)
+    return;
+
+  Dwarf_Files *files = w->files;
+  if (dwarf_getsrcfiles (unit, &w->files, NULL) != 0)
+    w->files = NULL;
+  path_cache_set_dir (w->paths, unit_comp_dir (unit));
+
+  walk_children (w, unit, 3, NULL);
+  if (w->opts->data)
+    walk_data (w, unit);
+  if (w->opts->lines && !w->opts->callgrind)
+    walk_lines (w, unit);
+
+  w->files = files;
+}
+
+static void
+handle_cu (struct walker *w, Dwarf_Die *cu)
+{
+  if (dwarf_tag (cu) == DW_TAG_partial_unit)
+    {
+      walk_partial_unit (w, cu);
+      return;
+    }
+
+  /* Skip CUs without any code. */
+  Dwarf_Word size = DIE_code_size (w, cu);
+  const char *name = dwarf_diename (cu);
+
+  // XXX ehe, name == NULL, when does that happen?
+  if (size == 0 || name == NULL)
+    return;
+
+  /* Construct a (short) name and file to refer to this CU. */
+  const char *short_name = rindex (name, '/');
+  short_name = (short_name != NULL) ? short_name + 1 : name;
+
+  path_cache_set_dir (w->paths, unit_comp_dir (cu));
+
+  /* Compile Unit DIEs only really have where info, but construct a
+     what for consistency. */
+  struct where_info where;
+  struct what_info what;
+  where.tag = what.tag = dwarf_tag (cu);
+  where.die_off = what.die_off = dwarf_dieoffset (cu);
+  what.name = short_name;
+  where.file = what.file = path_canonical (w->paths, name);
+  where.line = what.line = 0;
+  where.col = what.col = 0;
+  what.instance = NULL;
+  where.size = size;
+
+  /* cache the file list for this CU. */
+  if (dwarf_getsrcfiles (cu, &w->files, NULL) != 0)
+    w->files = NULL; // There better not be any DW_AT_desc_files...
+
+  output_cu_begin (&what, &where);
+  Dwarf_Word children_size = walk_children (w, cu, 3, NULL); // indent 3 (dp/mod/cu)
+
+  output_cu_end (&what, &where, children_size);
+
+  if (w->opts->data)
+    walk_data (w, cu);
+
+  if (w->opts->lines && !w->opts->callgrind)
+    walk_lines (w, cu);
+}
+
+static void
+output_module_begin (const char *name)
+{
+  fprintf (stderr, "process '%s' ", name);
+}
+
+static void
+output_module_end (const char *name)
+{
+  fprintf (stderr, "... done\n");
+}
+
+/* Returns a string identifying the code of a module: its build-id
+   in hex if it has one, otherwise its name. To be freed by caller. */
+static char *
+module_key (Dwfl_Module *mod, const char *name)
+{
+  const unsigned char *bits;
+  GElf_Addr vaddr;
+  int len = dwfl_module_build_id (mod, &bits, &vaddr);
+  if (len <= 0)
+    return strdup (name);
+
+  char *key = (char *)malloc (2 * len + 1);
+  for (int i = 0; i < len; i++)
+    sprintf (key + 2 * i, "%02x", bits[i]);
+  return key;
+}
+
+/* Picks the samples that fall into this module for its sweep. They
+   are addresses in the space of the Dwfl (the process for -p, the
+   file for -e), the sweep has them relative to the DWARF. */
+static void
+module_samples (struct walker *w, Dwfl_Module *mod, const char *name)
+{
+  Dwarf_Addr low, high, bias;
+  dwfl_module_info (mod, NULL, &low, &high, NULL, NULL, NULL, NULL);
+  if (dwfl_module_getdwarf (mod, &bias) != NULL)
+    select_samples (w->space, w->ctx->mpSamples, name, low, high, bias);
+}
+
+/* Points the DWARF of a module at its dwz alt file, if it has one,
+   before anything refers to it; and forgets what was cached of the
+   DIEs of the module before. */
+static void
+module_begin_dwarf (struct walker *w, Dwfl_Module *mod)
+{
+  w->partial_units.clear ();
+  w->origins.clear ();
+
+  Dwarf_Addr bias;
+  Dwarf *dw = dwfl_module_getdwarf (mod, &bias);
+  if (dw == NULL)
+    return;
+  const char *debugfile = NULL;
+  dwfl_module_info (mod, NULL, NULL, NULL, NULL, NULL, NULL, &debugfile);
+  alt_files_attach (w->alts, dw, debugfile);
+}
+
+/* Starts reading the debug sections of a module ahead of the walk,
+   unless --no-readahead, and timing the waiting for them. */
+static ModuleIO *
+module_io (struct walker *w, Dwfl_Module *mod)
+{
+  Dwarf_Addr bias;
+  Dwarf *dw = dwfl_module_getdwarf (mod, &bias);
+  if (dw == NULL)
+    return NULL;
+  const char *mainfile = NULL, *debugfile = NULL;
+  dwfl_module_info (mod, NULL, NULL, NULL, NULL, NULL, &mainfile, &debugfile);
+  return module_io_begin (dw, debugfile ? debugfile : mainfile,
+			  w->opts->readahead);
+}
+
+/* Streaming: for each CU of a module, in walk order, the lowest
+   address it or any CU after it can register. Once a CU is done,
+   everything below that of the next one is final and can be swept
+   into the tree, so that only about a CU's worth of records is held
+   at a time. CUs are mostly disjoint and in address order, but a CU
+   with just a low_pc may have children anywhere: it holds everything
+   back until it has been walked. */
+static void
+cu_lows (Dwfl_Module *mod, std::vector<Dwarf_Addr> &lows)
+{
+  Dwarf_Die *cu = NULL;
+  Dwarf_Addr bias;
+  while ((cu = dwfl_module_nextcu (mod, cu, &bias)) != NULL)
+    {
+      Dwarf_Addr base, begin, end;
+      Dwarf_Addr low = (Dwarf_Addr) -1;
+      ptrdiff_t off = 0;
+      while ((off = dwarf_ranges (cu, off, &base, &begin, &end)) > 0)
+	low = std::min (low, begin);
+      if (low == (Dwarf_Addr) -1 && (dwarf_hasattr (cu, DW_AT_entry_pc)
+				     || dwarf_hasattr (cu, DW_AT_low_pc)))
+	low = 0;
+      lows.push_back (low);
+    }
+  for (size_t i = lows.size (); i-- > 1; )
+    lows[i - 1] = std::min (lows[i - 1], lows[i]);
+}
+
+/* A walk over the modules of a Dwfl, and how many it analysed. */
+struct module_walk
+{
+  struct walker *w;
+  int analysed;
+};
+
+static int
+handle_module (Dwfl_Module *mod, void **userdata, const char *name,
+	       Dwarf_Addr base, void *arg)
+{
+  struct module_walk *walk = (struct module_walk *)arg;
+  struct walker *w = walk->w;
+  Dwarf_Die *cu = NULL;
+  Dwarf_Addr bias;
+
+  /* For the tree every module gets swept into a tree of its own,
+     callgrind output keeps sweeping the whole space at the end. */
+  bool per_module = !w->opts->callgrind;
+  char *key = per_module ? module_key (mod, name) : NULL;
+  if (key && fs_module_seen (w->ctx, key))
+    {
+      free (key);
+      return DWARF_CB_OK;
+    }
+
+  output_module_begin (name);
+  ModuleIO *io = module_io (w, mod);
+  module_begin_dwarf (w, mod);
+  gap_symbols_load (w->space, mod);
+  if (w->ctx->mpSamples && key)
+    module_samples (w, mod, name);
+  if (w->opts->data)
+    data_begin_module (w, mod);
+  /* Partial units first: whoever imports them, their code is then in
+     the space before any of it can be swept (cf. cu_lows). */
+  while ((cu = dwfl_module_nextcu (mod, cu, &bias)) != NULL)
+    if (dwarf_tag (cu) == DW_TAG_partial_unit)
+      walk_partial_unit (w, cu);
+
+  std::vector<Dwarf_Addr> lows;
+  if (key && w->opts->stream)
+    cu_lows (mod, lows);
+  size_t n = 0;
+  while ((cu = dwfl_module_nextcu (mod, cu, &bias)) != NULL)
+    {
+      handle_cu (w, cu);
+      if (++n < lows.size ())
+	flush_addresses_below (w->space, lows[n]);
+    }
+  if (key)
+    fs_add_module (w->ctx, key, scan_addresses_to_module_tree (w->space));
+  module_io_end (io, name);
+  output_module_end (name);
+
+  walk->analysed++;
+  free (key);
+
+  return DWARF_CB_OK;
+}
+
+/* An address space with its names in the context, swept as the
+   options say. */
+static address_space *
+context_space_new (dwarfprofile_context *ctx)
+{
+  address_space *space = address_space_new (&ctx->maNames);
+  address_space_sweep_kernel (space, ctx->maOptions.sweep_kernel);
+  return space;
+}
+
+int
+dwarfprofile_analyse_dwfl (dwarfprofile_context *ctx, Dwfl *dwfl)
+{
+  /* Callgrind output keeps everything in the context's space, the
+     tree sweeps each module out of a space of the walk. */
+  address_space *space = ctx->mpSpace ? ctx->mpSpace
+				      : context_space_new (ctx);
+  if (space != ctx->mpSpace)
+    address_space_tree_jobs (space, ctx->maOptions.tree_jobs);
+  struct walker w (ctx, space);
+  struct module_walk walk = { &w, 0 };
+
+  ptrdiff_t res = dwfl_getmodules (dwfl, handle_module, &walk, 0);
+  if (space != ctx->mpSpace)
+    address_space_free (space);
+  if (res != 0) // We should handle all modules, anything else is an error
+    {
+      fprintf (stderr, "dwfl_getmodules failed: %s\n", dwfl_errmsg (-1));
+      return -1;
+    }
+  return walk.analysed;
+}
+
+static const Dwfl_Callbacks offline_callbacks =
+  {
+    .find_elf = dwfl_build_id_find_elf,
+    .find_debuginfo = dwfl_standard_find_debuginfo,
+    .section_address = dwfl_offline_section_address,
+  };
+
+/* Opens an object on its own, for use by one thread only. Returns
+   NULL if there is no DWARF for it. */
+static Dwarf *
+open_offline (const char *path, Dwfl **dwflp, Dwfl_Module **modp)
+{
+  Dwfl *dwfl = dwfl_begin (&offline_callbacks);
+  if (dwfl == NULL)
+    return NULL;
+
+  Dwfl_Module *mod = dwfl_report_offline (dwfl, path, path, -1);
+  dwfl_report_end (dwfl, NULL, NULL);
+
+  Dwarf_Addr bias;
+  Dwarf *dw = mod ? dwfl_module_getdwarf (mod, &bias) : NULL;
+  if (dw == NULL)
+    {
+      dwfl_end (dwfl);
+      return NULL;
+    }
+  *dwflp = dwfl;
+  *modp = mod;
+  return dw;
+}
+
+int
+dwarfprofile_analyse_file (dwarfprofile_context *ctx, const char *path)
+{
+  Dwfl *dwfl;
+  Dwfl_Module *mod;
+  if (open_offline (path, &dwfl, &mod) == NULL)
+    {
+      fprintf (stderr, "no DWARF for '%s'\n", path);
+      return -1;
+    }
+  int analysed = dwarfprofile_analyse_dwfl (ctx, dwfl);
+  dwfl_end (dwfl);
+  return analysed;
+}
+
+/* Analyses a process with a Dwfl of its own. Modules are keyed by
+   build-id, so a library mapped by many processes is only analysed
+   for the first of them; the others just refer to it. */
+int
+dwarfprofile_analyse_process (dwarfprofile_context *ctx, pid_t pid,
+			      const char *name)
+{
+  static const Dwfl_Callbacks proc_callbacks =
+    {
+      .find_elf = dwfl_linux_proc_find_elf,
+      .find_debuginfo = dwfl_standard_find_debuginfo,
+    };
+
+  Dwfl *dwfl = dwfl_begin (&proc_callbacks);
+  if (dwfl == NULL)
+    return -1;
+
+  dwfl_report_begin (dwfl);
+  int err = dwfl_linux_proc_report (dwfl, pid);
+  if (dwfl_report_end (dwfl, NULL, NULL) != 0 || err != 0)
+    {
+      dwfl_end (dwfl);
+      return -1;
+    }
+
+  fs_begin_process (ctx, pid, name);
+  int analysed = dwarfprofile_analyse_dwfl (ctx, dwfl);
+  dwfl_end (dwfl);
+  return analysed;
+}
+
+int
+dwarfprofile_refresh (dwarfprofile_context *ctx, Dwfl *dwfl, int *dropped)
+{
+  pid_t pid = dwfl_pid (dwfl);
+  if (pid <= 0)
+    return -1;
+
+  dwfl_report_begin (dwfl);
+  int err = dwfl_linux_proc_report (dwfl, pid);
+  if (dwfl_report_end (dwfl, NULL, NULL) != 0 || err != 0)
+    return -1;
+
+  fs_begin_modules (ctx);
+  int analysed = dwarfprofile_analyse_dwfl (ctx, dwfl);
+  if (analysed < 0)
+    return -1;
+  *dropped = fs_drop_unseen_modules (ctx);
+  return analysed;
+}
+
+/* Batch mode. Every object is split into chunks of CUs, each chunk
+   a task on a work-stealing pool, so one huge library is spread over
+   all the workers instead of being the tail of the run. libdw handles
+   are not shared between threads: each chunk opens the object itself
+   and builds its own address space. The last chunk to finish merges
+   the spaces, in chunk order, and sweeps them into the object's tree. */
+
+// Objects with more CUs than this get split.
+#define BATCH_CHUNK_CUS 64
+
+struct batch_object
+{
+  char *path;
+  const char *name;			// its node: the basename
+  std::vector<Dwarf_Off> cus;		// CU DIE offsets
+  std::vector<address_space *> spaces;	// one per chunk
+  std::atomic<size_t> remaining;	// chunks not done yet
+  off_t size;
+  std::vector<struct walker *> *walkers; // one per worker
+  ModuleIO *io;				// reading it ahead
+};
+
+struct batch_chunk : public WorkPool::Task
+{
+  batch_object *object;
+  size_t chunk;
+  size_t first, last;
+  Dwfl *dwfl;				// already open for chunk 0
+  Dwfl_Module *mod;
+  Dwarf *dw;
+
+  batch_chunk (batch_object *o, size_t c, size_t f, size_t l)
+    : object (o), chunk (c), first (f), last (l),
+      dwfl (NULL), mod (NULL), dw (NULL) {}
+
+  virtual void run (WorkPool &pool, int worker);
+};
+
+static void
+batch_finish (struct walker *w, batch_object *object, Dwfl_Module *mod)
+{
+  address_space *space = context_space_new (w->ctx);
+  for (size_t i = 0; i < object->spaces.size (); i++)
+    merge_address_space (space, object->spaces[i]);
+  if (mod != NULL)
+    {
+      gap_symbols_load (space, mod);
+      if (w->ctx->mpSamples)
+	{
+	  w->space = space;
+	  module_samples (w, mod, object->name);
+	  w->space = NULL;
+	}
+    }
+  fs_add_object (w->ctx, object->name, scan_addresses_to_module_tree (space));
+  address_space_free (space);
+  module_io_end (object->io, NULL);
+
+  fprintf (stderr, "* %s: %lu CUs in %lu chunk(s) ... done\n", object->name,
+	   (unsigned long)object->cus.size (),
+	   (unsigned long)object->spaces.size ());
+  free (object->path);
+  delete object;
+}
+
+void
+batch_chunk::run (WorkPool &pool, int worker)
+{
+  struct walker *w = (*object->walkers)[worker];
+  w->space = context_space_new (w->ctx);
+  if (dw == NULL)
+    dw = open_offline (object->path, &dwfl, &mod);
+  if (dw != NULL)
+    {
+      module_begin_dwarf (w, mod);
+      if (w->opts->data)
+	data_begin_module (w, mod);
+      for (size_t i = first; i < last; i++)
+	{
+	  Dwarf_Die cu;
+	  if (dwarf_offdie (dw, object->cus[i], &cu) != NULL)
+	    handle_cu (w, &cu);
+	}
+    }
+  object->spaces[chunk] = w->space;
+  w->space = NULL;
+
+  // The last one sweeps, with our module to name the gaps.
+  if (--object->remaining == 0)
+    batch_finish (w, object, mod);
+  if (dw != NULL)
+    dwfl_end (dwfl);
+}
+
+/* Finds the CUs of an object, queues all but the first chunk of them
+   for whoever is free and gets going on the first one. */
+struct batch_scan : public WorkPool::Task
+{
+  batch_object *object;
+
+  batch_scan (batch_object *o) : object (o) {}
+
+  virtual void
+  run (WorkPool &pool, int worker)
+  {
+    Dwfl *dwfl;
+    Dwfl_Module *mod;
+    Dwarf *dw = open_offline (object->path, &dwfl, &mod);
+    if (dw != NULL)
+      {
+	Dwarf_Off off = 0, next;
+	size_t header_size;
+	while (dwarf_nextcu (dw, off, &next, &header_size,
+			     NULL, NULL, NULL) == 0)
+	  {
+	    object->cus.push_back (off + header_size);
+	    off = next;
+	  }
+      }
+    if (dw == NULL || object->cus.empty ())
+      {
+	fprintf (stderr, "* %s: no DWARF, skipped\n", object->name);
+	if (dw != NULL)
+	  dwfl_end (dwfl);
+	free (object->path);
+	delete object;
+	return;
+      }
+
+    /* Read ahead for all the chunks, until the last one is done; the
+       timing would only be this thread's, so it goes unreported. */
+    object->io = module_io ((*object->walkers)[worker], mod);
+
+    size_t chunks = (object->cus.size () + BATCH_CHUNK_CUS - 1)
+		    / BATCH_CHUNK_CUS;
+    object->spaces.resize (chunks, NULL);
+    object->remaining = chunks;
+    for (size_t i = 1; i < chunks; i++)
+      pool.push (new batch_chunk (object, i, i * BATCH_CHUNK_CUS,
+				  std::min ((i + 1) * BATCH_CHUNK_CUS,
+					    object->cus.size ())),
+		 worker);
+
+    batch_chunk first (object, 0, 0,
+		       std::min ((size_t)BATCH_CHUNK_CUS, object->cus.size ()));
+    first.dwfl = dwfl;
+    first.mod = mod;
+    first.dw = dw;
+    first.run (pool, worker);
+  }
+};
+
+static bool
+is_elf_file (const char *path, off_t *size)
+{
+  struct stat st;
+  if (stat (path, &st) != 0 || !S_ISREG (st.st_mode))
+    return false;
+  *size = st.st_size;
+
+  char magic[4];
+  int fd = open (path, O_RDONLY);
+  if (fd < 0)
+    return false;
+  bool elf = (read (fd, magic, 4) == 4 && !memcmp (magic, "\177ELF", 4));
+  close (fd);
+  return elf;
+}
+
+static bool
+smaller_object (const batch_object *a, const batch_object *b)
+{
+  return a->size < b->size;
+}
+
+bool
+dwarfprofile_analyse_batch (dwarfprofile_context *ctx,
+			    const std::vector<const char *> &paths, int jobs)
+{
+  std::vector<batch_object *> objects;
+  std::vector<struct walker *> walkers;
+
+  for (size_t i = 0; i < paths.size (); i++)
+    {
+      off_t size;
+      if (!is_elf_file (paths[i], &size))
+	continue;
+      batch_object *object = new batch_object;
+      object->path = strdup (paths[i]);
+      const char *slash = strrchr (object->path, '/');
+      object->name = slash ? slash + 1 : object->path;
+      object->size = size;
+      object->remaining = 0;
+      object->walkers = &walkers;
+      object->io = NULL;
+      objects.push_back (object);
+    }
+  if (objects.empty ())
+    return false;
+
+  WorkPool pool (jobs > 0 ? jobs : (int)std::thread::hardware_concurrency ());
+  for (int i = 0; i < pool.workers (); i++)
+    {
+      // libdw handles are not shared between threads, alt files neither
+      walkers.push_back (new walker (ctx, NULL));
+      walkers.back ()->alts = alt_files_new ();
+    }
+  fprintf (stderr, "* %lu objects on %d workers\n",
+	   (unsigned long)objects.size (), pool.workers ());
+
+  /* Dealt out smallest first, so that each worker starts with the
+     biggest object of its share (owners pop from the back). */
+  std::sort (objects.begin (), objects.end (), smaller_object);
+  for (size_t i = 0; i < objects.size (); i++)
+    pool.push (new batch_scan (objects[i]), i);
+  pool.run ();
+
+  for (size_t i = 0; i < walkers.size (); i++)
+    {
+      alt_files_free (walkers[i]->alts);
+      delete walkers[i];
+    }
+  return true;
+}
+
+void
+dwarfprofile_init_options (struct dwarfprofile_options *opts)
+{
+  memset (opts, 0, sizeof (*opts));
+  opts->single_address_size = 1;
+  opts->stream = true;
+  opts->tree_jobs = 1;
+  opts->readahead = true;
+}
+
+dwarfprofile_context *
+dwarfprofile_begin (const struct dwarfprofile_options *opts)
+{
+  dwarfprofile_context *ctx = new dwarfprofile_context;
+  ctx->maOptions = *opts;
+  ctx->mpRoot = new FileSystemNode (&ctx->maNames);
+  ctx->mpSpace = opts->callgrind ? context_space_new (ctx) : NULL;
+  ctx->mpInlines = opts->inlines ? inline_report_new () : NULL;
+  ctx->mpTemplates = opts->group_templates ? template_report_new () : NULL;
+  ctx->mpSamples = NULL;
+  ctx->mpAltFiles = alt_files_new ();
+  ctx->mpServed = NULL;
+  return ctx;
+}
+
+void
+dwarfprofile_end (dwarfprofile_context *ctx)
+{
+  // The module trees were merged into the root, and stay separate.
+  for (ModuleMap::iterator it = ctx->maModules.begin ();
+       it != ctx->maModules.end (); ++it)
+    it->second.mpTree->deleteTree ();
+  ctx->mpRoot->deleteTree ();
+  address_space_free (ctx->mpSpace);
+  inline_report_free (ctx->mpInlines);
+  template_report_free (ctx->mpTemplates);
+  samples_free (ctx->mpSamples);
+  alt_files_free (ctx->mpAltFiles);
+  served_trees_free (ctx->mpServed);
+  delete ctx;
+}
+
+bool
+dwarfprofile_add_prefix_map (dwarfprofile_context *ctx, const char *mapping)
+{
+  return prefix_map_add (ctx->maPrefixMap, mapping);
+}
+
+bool
+dwarfprofile_load_samples (dwarfprofile_context *ctx, const char *path)
+{
+  sample_set *samples = samples_load (path);
+  if (samples == NULL)
+    return false;
+  samples_free (ctx->mpSamples);
+  ctx->mpSamples = samples;
+  return true;
+}
+
+FileSystemNode *
+dwarfprofile_tree (dwarfprofile_context *ctx)
+{
+  return ctx->mpRoot;
+}
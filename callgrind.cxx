@@ -0,0 +1,173 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Callgrind output from the address space, see:
+ *     http://valgrind.org/docs/manual/cl-format.html
+ */
+
+#include <vector>
+#include <utility>
+#include <boost/unordered_map.hpp>
+#include <string.h>
+#include <logging.hxx>
+#include <output.hxx>
+#include <context.hxx>
+
+/*
+ * Writes spans as callgrind cost lines using name compression: the
+ * first use of a file or function writes "fl=(id) name", later uses
+ * just "fl=(id)". Names are interned by the address space, so the
+ * pointer is enough to find the id.
+ */
+class CallgrindSink : public address_sink {
+    typedef boost::unordered_map< const char *, unsigned > IdMap;
+    typedef std::pair< unsigned, unsigned > FileFunc;
+
+    FILE        *mpFile;
+    OutputBuffer maOut;
+    bool         mbCalltree;
+
+    IdMap        maFileIds;
+    IdMap        maFuncIds;
+    unsigned     mnCurFile;
+    unsigned     mnCurFunc;
+
+    // pending cost line, merged while file/func/line stay the same
+    int          mnLine;
+    size_t       mnCost;
+
+    // calltree: inclusive size per file/func in first-seen order
+    boost::unordered_map< FileFunc, size_t > maTotalIdx;
+    std::vector< std::pair< FileFunc, size_t > > maTotals;
+
+    // Emits "key=(id)" plus the name on first use; returns the id.
+    unsigned compressed (const char *pKey, IdMap &rIds,
+                         const char *pName, const char *pDisplay)
+    {
+        IdMap::iterator it = rIds.find (pName);
+        bool bNew = it == rIds.end();
+        unsigned nId = bNew ? rIds.size() + 1 : it->second;
+        if (bNew)
+            rIds[pName] = nId;
+
+        maOut.append (pKey);
+        maOut.append ("=(");
+        maOut.appendNumber (nId);
+        maOut.append (')');
+        if (bNew)
+        {
+            maOut.append (' ');
+            maOut.append (pDisplay);
+        }
+        maOut.append ('\n');
+        return nId;
+    }
+
+    void flushCost ()
+    {
+        if (mnCost == 0)
+            return;
+        maOut.appendNumber (mnLine);
+        maOut.append (' ');
+        maOut.appendNumber (mnCost);
+        maOut.append ('\n');
+        mnCost = 0;
+        if (maOut.size() > (1 << 20))
+            maOut.write (mpFile);
+    }
+
+  public:
+    CallgrindSink (FILE *pFile, bool bCalltree)
+        : mpFile (pFile), mbCalltree (bCalltree),
+          mnCurFile (0), mnCurFunc (0), mnLine (0), mnCost (0)
+    {
+        maOut.append ("version: 1\ncreator: dwarfprofile\n"
+                      "positions: line\nevents: Bytes\n\n");
+    }
+
+    virtual void span (const char *file, const char *func, int line, int col,
+                       Dwarf_Addr start, size_t size)
+    {
+        if (!func)
+            func = "";
+
+        IdMap::iterator itFile = maFileIds.find (file);
+        IdMap::iterator itFunc = maFuncIds.find (func);
+        if (itFile == maFileIds.end() || itFile->second != mnCurFile ||
+            itFunc == maFuncIds.end() || itFunc->second != mnCurFunc)
+        {
+            flushCost ();
+            if (itFile == maFileIds.end() || itFile->second != mnCurFile)
+            {
+                mnCurFile = compressed ("fl", maFileIds, file, file);
+                mnCurFunc = 0; // callgrind wants fn= after each fl=
+            }
+            if (itFunc == maFuncIds.end() || itFunc->second != mnCurFunc)
+            {
+                // KCachegrind treats 'main' as the root of everything.
+                bool bMain = mbCalltree && !strcmp (func, "main");
+                mnCurFunc = compressed ("fn", maFuncIds, func,
+                                        bMain ? "__main__" : func);
+            }
+        }
+        else if (line != mnLine)
+            flushCost ();
+
+        mnLine = line;
+        mnCost += size;
+
+        if (mbCalltree)
+        {
+            FileFunc aKey (mnCurFile, mnCurFunc);
+            boost::unordered_map< FileFunc, size_t >::iterator it;
+            it = maTotalIdx.find (aKey);
+            if (it == maTotalIdx.end())
+            {
+                maTotalIdx[aKey] = maTotals.size();
+                maTotals.push_back (std::make_pair (aKey, size));
+            }
+            else
+                maTotals[it->second].second += size;
+        }
+    }
+
+    void finish ()
+    {
+        flushCost ();
+
+        if (mbCalltree)
+        {
+            // A pseudo main that calls every function once.
+            static const char *pWrapper = "outer-wrapper";
+            static const char *pMain = "main";
+            compressed ("fl", maFileIds, pWrapper, pWrapper);
+            compressed ("fn", maFuncIds, pMain, pMain);
+            for (size_t i = 0; i < maTotals.size(); i++)
+            {
+                maOut.append ("cfl=(");
+                maOut.appendNumber (maTotals[i].first.first);
+                maOut.append (")\ncfn=(");
+                maOut.appendNumber (maTotals[i].first.second);
+                maOut.append (")\ncalls=1 0\n0 ");
+                maOut.appendNumber (maTotals[i].second);
+                maOut.append ('\n');
+            }
+        }
+        maOut.write (mpFile);
+        fflush (mpFile);
+    }
+};
+
+void write_callgrind (dwarfprofile_context *ctx, FILE *out, bool calltree)
+{
+    if (!ctx->mpSpace)
+        return; // not analysed for callgrind (cf. dwarfprofile_options)
+    CallgrindSink aSink (out, calltree);
+    scan_addresses (ctx->mpSpace, &aSink);
+    aSink.finish ();
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,65 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef DWARFPROFILE_CONTEXT_HXX
+#define DWARFPROFILE_CONTEXT_HXX
+
+#include <vector>
+#include <string>
+#include <mutex>
+#include <boost/unordered_map.hpp>
+#include <dwarfprofile.hxx>
+#include <logging.hxx>
+#include <fstree.hxx>
+
+/*
+ * The tree of every module analysed so far, by module key (cf.
+ * module_key), so that modules can be taken out again when they go
+ * away and are not analysed twice.
+ */
+struct ModuleTree {
+    FileSystemNode *mpTree;
+    bool            mbSeen;
+};
+typedef boost::unordered_map< std::string, ModuleTree > ModuleMap;
+
+/*
+ * When analysing several processes, the modules each one maps. The
+ * module trees themselves are shared: the main tree has every
+ * distinct module once, and per process numbers are summed up from
+ * the module trees.
+ */
+struct ProcessModules {
+    int                        mnPid;
+    std::string                maName;
+    std::vector< std::string > maKeys;
+};
+
+/*
+ * One analysis: how it was asked for and all it has found. Batch
+ * workers share the context of their batch, but only touch it through
+ * fs_add_object and the reports, which lock.
+ */
+struct dwarfprofile_context {
+    dwarfprofile_options          maOptions;
+    NamePool                      maNames;     // of all the trees
+    FileSystemNode               *mpRoot;
+    ModuleMap                     maModules;
+    std::vector< ProcessModules > maProcesses;
+    std::mutex                    maObjectsMutex;
+    address_space                *mpSpace;     // callgrind: everything, unswept
+    InlineReport                 *mpInlines;   // or NULL
+    TemplateReport               *mpTemplates; // or NULL
+    sample_set                   *mpSamples;   // or NULL
+    PrefixMap                     maPrefixMap; // --prefix-map
+    AltFiles                     *mpAltFiles;  // shared by the modules
+    ServedTrees                  *mpServed;    // or NULL
+};
+
+#endif // DWARFPROFILE_CONTEXT_HXX
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
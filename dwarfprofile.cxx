@@ -11,17 +11,17 @@
 
 #include <argp.h>
 #include <error.h>
-#include <inttypes.h>
+#include <errno.h>
+#include <ctype.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
 
-#include <logging.hxx>
-
-// Older versions of elfutils/libdw dwarf.h don't define this one.
-#ifndef DW_TAG_GNU_call_site
-#define DW_TAG_GNU_call_site 0x4109
-#endif
+#include <dwarfprofile.hxx>
 
 // Are we generating a Flat Calltree Profile Format
 static bool generate_fcpf = false;
@@ -32,42 +32,96 @@ static bool generate_cpf = false;
 // Are we generating a XML
 static bool generate_xml = false;
 
-// Ignore DIEs without a name (e.g. lexical blocks)
-static bool ignore_no_name = false;
+// What to analyse, handed to the context.
+static struct dwarfprofile_options analysis;
+
+// Profile samples to map onto the tree (--samples).
+static const char *samples_file = NULL;
 
-// Size used for single address DIEs
-static int single_address_size = 1;
+// OLD=NEW path prefixes to rewrite (--prefix-map), in order.
+static std::vector<const char *> prefix_maps;
 
 // For debugging in flat output show DIE offsets.
 static bool show_die_offset = false;
 
-// File strings cache for the current CU.
-static Dwarf_Files *files;
+// Seconds between re-reading the modules of a process, 0 for once.
+static unsigned watch_interval = 0;
+
+// Processes to analyse together (--pids, --all-processes).
+static std::vector<pid_t> pids;
+static bool all_processes = false;
+
+// Directory or list file of objects for --batch, and worker threads.
+static const char *batch_source = NULL;
+static int batch_jobs = 0;
+
+// What to report and how, handed to dump_results.
+static struct report_options report;
+
+// Keys for options that only have a long form.
+enum
+  {
+    OPT_DEPTHS = 0x100,
+    OPT_PPROF,
+    OPT_TREEMAP,
+    OPT_SAVE,
+    OPT_PATH,
+    OPT_DEPTH,
+    OPT_TOP,
+    OPT_SERVE,
+    OPT_MIN_SIZE,
+    OPT_MIN_PERCENT,
+    OPT_WATCH,
+    OPT_PIDS,
+    OPT_ALL_PROCESSES,
+    OPT_BATCH,
+    OPT_JOBS,
+    OPT_INLINES,
+    OPT_GROUP_TEMPLATES,
+    OPT_DATA,
+    OPT_SAMPLES,
+    OPT_NO_STREAM,
+    OPT_LINES,
+    OPT_PREFIX_MAP,
+    OPT_TREE_JOBS,
+    OPT_SWEEP_KERNEL,
+    OPT_NO_READAHEAD,
+  };
 
 static struct argp argp;
 
-static char *
-escape_name(const char *fname)
+/* Parses a comma separated list of breakdown depths into the report
+   options. Returns false if the list is malformed. */
+static bool
+parse_depths (const char *arg)
 {
-  int i;
-  char *escaped;
-  if (!fname)
-    return NULL;
-
-  // We have a pseudo-main that contains all the data
-  if (!strcmp(fname, "main"))
-    return strdup ("__main__");
-
-  escaped = (char *)malloc(strlen(fname) + 1);
-  for (i = 0; fname[i]; i++)
+  report.depths.clear ();
+  while (*arg)
     {
-      if (fname[i] != '<' && fname[i] != '>' && fname[i] != '&')
-	escaped[i] = fname[i];
-      else
-	escaped[i] = '_';
+      char *end;
+      long depth = strtol (arg, &end, 10);
+      if (end == arg || depth < 0 || (*end != ',' && *end != '\0'))
+	return false;
+      report.depths.push_back ((int)depth);
+      arg = (*end == ',') ? end + 1 : end;
     }
-  escaped[i] = '\0';
-  return escaped;
+  return !report.depths.empty ();
+}
+
+/* Parses a byte size or entry count. Returns false unless all of arg
+   is a number that fits. */
+static bool
+parse_count (const char *arg, size_t *count)
+{
+  char *end;
+  if (!isdigit ((unsigned char)*arg))
+    return false;
+  errno = 0;
+  unsigned long long n = strtoull (arg, &end, 10);
+  if (*end != '\0' || errno == ERANGE || n != (size_t)n)
+    return false;
+  *count = (size_t)n;
+  return true;
 }
 
 static error_t
@@ -77,30 +131,147 @@ parse_opt (int key, char *arg, struct argp_state *state)
     {
     case ARGP_KEY_INIT:
       /* dwfl_standard_argp needs a Dwfl pointer to fill in. */
-      state->child_inputs[0] = state->input;
+      if (state->root_argp->children)
+	state->child_inputs[0] = state->input;
       break;
     case 'f':
       generate_fcpf = true;
-      ignore_no_name = true;
-      single_address_size = 0;
+      analysis.ignore_no_name = true;
+      analysis.single_address_size = 0;
       break;
     case 'c':
       generate_cpf = true;
-      ignore_no_name = true;
-      single_address_size = 0;
+      analysis.ignore_no_name = true;
+      analysis.single_address_size = 0;
       break;
     case 'x':
       generate_xml = true;
       break;
     case 'i':
-      ignore_no_name = true;
+      analysis.ignore_no_name = true;
       break;
     case 's':
-      single_address_size = atoi (arg);
+      analysis.single_address_size = atoi (arg);
       break;
     case 'd':
       show_die_offset = true;
       break;
+    case OPT_DEPTHS:
+      if (!parse_depths (arg))
+	argp_error (state, "invalid depth list '%s'", arg);
+      break;
+    case OPT_PPROF:
+      report.pprof_file = arg;
+      break;
+    case OPT_TREEMAP:
+      report.treemap_file = arg;
+      break;
+    case OPT_SAVE:
+      report.save_file = arg;
+      break;
+    case OPT_SERVE:
+      report.serve_socket = arg;
+      break;
+    case OPT_TOP:
+      if (!parse_count (arg, &report.top))
+	argp_error (state, "invalid number of entries '%s'", arg);
+      break;
+    case OPT_MIN_SIZE:
+      if (!parse_count (arg, &report.min_size))
+	argp_error (state, "invalid size '%s'", arg);
+      break;
+    case OPT_MIN_PERCENT:
+      {
+	char *end;
+	errno = 0;
+	report.min_percent = strtod (arg, &end);
+	if (end == arg || *end != '\0' || errno == ERANGE
+	    || !(report.min_percent >= 0 && report.min_percent <= 100))
+	  argp_error (state, "invalid percentage '%s'", arg);
+      }
+      break;
+    case OPT_PIDS:
+      for (char *p = arg; *p; )
+	{
+	  char *end;
+	  long pid = strtol (p, &end, 10);
+	  if (end == p || pid <= 0 || (*end != ',' && *end != '\0'))
+	    argp_error (state, "invalid pid list '%s'", arg);
+	  pids.push_back ((pid_t)pid);
+	  p = (*end == ',') ? end + 1 : end;
+	}
+      break;
+    case OPT_ALL_PROCESSES:
+      all_processes = true;
+      break;
+    case OPT_BATCH:
+      batch_source = arg;
+      break;
+    case OPT_JOBS:
+      batch_jobs = atoi (arg);
+      if (batch_jobs <= 0)
+	argp_error (state, "invalid number of jobs '%s'", arg);
+      break;
+    case OPT_INLINES:
+      analysis.inlines = report.inlines = true;
+      report.inlines_top = 50;
+      if (arg && !parse_count (arg, &report.inlines_top))
+	argp_error (state, "invalid number of entries '%s'", arg);
+      break;
+    case OPT_GROUP_TEMPLATES:
+      analysis.group_templates = report.templates = true;
+      report.templates_top = 50;
+      if (arg && !parse_count (arg, &report.templates_top))
+	argp_error (state, "invalid number of entries '%s'", arg);
+      break;
+    case OPT_DATA:
+      analysis.data = true;
+      break;
+    case OPT_SAMPLES:
+      samples_file = arg;
+      report.samples = true;
+      break;
+    case OPT_LINES:
+      analysis.lines = report.lines = true;
+      report.lines_top = 20;
+      if (arg && !parse_count (arg, &report.lines_top))
+	argp_error (state, "invalid number of entries '%s'", arg);
+      break;
+    case OPT_NO_STREAM:
+      analysis.stream = false;
+      break;
+    case OPT_NO_READAHEAD:
+      analysis.readahead = false;
+      break;
+    case OPT_TREE_JOBS:
+      {
+	size_t jobs = 0;  // one per CPU
+	if (arg && (!parse_count (arg, &jobs) || jobs == 0
+		    || jobs > INT_MAX))
+	  argp_error (state, "invalid number of tree jobs '%s'", arg);
+	analysis.tree_jobs = jobs;
+      }
+      break;
+    case OPT_SWEEP_KERNEL:
+      if (!dwarfprofile_sweep_kernel_ok (arg))
+	argp_error (state, "unknown sweep kernel '%s', or not for this CPU",
+		    arg);
+      analysis.sweep_kernel = arg;
+      break;
+    case OPT_PREFIX_MAP:
+      if (strchr (arg, '=') == NULL || arg[0] == '=')
+	argp_error (state, "invalid prefix map '%s', want OLD=NEW", arg);
+      prefix_maps.push_back (arg);
+      break;
+    case OPT_WATCH:
+      {
+	size_t interval = 5;
+	if (arg && (!parse_count (arg, &interval) || interval == 0
+		    || interval != (unsigned)interval))
+	  argp_error (state, "invalid watch interval '%s'", arg);
+	watch_interval = interval;
+      }
+      break;
     case ARGP_KEY_FINI:
       if (generate_cpf + generate_xml + generate_fcpf > 1)
 	{
@@ -109,475 +280,311 @@ parse_opt (int key, char *arg, struct argp_state *state)
 			" (XML, CTF or FCTF) at a time.\n");
 	  return EINVAL;
 	}
+      if (analysis.data && (generate_cpf || generate_fcpf))
+	{
+	  argp_failure (state, EXIT_FAILURE, 0,
+			"--data only works with the tree report.\n");
+	  return EINVAL;
+	}
+      if (samples_file && (generate_cpf || generate_fcpf))
+	{
+	  argp_failure (state, EXIT_FAILURE, 0,
+			"--samples only works with the tree report.\n");
+	  return EINVAL;
+	}
+      if (watch_interval > 0 && (generate_cpf || generate_fcpf
+				 || report.serve_socket))
+	{
+	  argp_failure (state, EXIT_FAILURE, 0,
+			"--watch only works with the tree report.\n");
+	  return EINVAL;
+	}
     default:
       return ARGP_ERR_UNKNOWN;
     }
   return 0;
 }
 
-/* Returns size of code described by this DIE. Returns zero if this
-   DIE doesn't cover any code. 1 is returned for DIEs that do describe
-   code by have unknown size. */
-static Dwarf_Word
-DIE_code_size (Dwarf_Die *die)
-{
-  Dwarf_Addr base;
-  Dwarf_Addr begin;
-  Dwarf_Addr end;
-  ptrdiff_t off = 0;
-  Dwarf_Word size = 0;
+/* Several processes or objects get a Dwfl each, so the standard Dwfl
+   options (and their "-e a.out" default) don't apply to them. Which it
+   is gets found in a silent first pass over the options, so that they
+   are abbreviated as they will be in the real one. */
+static bool scan_multi_process, scan_batch;
 
-  do
+static error_t
+scan_opt (int key, char *arg, struct argp_state *state)
+{
+  switch (key)
     {
-      // Also handles lowpc plus highpc as special one range case.
-      off = dwarf_ranges (die, off, &base, &begin, &end);
-      if (off > 0)
-	{
-	  size += (end - begin);
-	}
+    case OPT_PIDS:
+    case OPT_ALL_PROCESSES:
+      scan_multi_process = true;
+      break;
+    case OPT_BATCH:
+      scan_batch = true;
+      break;
+    default:
+      // the rest is for the real pass
+      return key < ARGP_KEY_END ? 0 : ARGP_ERR_UNKNOWN;
     }
-  while (off > 0);
-
-  if (size == 0 && (dwarf_hasattr (die, DW_AT_entry_pc)
-                    || dwarf_hasattr (die, DW_AT_low_pc)))
-    size = single_address_size;
-
-  return size;
+  return 0;
 }
 
-/* Returns the tag of the DIE declaring the given DIE following
-   DW_AT_abstract_origin and DW_AT_specification. */
-static int
-DIE_decl_tag (Dwarf_Die *die, Dwarf_Die **decl)
+static void
+scan_options (const struct argp_option *options, int argc, char **argv)
 {
-  Dwarf_Die die_mem;
-  Dwarf_Attribute attr_mem;
-  Dwarf_Attribute *attr;
-
-  *decl = die;
-  do
+  struct argp dwfl_scan = { .options = dwfl_standard_argp ()->options,
+			    .parser = scan_opt };
+  const struct argp_child children[] =
     {
-      attr = dwarf_attr (die, DW_AT_abstract_origin, &attr_mem);
-      if (attr == NULL)
-	attr = dwarf_attr (die, DW_AT_specification, &attr_mem);
-      if (attr == NULL)
-	break;
-
-      die = *decl;
-      *decl = dwarf_formref_die (attr, &die_mem);
-    }
-  while (*decl != NULL); /* Wouldn't that actually be an error? */
-
-  return dwarf_tag (die);
+      {	.argp = &dwfl_scan },
+      {	.argp = NULL },
+    };
+  struct argp scan = { .options = options, .parser = scan_opt,
+		       .children = children };
+
+  // argp may reorder them
+  char **args = (char **) calloc (argc + 1, sizeof (char *));
+  if (args == NULL)
+    error (EXIT_FAILURE, errno, "calloc");
+  memcpy (args, argv, argc * sizeof (char *));
+  argp_parse (&scan, argc, args, ARGP_SILENT, NULL, NULL);
+  free (args);
 }
 
-#if 0
-/* Returns a static constant string representation of the DIE tag.
-   Returns NULL when unknown. Would be nice if libdw had this. */
-static const char *
-TAG_name (int tag)
+/* Re-reads the mappings of the process every watch_interval seconds.
+   Only modules that were not seen before get analysed, and modules
+   that went away are taken out of the tree again; the report is
+   written again whenever something changed. */
+static void
+watch_process (struct dwarfprofile_context *ctx, Dwfl *dwfl)
 {
-  /* Just recognize code/function DIEs. Add more if necessary. */
-  switch (tag)
+  if (dwfl_pid (dwfl) <= 0)
     {
-    case DW_TAG_compile_unit:
-      return "compile_unit";
-    case DW_TAG_subprogram:
-      return "subprogram";
-    case DW_TAG_catch_block:
-      return "catch_block";
-    case DW_TAG_inlined_subroutine:
-      return "inlined_subroutine";
-    case DW_TAG_lexical_block:
-      return "lexical_block";
-    case DW_TAG_module:
-      return "module";
-    case DW_TAG_partial_unit:
-      return "partial_unit";
-    case DW_TAG_try_block:
-      return "try_block";
-    case DW_TAG_with_stmt:
-      return "with_stmt";
-    case DW_TAG_GNU_call_site:
-      return "call_site";
-    case DW_TAG_label:
-      return "label";
-    default:
-      return NULL;
+      fprintf (stderr, "--watch needs a process (-p)\n");
+      return;
     }
-}
-#endif
 
-/* Returns the code size of the DIE and fills in the what and where
-   info if the size is greater than zero. */
-Dwarf_Word
-DIE_what_where_size (Dwarf_Die *die,
-		     struct what_info *what, struct where_info *where)
-{
-  Dwarf_Word size = DIE_code_size (die);
-  if (size > 0)
+  for (;;)
     {
-      Dwarf_Die *decl;
-      const char *what_file, *where_file;
-
-      what->tag = DIE_decl_tag (die, &decl);
-      what->die_off = dwarf_dieoffset (decl);
-      what->name = dwarf_diename (die);
-      what_file = dwarf_decl_file (die);
-
-      what->line = 0;
-      what->col = 0;
-      dwarf_decl_line (die, &what->line);
-      dwarf_decl_column (die, &what->col);
+      sleep (watch_interval);
 
-      if (decl == die)
+      int dropped = 0;
+      int analysed = dwarfprofile_refresh (ctx, dwfl, &dropped);
+      if (analysed < 0)
 	{
-	  where->tag = what->tag;
-	  where->die_off = what->die_off;
-	  where_file = what_file;
-	  where->line = what->line;
-	  where->col = what->col;
+	  fprintf (stderr, "* process %d is gone\n", (int)dwfl_pid (dwfl));
+	  break;
 	}
-      else
-	{
-	  where->tag = dwarf_tag (die);
-	  where->die_off = dwarf_dieoffset (die);
-
-	  Dwarf_Word value;
-	  Dwarf_Attribute attr_mem;
-	  where_file = what_file;
-	  if (dwarf_formudata (dwarf_attr (die, DW_AT_call_file, &attr_mem),
-			       &value) == 0)
-	    where_file = dwarf_filesrc (files, value, NULL, NULL);
-
-	  where->line = what->line;
-	  if (dwarf_formudata (dwarf_attr (die, DW_AT_call_line, &attr_mem),
-			       &value) == 0)
-	    where->line = value;
-
-	  where->col = what->col;
-	  if (dwarf_formudata (dwarf_attr (die, DW_AT_call_column, &attr_mem),
-			       &value) == 0)
-	    where->col = value;
-
-	  /* XXX is this really right or just cosmetics?  If all
-	     information of what and where are the same just pretend
-	     what == where anyway. Note we force the what die_off
-	     because all information can apparently be derived from
-	     the where. */
-	  if (where->tag == what->tag
-	      && where_file == what_file
-	      && where->line == what->line
-	      && where->col == what->col)
-	    what->die_off = where->die_off;
-
-	}
-      where->size = size;
-      what->file = escape_name (what_file);
-      where->file = escape_name (where_file);
-
-      // Register these addresses cf. die-code-size etc.
-      {
-	Dwarf_Addr base;
-	Dwarf_Addr begin;
-	Dwarf_Addr end;
-	ptrdiff_t off = 0;
-	do
-	  {
-	    // Also handles lowpc plus highpc as special one range case.
-	    off = dwarf_ranges (die, off, &base, &begin, &end);
-	    if (off > 0)
-	      {
-		register_address_span (what, begin, end);
-	      }
-	  }
-	while (off > 0);
-
-	if (size == 0 && (dwarf_hasattr (die, DW_AT_entry_pc)
-			  || dwarf_hasattr (die, DW_AT_low_pc)) &&
-	    single_address_size > 0)
-	  {
-	    fprintf (stderr, "test me - size zero die: 0x%ld", (long) base);
-	    register_address_span (what, base, base + 1);
-	  }
 
-      }
-    }
-  else
-    {
-      what->file = NULL;
-      where->file = NULL;
-    }
-
-  return size;
-}
-
-#if 0
-/* Returns a hopefully unique identifier for what code is being used
-   based on the definition tag, name, file, line and col if
-   known. String has to be freed by caller. */
-static char *
-what_identifier_string (const struct what_info *what)
-{
-  char *res;
-  int tag = what->tag;
-  const char *orig_name = what->name;
-  const char *file = what->file;
-  int line = what->line;
-  int col = what->col;
-  Dwarf_Word die_off = what->die_off;
-
-  if (orig_name != NULL)
-    {
-      char *name = escape_name (orig_name);
-      if (file != NULL)
+      if (analysed > 0 || dropped > 0)
 	{
-	  if (line != 0)
-	    {
-	      if (col != 0)
-		{
-		  if (asprintf (&res, "%s:%s:%s:%d:%d", TAG_name (tag),
-				name, file, line, col) < 0)
-		    res = NULL;
-		}
-	      else
-		{
-		  if (asprintf (&res, "%s:%s:%s:%d", TAG_name (tag),
-				name, file, line) < 0)
-		    res = NULL;
-		}
-	    }
-	  else
-	    {
-	      if (asprintf (&res, "%s:%s:%s", TAG_name (tag), name, file) < 0)
-		res = NULL;
-	    }
+	  fprintf (stderr, "* %d new module(s), %d unloaded\n",
+		   analysed, dropped);
+	  dump_results (ctx, &report);
+	  fflush (stdout);
 	}
-      else
-	{
-	  if (asprintf (&res, "%s:%s", TAG_name (tag), name) < 0)
-	    res = NULL;
-	}
-      free (name);
-    }
-  else
-    {
-      // No name, use DIE offset to generate something (possibly non-unique).
-      if (asprintf (&res, "%s_%#lx", TAG_name (tag), (long)die_off) < 0)
-	res = NULL;
     }
-
-  return res;
 }
 
-/* Returns a string describing the location where a DIE was used.
-   String has to be freed by caller. */
-static char *
-where_string (const struct where_info *where)
+// Adds every process in /proc (but ourselves) to pids.
+static void
+list_all_processes ()
 {
-  char *res;
-  int tag = where->tag;
-  const char *file = where->file;
-  int line = where->line;
-  int col = where->col;
-
-  if (file != NULL)
-    {
-      if (line != 0)
-	{
-	  if (col != 0)
-	    {
-	      if (asprintf (&res, "%s:%s:%d:%d", TAG_name (tag),
-			    file, line, col) < 0)
-		res = NULL;
-	    }
-	  else
-	    {
-	      if (asprintf (&res, "%s:%s:%d", TAG_name (tag),
-			    file, line) < 0)
-		res = NULL;
-	    }
-	}
-      else
-	{
-	  if (asprintf (&res, "%s:%s", TAG_name (tag), file) < 0)
-	    res = NULL;
-	}
-    }
-  else
+  DIR *dir = opendir ("/proc");
+  if (!dir)
+    return;
+  struct dirent *entry;
+  while ((entry = readdir (dir)) != NULL)
     {
-      if (asprintf (&res, "%s", TAG_name (tag)) < 0)
-	res = NULL;
+      char *end;
+      long pid = strtol (entry->d_name, &end, 10);
+      if (*end == '\0' && pid > 0 && pid != getpid ())
+	pids.push_back ((pid_t)pid);
     }
-
-  return res;
+  closedir (dir);
 }
-#endif
-
-/* We treat nested subprograms as "inlines", keep track of how deep we nest. */
-// static int in_top_level_subprogram = 0;
 
+// Fills in the command name of a process, "?" if unknown.
 static void
-output_die_begin (struct what_info *what, struct where_info *where, int indent)
+process_name (pid_t pid, char *name, size_t len)
 {
+  char path[64];
+  snprintf (path, sizeof (path), "/proc/%d/comm", (int)pid);
+  FILE *f = fopen (path, "r");
+  if (!f || !fgets (name, len, f))
+    snprintf (name, len, "?");
+  else
+    name[strcspn (name, "\n")] = '\0';
+  if (f)
+    fclose (f);
 }
 
+/* Analyses each of the pids with a Dwfl of its own; modules they
+   share are analysed once. */
 static void
-output_die_end (struct what_info *pwhat, struct where_info *pwhere,
-                struct what_info *what, struct where_info *where,
-		Dwarf_Word children_size, int indent)
+analyse_processes (struct dwarfprofile_context *ctx)
 {
+  for (size_t i = 0; i < pids.size (); i++)
+    {
+      char name[64];
+      process_name (pids[i], name, sizeof (name));
+      if (dwarfprofile_analyse_process (ctx, pids[i], name) < 0)
+	// Gone already, or not ours to look at: not worth failing over.
+	fprintf (stderr, "skipping process %d\n", (int)pids[i]);
+    }
 }
 
-/* Walks all (code) children of the given DIE and returns the total
-   code size. */
-static Dwarf_Word
-walk_children (Dwarf_Die *die, int indent)
+/* Collects the objects for --batch: the files in the directory
+   batch_source (not recursively), or listed in it if it is a file.
+   Those that are no ELF files get skipped by the analysis. */
+static bool
+batch_paths (std::vector<char *> &paths)
 {
-  Dwarf_Word total = 0;
-  if (! dwarf_haschildren (die))
-    return total;
-
-  struct what_info pwhat;
-  struct where_info pwhere;
-  DIE_what_where_size (die, &pwhat, &pwhere);
-
-  Dwarf_Die child;
-  if (dwarf_child (die, &child) == 0)
+  struct stat st;
+  if (stat (batch_source, &st) != 0)
     {
-      do
+      fprintf (stderr, "cannot read '%s'\n", batch_source);
+      return false;
+    }
+  if (S_ISDIR (st.st_mode))
+    {
+      DIR *dir = opendir (batch_source);
+      struct dirent *entry;
+      while (dir && (entry = readdir (dir)) != NULL)
 	{
-	  struct what_info what;
-	  struct where_info where;
-
-	  /* Only DIEs with a code size have children with code and
-	     the code size of a DIE >= the sum of the code size of the
-	     children. */
-	  Dwarf_Word size = DIE_what_where_size (&child, &what, &where);
-	  if (size > 0)
-	    {
-	      /* Even if we don't use this DIE because it doesn't have
-		 a name, we still want to walk the children. */
-	      bool use_die = ((what.name != NULL) || (! ignore_no_name));
-
-	      if (use_die)
-		{
-		  /* Note we add the whole DIE size, which include the
-		     size of all children. So only add children_size
-		     below if we don't report this DIE. */
-		  total += size;
-
-		  output_die_begin (&what, &where, indent);
-		}
-
-	      Dwarf_Word children_size = walk_children (&child, indent + 1);
-
-	      if (use_die)
-		output_die_end (&pwhat, &pwhere, &what, &where, children_size, indent);
-	      else
-		total += children_size;
-	    }
-
-	  if (what.file)
-	    free (what.file);
-	  if (where.file)
-	    free (where.file);
+	  char *path;
+	  if (asprintf (&path, "%s/%s", batch_source, entry->d_name) != -1)
+	    paths.push_back (path);
 	}
-      while (dwarf_siblingof (&child, &child) == 0);
+      if (dir)
+	closedir (dir);
     }
-
-  return total;
+  else
+    {
+      FILE *list = fopen (batch_source, "r");
+      char *line = NULL;
+      size_t len = 0;
+      ssize_t n;
+      while (list && (n = getline (&line, &len, list)) != -1)
+	{
+	  line[strcspn (line, "\n")] = '\0';
+	  if (line[0] != '\0')
+	    paths.push_back (strdup (line));
+	}
+      free (line);
+      if (list)
+	fclose (list);
+    }
+  return true;
 }
 
-static void
-output_cu_begin (struct what_info *what, struct where_info *where)
+static bool
+analyse_batch (struct dwarfprofile_context *ctx)
 {
-  output_die_begin (what, where, 2); // indent 2 (dwarfprofile + module).
+  std::vector<char *> paths;
+  if (!batch_paths (paths))
+    return false;
+
+  std::vector<const char *> objects (paths.begin (), paths.end ());
+  bool ok = dwarfprofile_analyse_batch (ctx, objects, batch_jobs);
+  if (!ok)
+    fprintf (stderr, "no ELF files in '%s'\n", batch_source);
+  for (size_t i = 0; i < paths.size (); i++)
+    free (paths[i]);
+  return ok;
 }
 
-static void
-output_cu_end (struct what_info *what, struct where_info *where,
-	       Dwarf_Word children_size)
+/* Arguments of 'dwarfprofile query'. */
+struct query_args
 {
-  output_die_end (NULL, NULL, what, where, children_size, 2);
-}
+  const char *file;
+  const char *path;
+  int depth;
+  int top;
+};
 
-static void
-handle_cu (Dwarf_Die *cu)
+static error_t
+parse_query_opt (int key, char *arg, struct argp_state *state)
 {
-  /* Skip CUs without any code. */
-  Dwarf_Word size = DIE_code_size (cu);
-  const char *name = dwarf_diename (cu);
-
-  // XXX ehe, name == NULL, when does that happen?
-  if (size == 0 || name == NULL)
-    return;
-
-  /* Construct a (short) name and file to refer to this CU. */
-  const char *short_name = rindex (name, '/');
-  short_name = (short_name != NULL) ? short_name + 1 : name;
-
-  Dwarf_Attribute attr;
-  const char *dir = dwarf_formstring (dwarf_attr (cu, DW_AT_comp_dir, &attr));
-
-  char *full_name;
-  const char *file = name;
-  if (dir != NULL && name[0] != '/')
+  struct query_args *args = (struct query_args *)state->input;
+  size_t n;
+  switch (key)
     {
-      if (asprintf (&full_name, "%s/%s", dir, name) != -1)
-	file = full_name;
+    case OPT_PATH:
+      args->path = arg;
+      break;
+    case OPT_DEPTH:
+      if (!parse_count (arg, &n) || n > INT_MAX)
+	argp_error (state, "invalid depth '%s'", arg);
+      args->depth = n;
+      break;
+    case OPT_TOP:
+      if (!parse_count (arg, &n) || n > INT_MAX)
+	argp_error (state, "invalid number of entries '%s'", arg);
+      args->top = n;
+      break;
+    case ARGP_KEY_ARG:
+      if (args->file != NULL)
+	argp_error (state, "only one snapshot can be queried");
+      args->file = arg;
+      break;
+    case ARGP_KEY_END:
+      if (args->file == NULL)
+	argp_error (state, "no snapshot given");
+      break;
+    default:
+      return ARGP_ERR_UNKNOWN;
     }
-
-  /* Compile Unit DIEs only really have where info, but construct a
-     what for consistency. XXX Need to handle imported_unit/partial_units? */
-  struct where_info where;
-  struct what_info what;
-  where.tag = what.tag = dwarf_tag (cu);
-  where.die_off = what.die_off = dwarf_dieoffset (cu);
-  what.name = short_name;
-  where.file = what.file = escape_name (file);
-  where.line = what.line = 0;
-  where.col = what.col = 0;
-  where.size = size;
-
-  /* cache the file list for this CU. */
-  if (dwarf_getsrcfiles (cu, &files, NULL) != 0)
-    files = NULL; // There better not be any DW_AT_desc_files...
-
-  output_cu_begin (&what, &where);
-  Dwarf_Word children_size = walk_children (cu, 3); // indent 3 (dp/mod/cu)
-
-  output_cu_end (&what, &where, children_size);
-
-  if (file != name)
-    free (full_name);
+  return 0;
 }
 
-static void
-output_module_begin (const char *name)
+/* Answers from a snapshot written with --save, without any DWARF. */
+static int
+query_main (int argc, char **argv)
 {
-  fprintf (stderr, "process '%s' ", name);
+  const struct argp_option options[] =
+    {
+      { "path", OPT_PATH, "prefix", 0,
+	"Only report below this path (default: everything)", 0 },
+      { "depth", OPT_DEPTH, "N", 0, "Breakdown depth (default 2)", 0 },
+      { "top", OPT_TOP, "K", 0,
+	"Only report the K biggest entries at each level", 0 },
+      { NULL, 0, NULL, 0, NULL, 0 }
+    };
+  struct argp query_argp = { options, parse_query_opt, "SNAPSHOT",
+			     "Query a tree saved with --save", NULL, NULL, NULL };
+
+  struct query_args args = { NULL, NULL, 2, 0 };
+  if (argp_parse (&query_argp, argc, argv, 0, NULL, &args) != 0)
+    return -1;
+
+  return query_snapshot (args.file, args.path, args.depth, args.top);
 }
 
-static void
-output_module_end (const char *name)
+/* Times the sweep kernels: dwarfprofile bench-sweep [RECORDS] */
+static int
+bench_sweep_main (int argc, char **argv)
 {
-  fprintf (stderr, "... done\n");
+  size_t records = argc > 1 ? strtoul (argv[1], NULL, 10) : 1 << 16;
+  if (records == 0)
+    {
+      fprintf (stderr, "usage: dwarfprofile bench-sweep [RECORDS]\n");
+      return -1;
+    }
+  return bench_sweep_kernels (records, 100);
 }
 
+/* Keeps snapshots resident: dwarfprofile serve SOCKET SNAPSHOT... */
 static int
-handle_module (Dwfl_Module *mod, void **userdata, const char *name,
-	       Dwarf_Addr base, void *arg)
+serve_main (int argc, char **argv)
 {
-  Dwarf_Die *cu = NULL;
-  Dwarf_Addr bias;
-
-  output_module_begin (name);
-  while ((cu = dwfl_module_nextcu (mod, cu, &bias)) != NULL)
-    handle_cu (cu);
-  output_module_end (name);
-
-  return DWARF_CB_OK;
+  if (argc < 3)
+    {
+      fprintf (stderr, "usage: dwarfprofile serve SOCKET SNAPSHOT...\n");
+      return -1;
+    }
+  return serve_snapshots (argv[1], argv + 2, argc - 2);
 }
 
 void
@@ -588,6 +595,13 @@ output_paths ()
 int
 main (int argc, char **argv)
 {
+  if (argc > 1 && !strcmp (argv[1], "query"))
+    return query_main (argc - 1, argv + 1);
+  if (argc > 1 && !strcmp (argv[1], "serve"))
+    return serve_main (argc - 1, argv + 1);
+  if (argc > 1 && !strcmp (argv[1], "bench-sweep"))
+    return bench_sweep_main (argc - 1, argv + 1);
+
   const struct argp_option options[] =
     {
       { NULL, 0, NULL,  0, "Output selection options:", 2 },
@@ -596,6 +610,78 @@ main (int argc, char **argv)
       { "calltree", 'c', NULL, 0,
 	"Output Calltree Profile Format (implies -i -s0)", 0 },
       { "xml", 'x', NULL, 0, "XML output", 0 },
+      { "depths", OPT_DEPTHS, "list", 0,
+	"Comma separated breakdown depths to report (default 2,8,14)", 0 },
+      { "top", OPT_TOP, "K", 0,
+	"Only report the K biggest entries at each level, folding the"
+	" rest into an '(other N entries)' line", 0 },
+      { "min-size", OPT_MIN_SIZE, "bytes", 0,
+	"Fold entries smaller than this into '(other N entries)'", 0 },
+      { "min-percent", OPT_MIN_PERCENT, "percent", 0,
+	"Fold entries smaller than this share of the total", 0 },
+      { "inlines", OPT_INLINES, "K", OPTION_ARG_OPTIONAL,
+	"Also report inlined code by the function inlined: total bytes,"
+	" instances, average and biggest callers. Lists the biggest K"
+	" (default 50, 0 for all)", 0 },
+      { "data", OPT_DATA, NULL, 0,
+	"Also account variables with a fixed address, in the tree below"
+	" the section (.rodata, .data, ...) they are in", 0 },
+      { "samples", OPT_SAMPLES, "file", 0,
+	"Add a column of profile samples: one address per line in the"
+	" file, optionally followed by its object in parentheses, as"
+	" 'perf script -F ip,dso' writes them", 0 },
+      { "lines", OPT_LINES, "K", OPTION_ARG_OPTIONAL,
+	"Split the code of functions and files by source line (from the"
+	" line tables), and report the biggest lines of the biggest K"
+	" functions and files (default 20, 0 for all)", 0 },
+      { "no-stream", OPT_NO_STREAM, NULL, 0,
+	"Keep every address of a module until it has been walked, instead"
+	" of sweeping each compile unit into the tree as soon as no later"
+	" one can overlap it (same result, more memory)", 0 },
+      { "no-readahead", OPT_NO_READAHEAD, NULL, 0,
+	"Leave the debug sections of a module to be paged in as the walk"
+	" gets to them, instead of reading them ahead", 0 },
+      { "tree-jobs", OPT_TREE_JOBS, "N", OPTION_ARG_OPTIONAL,
+	"Sort, sweep and build the tree of each module on N threads"
+	" (default: one per CPU); the tree in shards that are merged in a"
+	" fixed order, not with --samples or --lines", 0 },
+      { "sweep-kernel", OPT_SWEEP_KERNEL, "NAME", 0,
+	"Sweep with the avx512, avx2 or scalar kernel (default: auto, the"
+	" best this CPU has; cf. dwarfprofile bench-sweep)", 0 },
+      { "prefix-map", OPT_PREFIX_MAP, "OLD=NEW", 0,
+	"Report files below directory OLD below NEW instead, like"
+	" -fdebug-prefix-map; may be given several times, the last match"
+	" wins", 0 },
+      { "group-templates", OPT_GROUP_TEMPLATES, "K", OPTION_ARG_OPTIONAL,
+	"Name template instances after their family (arguments stripped)"
+	" and report the K biggest families (default 50, 0 for all)", 0 },
+      { "pprof", OPT_PPROF, "file", 0,
+	"Also write the tree as a gzipped pprof profile.proto", 0 },
+      { "treemap", OPT_TREEMAP, "file", 0,
+	"Also write the tree as an HTML page with a treemap, to browse"
+	" it in a web browser", 0 },
+      { "save", OPT_SAVE, "file", 0,
+	"Also save the tree as a snapshot for 'dwarfprofile query'", 0 },
+      { "serve", OPT_SERVE, "socket", 0,
+	"Then keep the tree resident and answer JSON queries on a unix"
+	" socket (see also 'dwarfprofile serve')", 0 },
+
+      { "watch", OPT_WATCH, "seconds", OPTION_ARG_OPTIONAL,
+	"With -p, keep re-reading the process' modules (every 5 seconds"
+	" by default), analysing just the new ones, and report changes", 0 },
+
+      { "pids", OPT_PIDS, "pid,...", 0,
+	"Analyse several processes; modules they share (by build-id)"
+	" are analysed once. Replaces -e/-p", 0 },
+      { "all-processes", OPT_ALL_PROCESSES, NULL, 0,
+	"Like --pids, for every process we can read", 0 },
+
+      { "batch", OPT_BATCH, "dir|list", 0,
+	"Analyse every ELF file in a directory, or listed (one per line)"
+	" in a file, in parallel. Each gets a top-level node of its own."
+	" Replaces -e/-p", 0 },
+      { "jobs", OPT_JOBS, "N", 0,
+	"Worker threads for --batch (default: one per CPU)", 0 },
 
       { NULL, 0, NULL,  0, "Code DIE selection options:", 3 },
       { "ignore-no-name", 'i', NULL, 0,
@@ -618,28 +704,86 @@ main (int argc, char **argv)
       {	.argp = NULL },
     };
 
-  argp.children = argp_children;
+  scan_options (options, argc, argv);
+  bool multi_process = scan_multi_process, batch = scan_batch;
+
+  argp.children = (multi_process || batch) ? NULL : argp_children;
   argp.options = options;
   argp.parser = parse_opt;
 
+  dwarfprofile_init_options (&analysis);
+
   int cnt;
   Dwfl *dwfl = NULL;
   error_t e = argp_parse (&argp, argc, argv, 0, &cnt, &dwfl);
 
-  if (e != 0 || dwfl == NULL)
+  if (e != 0 || (dwfl == NULL && !multi_process && !batch))
+    exit (-1);
+
+  if (report.depths.empty ())
+    {
+      report.depths.push_back (2);
+      report.depths.push_back (8);
+      report.depths.push_back (14);
+    }
+
+  analysis.callgrind = generate_cpf || generate_fcpf;
+  struct dwarfprofile_context *ctx = dwarfprofile_begin (&analysis);
+  if (samples_file && !dwarfprofile_load_samples (ctx, samples_file))
     exit (-1);
+  for (size_t i = 0; i < prefix_maps.size (); i++)
+    dwarfprofile_add_prefix_map (ctx, prefix_maps[i]);
+
+  if (batch)
+    {
+      if (generate_cpf || generate_fcpf || watch_interval > 0
+	  || multi_process)
+	{
+	  fprintf (stderr, "--batch only works with the tree report\n");
+	  exit (-1);
+	}
+      if (!analyse_batch (ctx))
+	exit (-1);
+      dump_results (ctx, &report);
+      dwarfprofile_end (ctx);
+      return 0;
+    }
 
-  ptrdiff_t res = dwfl_getmodules (dwfl, handle_module, NULL, 0);
-  if (res != 0) // We should handle all modules, anything else is an error
+  if (multi_process)
     {
-      fprintf (stderr, "dwfl_getmodules failed: %s\n",  dwfl_errmsg (-1));
-      exit (-1);
+      if (generate_cpf || generate_fcpf || watch_interval > 0)
+	{
+	  fprintf (stderr, "--pids/--all-processes only work with"
+		   " the tree report\n");
+	  exit (-1);
+	}
+      if (all_processes)
+	list_all_processes ();
+      analyse_processes (ctx);
+      dump_processes (ctx);
+      dump_results (ctx, &report);
+      dwarfprofile_end (ctx);
+      return 0;
     }
+
+  if (dwarfprofile_analyse_dwfl (ctx, dwfl) < 0)
+    exit (-1);
   output_paths ();
 
-  dwfl_end (dwfl);
+  if (generate_cpf || generate_fcpf)
+    write_callgrind (ctx, stdout, generate_cpf);
+  else
+    dump_results (ctx, &report);
 
-  dump_results();
+  if (watch_interval > 0)
+    {
+      fflush (stdout);
+      watch_process (ctx, dwfl);
+    }
+
+  dwfl_end (dwfl);
+  dwarfprofile_end (ctx);
 
   return 0;
 }
+
@@ -0,0 +1,148 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef DWARFPROFILE_DWARFPROFILE_HXX
+#define DWARFPROFILE_DWARFPROFILE_HXX
+
+#include <elfutils/libdwfl.h>
+#include <sys/types.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <vector>
+
+/* libdwarfprofile: the analysis behind the dwarfprofile command, for
+   use from other programs. Everything an analysis builds up lives in
+   its context, the names of its nodes and the trees it serves
+   included; contexts share nothing, so any number of them can be used
+   at once, each from a thread of its own. A context itself is not to be used by two
+   threads at the same time. */
+
+/* What to collect, fixed for the lifetime of a context. */
+struct dwarfprofile_options
+{
+  bool ignore_no_name;     // skip DIEs without a name (lexical blocks)
+  int single_address_size; // size of DIEs with just a low_pc, 0 skips them
+  bool inlines;            // collect inlining by abstract origin
+  bool group_templates;    // name template instances after their family
+  bool data;               // account variables too, below their sections
+  bool lines;              // split functions and files by source line
+  bool callgrind;          // keep one address space for write_callgrind
+                           // instead of sweeping modules into the tree
+  bool stream;             // sweep each CU into the tree once no later
+                           // one can overlap it, rather than per module
+  int tree_jobs;           // threads sorting, sweeping and building the
+                           // tree of a module, 0 for one per CPU, 1 for
+                           // none of its own
+  bool readahead;          // read the debug sections of a module ahead
+  const char *sweep_kernel; // what sweeps compute sizes and gaps with:
+                           // "avx512", "avx2", "scalar", or NULL (or
+                           // "auto") for the best the CPU has
+};
+
+// the defaults of the command line
+extern void dwarfprofile_init_options (struct dwarfprofile_options *opts);
+
+struct dwarfprofile_context;
+extern struct dwarfprofile_context *
+dwarfprofile_begin (const struct dwarfprofile_options *opts);
+extern void dwarfprofile_end (struct dwarfprofile_context *ctx);
+
+// map the samples in this file onto the modules analysed from now on
+extern bool dwarfprofile_load_samples (struct dwarfprofile_context *ctx,
+                                       const char *path);
+/* report the files below directory OLD of the modules analysed from
+   now on below NEW, for a mapping "OLD=NEW"; the last matching one
+   wins. Returns false if there is no OLD. */
+extern bool dwarfprofile_add_prefix_map (struct dwarfprofile_context *ctx,
+                                         const char *mapping);
+
+/* whether there is a sweep kernel of this name (cf. sweep_kernel in
+   the options) that the CPU can run */
+extern bool dwarfprofile_sweep_kernel_ok (const char *name);
+// time them on this many made up records (dwarfprofile bench-sweep)
+extern int bench_sweep_kernels (size_t records, int rounds);
+
+/* Analyse the modules of a Dwfl that were not analysed before (by
+   build-id). Return the number of modules analysed, -1 on error. */
+extern int dwarfprofile_analyse_dwfl (struct dwarfprofile_context *ctx,
+                                      Dwfl *dwfl);
+extern int dwarfprofile_analyse_file (struct dwarfprofile_context *ctx,
+                                      const char *path);
+// a process, keeping track of which modules it maps (cf. dump_processes)
+extern int dwarfprofile_analyse_process (struct dwarfprofile_context *ctx,
+                                         pid_t pid, const char *name);
+
+/* Re-read the modules of the process of a Dwfl: analyse the new ones,
+   take the ones that went away out of the tree again (counted in
+   *dropped). Returns -1 when the process is gone. */
+extern int dwarfprofile_refresh (struct dwarfprofile_context *ctx,
+                                 Dwfl *dwfl, int *dropped);
+
+/* Analyse many ELF files on jobs threads (0: one per CPU), each below a
+   node of its own named after it. Files that are no ELF are skipped;
+   returns false if none was left. */
+extern bool dwarfprofile_analyse_batch (struct dwarfprofile_context *ctx,
+                                        const std::vector<const char *> &paths,
+                                        int jobs);
+
+// the tree of everything analysed so far
+struct FileSystemNode;
+extern FileSystemNode *dwarfprofile_tree (struct dwarfprofile_context *ctx);
+
+/* How the results get reported, filled in from the command line. */
+struct report_options
+{
+  std::vector<int> depths; // breakdown depths, in output order
+  size_t top;              // only the biggest entries per level, if non-zero
+  size_t min_size;         // fold entries smaller than this, in bytes
+  double min_percent;      // ... or than this percentage of the total
+  const char *pprof_file;  // also write a gzipped pprof profile here
+  const char *treemap_file; // ... and an HTML treemap here
+  const char *save_file;   // also save the tree as a snapshot here
+  const char *serve_socket; // then keep serving queries on this socket
+  bool inlines;            // also report inlining by abstract origin
+  size_t inlines_top;      // ... just the biggest this many, if non-zero
+  bool templates;          // also report template families
+  size_t templates_top;    // ... just the biggest this many, if non-zero
+  bool samples;            // show a column of profile samples (--samples)
+  bool lines;              // also report the biggest lines of functions
+  size_t lines_top;        // ... and files, of this many, if non-zero
+};
+
+extern void dump_results (struct dwarfprofile_context *ctx,
+                          const struct report_options *opts);
+
+// several processes: which modules each one uses, and a summary
+extern void dump_processes (struct dwarfprofile_context *ctx);
+
+// write the address space as callgrind (flat or with a calltree)
+extern void write_callgrind (struct dwarfprofile_context *ctx, FILE *out,
+                             bool calltree);
+
+// write a tree as a gzipped pprof profile.proto
+extern bool write_pprof (const FileSystemNode *root, const char *path);
+
+// write a tree as a self-contained HTML page with an SVG treemap
+extern bool write_treemap (const FileSystemNode *root, const char *path);
+
+// save a tree as a snapshot, and answer queries from one
+extern bool save_snapshot (const FileSystemNode *root, const char *path);
+extern int query_snapshot (const char *file, const char *path,
+                           int depth, int top);
+
+// answer JSON queries on a unix socket, about the trees of a context
+// or snapshots: a tree is taken in as it is when added, its children
+// biggest first
+extern bool serve_tree_add (struct dwarfprofile_context *ctx,
+                            const FileSystemNode *root);
+extern int serve_trees (struct dwarfprofile_context *ctx,
+                        const char *socket_path);
+extern int serve_snapshots (const char *socket_path, char **files, int n_files);
+
+#endif // DWARFPROFILE_DWARFPROFILE_HXX
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
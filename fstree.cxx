@@ -13,178 +13,200 @@
 #include <assert.h>
 #include <string.h>
 #include <logging.hxx>
+#include <fstree.hxx>
+#include <context.hxx>
 
-struct FileSystemNode;
-struct FileSystemNode {
-    char           *mpName;
-    FileSystemNode *mpParent;
-
-    typedef std::vector< FileSystemNode * > ChildsType; // Hamburg nostalgia
-    ChildsType      maChildren;
-
-    FileSystemNode (FileSystemNode *pParent,
-                    const char *pName, int nLength)
-    {
-        mpName = strndup (pName, nLength);
-        mpParent = pParent;
-        if (mpParent)
-            mpParent->maChildren.push_back(this);
-        mnSize = 0;
-        useCount = 0;
-    }
-    ~FileSystemNode()
-    {
-        free (mpName);
-    }
+void fs_begin_process (dwarfprofile_context *ctx, int pid, const char *name)
+{
+    ProcessModules aProcess;
+    aProcess.mnPid = pid;
+    aProcess.maName = name;
+    ctx->maProcesses.push_back (aProcess);
+}
 
-    static FileSystemNode *gpRoot;
+bool fs_module_seen (dwarfprofile_context *ctx, const char *key)
+{
+    ModuleMap::iterator it = ctx->maModules.find (key);
+    if (it == ctx->maModules.end())
+        return false;
+    it->second.mbSeen = true;
+    if (!ctx->maProcesses.empty())
+        ctx->maProcesses.back().maKeys.push_back (key);
+    return true;
+}
 
-    static FileSystemNode *getNode (const char *pPath)
-    {
-        assert (pPath != NULL);
-        if (!gpRoot)
-            gpRoot = new FileSystemNode (NULL, "", 0);
+void fs_add_module (dwarfprofile_context *ctx, const char *key,
+                    FileSystemNode *tree)
+{
+    ctx->mpRoot->mergeTree (tree, true);
+    ModuleTree aEntry = { tree, true };
+    ctx->maModules[key] = aEntry;
+    if (!ctx->maProcesses.empty())
+        ctx->maProcesses.back().maKeys.push_back (key);
+}
 
-        FileSystemNode *pNode = gpRoot;
-        for (int last = 0, i = 0; pPath[i]; i++)
-        {
-            if (pPath[i] == '/')
-            {
-                if (i - last > 0)
-                {
-                    FileSystemNode *pChild;
-                    pChild = pNode->lookupNode(pPath + last, i - last);
-                    assert (pChild != NULL);
-                    pNode = pChild;
-                }
-                last = i + 1;
-            }
-        }
-        return pNode;
-    }
+/*
+ * Batch mode: every object gets a node of its own below the root, and
+ * its tree below that. Objects finish on any worker, in any order.
+ */
+void fs_add_object (dwarfprofile_context *ctx, const char *name,
+                    FileSystemNode *tree)
+{
+    std::lock_guard< std::mutex > aGuard (ctx->maObjectsMutex);
+    FileSystemNode *pRoot = ctx->mpRoot;
+    pRoot->lookupNode (name, strlen (name))->mergeTree (tree, true);
+    pRoot->mnSize += tree->mnSize;
+    pRoot->useCount += tree->useCount;
+    pRoot->mnSamples += tree->mnSamples;
+    tree->deleteTree ();
+}
 
-    FileSystemNode *lookupNode (const char *pName, int nLength)
+void dump_processes (dwarfprofile_context *ctx)
+{
+    const std::vector< ProcessModules > &aProcesses = ctx->maProcesses;
+    ModuleMap &aModules = ctx->maModules;
+
+    boost::unordered_map< std::string, int > aUsers;
+    for (size_t i = 0; i < aProcesses.size(); i++)
+        for (size_t j = 0; j < aProcesses[i].maKeys.size(); j++)
+            aUsers[aProcesses[i].maKeys[j]]++;
+
+    OutputBuffer aOut;
+    aOut.append ("\n---\n\n Breakdown by process\n\n"
+                 "     Pid Total Size  Shared Size  Modules Command\n");
+    size_t nMapped = 0;
+    for (size_t i = 0; i < aProcesses.size(); i++)
     {
-        // Un-mess-up relative paths etc. hoping that
-        // symlinks are kind to us.
-        if (!strncmp (pName, "..", nLength))
-            return mpParent ? mpParent : gpRoot;
-        if (!strncmp (pName, ".", nLength))
-            return this;
-
-        // slow as you like etc.
-        for (ChildsType::iterator it = maChildren.begin();
-             it != maChildren.end(); ++it)
+        const ProcessModules &rProcess = aProcesses[i];
+        size_t nTotal = 0, nShared = 0;
+        for (size_t j = 0; j < rProcess.maKeys.size(); j++)
         {
-            if (!strncmp ((*it)->mpName, pName, nLength))
-                return *it;
+            size_t nSize = aModules[rProcess.maKeys[j]].mpTree->mnSize;
+            nTotal += nSize;
+            if (aUsers[rProcess.maKeys[j]] > 1)
+                nShared += nSize;
         }
-        return new FileSystemNode(this, pName, nLength);
+        nMapped += nTotal;
+
+        aOut.appendNumber (rProcess.mnPid, 8);
+        aOut.append (' ');
+        aOut.appendNumber (nTotal, 10);
+        aOut.append (' ');
+        aOut.appendNumber (nShared, 12);
+        aOut.append (' ');
+        aOut.appendNumber (rProcess.maKeys.size(), 8);
+        aOut.append (' ');
+        aOut.append (rProcess.maName.c_str());
+        aOut.append ('\n');
     }
 
-    // Payload
-    size_t mnSize;
-
-    size_t useCount;
+    aOut.append ("\n");
+    aOut.appendNumber (aProcesses.size());
+    aOut.append (" processes map ");
+    aOut.appendNumber (nMapped);
+    aOut.append (" bytes of code, from ");
+    aOut.appendNumber (aModules.size());
+    aOut.append (" distinct modules of ");
+    aOut.appendNumber (ctx->mpRoot->mnSize);
+    aOut.append (" bytes (broken down below)\n");
+    aOut.write (stdout);
+}
 
-    // Size accumulated down the tree
-    void addSize (size_t nSize)
-    {
-        mnSize += nSize;
-        useCount++;
-        if (mpParent != NULL)
-            mpParent->addSize (nSize);
-    }
+void fs_begin_modules (dwarfprofile_context *ctx)
+{
+    for (ModuleMap::iterator it = ctx->maModules.begin();
+         it != ctx->maModules.end(); ++it)
+        it->second.mbSeen = false;
+}
 
-    static void accumulate_size (const char *pName, const char *pFunc,
-                                 int line, int col, size_t size)
+int fs_drop_unseen_modules (dwarfprofile_context *ctx)
+{
+    int nDropped = 0;
+    for (ModuleMap::iterator it = ctx->maModules.begin();
+         it != ctx->maModules.end(); )
     {
-        if (size == 0)
+        if (it->second.mbSeen)
         {
-// MJW - checkme - why is this zero so often ? ...
-//            fprintf (stderr, "odd zero size at '%s' '%s'\n", pName, pFunc);
-            return;
+            ++it;
+            continue;
         }
-
-        if (pName == NULL) {
-            return; /* some DIE have no names */
-        }
-        (void)line; (void)col; // later
-        FileSystemNode *pNode = getNode(pName);
-        if (pFunc)
-            pNode = pNode->lookupNode(pFunc, strlen(pFunc));
-        pNode->addSize (size);
+        ctx->mpRoot->mergeTree (it->second.mpTree, false);
+        it->second.mpTree->deleteTree ();
+        it = ctx->maModules.erase (it);
+        nDropped++;
     }
+    return nDropped;
+}
 
-    void dumpAtDepth (int nDepth)
-    {
-        if (nDepth < 0)
-            return;
-        static const char aIndent[] = "|                ";
-        assert (nDepth < (int)sizeof (aIndent));
-        const char *pIndent = aIndent + nDepth;
-
-        for (ChildsType::iterator it = maChildren.begin();
-             it != maChildren.end(); ++it)
-        {
-            fprintf (stdout, "%10lu %8lu %4lu %s%s\n",
-                     (unsigned long)(*it)->mnSize,
-                     (unsigned long)(*it)->useCount,
-                     (unsigned long)((*it)->useCount > 0?(*it)->mnSize / (*it)->useCount:0),
-                     pIndent,
-                     (*it)->mpName);
-            (*it)->dumpAtDepth (nDepth-1);
-        }
-    }
+static bool deepest_first (const FileSystemNode::DepthReport *a,
+                           const FileSystemNode::DepthReport *b)
+{
+    return a->mnDepth > b->mnDepth;
+}
 
-    static bool big_first (FileSystemNode *a, FileSystemNode *b)
+void dump_results (dwarfprofile_context *ctx, const struct report_options *opts)
+{
+    FileSystemNode *pRoot = ctx->mpRoot;
+    size_t nMinSize = opts->min_size;
+    if (opts->min_percent > 0)
+        nMinSize = std::max (nMinSize, (size_t)(pRoot->mnSize *
+                                                opts->min_percent / 100));
+    bool bPrune = opts->top > 0 || nMinSize > 0;
+
+    // Saved trees want everything, the report only what it shows.
+    if (!bPrune || opts->save_file || opts->serve_socket || opts->pprof_file ||
+        opts->treemap_file)
+        pRoot->sortChildren();
+    // all children in order, which pruning gives up
+    if (opts->treemap_file)
+        write_treemap (pRoot, opts->treemap_file);
+    if (opts->pprof_file)
+        write_pprof (pRoot, opts->pprof_file);
+    if (opts->save_file)
+        save_snapshot (pRoot, opts->save_file);
+    bool bServe = opts->serve_socket && serve_tree_add (ctx, pRoot);
+    if (bPrune)
     {
-        return a->mnSize > b->mnSize;
+        int nMaxDepth = 0;
+        for (size_t i = 0; i < opts->depths.size(); i++)
+            nMaxDepth = std::max (nMaxDepth, opts->depths[i]);
+        pRoot->sortChildren (opts->top, nMinSize, nMaxDepth);
     }
 
-    void sortChildren()
+    std::vector< FileSystemNode::DepthReport > aReports (opts->depths.size());
+    std::vector< FileSystemNode::DepthReport * > aByDepth;
+    for (size_t i = 0; i < aReports.size(); i++)
     {
-        std::sort (maChildren.begin(), maChildren.end(), big_first);
-
-        for (ChildsType::iterator it = maChildren.begin();
-             it != maChildren.end(); ++it)
-            (*it)->sortChildren();
+        aReports[i].mnDepth = opts->depths[i];
+        aReports[i].mbSamples = opts->samples;
+        aReports[i].maOut.appendReportHeader (opts->depths[i], opts->samples);
+        aByDepth.push_back (&aReports[i]);
     }
-};
-
-FileSystemNode *FileSystemNode::gpRoot = NULL;
-
-/*
- * Build a layered series of spans - we annotate the whole
- * size as we go down, and overwrite annotations as we ? ...
- */
-void fs_register_size (const char *path, const char *func,
-                       int line, int col, size_t size)
-{
-    if (!path)
-        return;
+    std::stable_sort (aByDepth.begin(), aByDepth.end(), deepest_first);
 
-    FileSystemNode::accumulate_size (path, func, line, col, size);
-}
-
-void dump_results()
-{
-    // Put address spans into our file-system tree
-    scan_addresses_to_fs_tree();
+    if (!aByDepth.empty())
+        pRoot->dumpDepths (&aByDepth[0], aByDepth.size(), 0);
 
-    FileSystemNode::gpRoot->sortChildren();
+    for (size_t i = 0; i < aReports.size(); i++)
+        aReports[i].maOut.write (stdout);
 
-    for (int i = 2; i <= 14; i+= 6)
+    fprintf (stderr, "check: total size %ld\n",
+             (long)pRoot->mnSize);
+    if (opts->samples && ctx->mpSamples)
+        samples_summary (ctx->mpSamples);
+
+    if (opts->inlines && ctx->mpInlines)
+        dump_inlines (ctx->mpInlines, opts->inlines_top);
+    if (opts->templates && ctx->mpTemplates)
+        dump_templates (ctx->mpTemplates, opts->templates_top);
+    if (opts->lines)
+        dump_lines (pRoot, opts->lines_top);
+
+    if (bServe)
     {
-        //int i = 12;
-        fprintf (stdout,
-                 "\n---\n\n Breakdown at depth %d\n\n"
-                 "Total Size    Count   Av. M Element\n", i);
-        FileSystemNode::gpRoot->dumpAtDepth(i);
+        fflush (stdout);
+        serve_trees (ctx, opts->serve_socket);
     }
-
-    fprintf (stderr, "check: total size %ld\n",
-             (long)FileSystemNode::gpRoot->mnSize);
 }
 
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
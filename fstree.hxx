@@ -0,0 +1,523 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef DWARFPROFILE_FSTREE_HXX
+#define DWARFPROFILE_FSTREE_HXX
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <mutex>
+#include <boost/unordered_map.hpp>
+#include <assert.h>
+#include <string.h>
+#include <output.hxx>
+
+/*
+ * Node names are interned: each distinct name is stored once and gets
+ * a small integer id, in order of first use. Id 0 is always the empty
+ * name of the root, which makes the pool directly usable as a string
+ * table (cf. pprof). A pool belongs to an analysis (or a shard of a
+ * tree) and the names go with it. Interning is locked, as batch
+ * workers build their trees in parallel; name() and size() are for
+ * when they are done.
+ */
+class NamePool {
+    std::vector< const char * >                   maNames;
+    boost::unordered_map< std::string, unsigned > maIds;
+    std::mutex                                    maMutex;
+
+    NamePool (const NamePool &);
+    NamePool &operator= (const NamePool &);
+
+  public:
+    NamePool ()
+    {
+        intern ("", 0);
+    }
+
+    ~NamePool ()
+    {
+        for (size_t i = 0; i < maNames.size(); i++)
+            free ((void *)maNames[i]);
+    }
+
+    unsigned intern (const char *pName, int nLength,
+                     const char **ppInterned = NULL)
+    {
+        std::string aName (pName, nLength);
+        std::lock_guard< std::mutex > aGuard (maMutex);
+        boost::unordered_map< std::string, unsigned >::iterator it;
+        it = maIds.find (aName);
+        unsigned nId;
+        if (it != maIds.end())
+            nId = it->second;
+        else
+        {
+            nId = maNames.size();
+            maNames.push_back (strndup (pName, nLength));
+            maIds[aName] = nId;
+        }
+        if (ppInterned)
+            *ppInterned = maNames[nId];
+        return nId;
+    }
+
+    const char *name (unsigned nId) const { return maNames[nId]; }
+    size_t size () const { return maNames.size(); }
+};
+
+/*
+ * Bytes of code per source line (cf. --lines), kept as a vector sorted
+ * by file and line. Additions are appended and merged into the sorted
+ * part whenever the tail has grown as long as it, so it never holds
+ * much more than twice the distinct lines, however many ranges went in.
+ */
+struct LineCount {
+    unsigned mnFileId;  // in the NamePool of the tree
+    int      mnLine;    // 0 (and no file): no line information
+    size_t   mnSize;
+    size_t   mnCount;
+
+    bool operator< (const LineCount &rOther) const
+    {
+        return mnFileId < rOther.mnFileId ||
+            (mnFileId == rOther.mnFileId && mnLine < rOther.mnLine);
+    }
+    bool sameLine (const LineCount &rOther) const
+    {
+        return mnFileId == rOther.mnFileId && mnLine == rOther.mnLine;
+    }
+};
+
+class LineHistogram {
+    mutable std::vector< LineCount > maLines;
+    mutable size_t                   mnSorted;
+
+    struct Empty {
+        bool operator() (const LineCount &r) const
+        {
+            return r.mnSize == 0 && r.mnCount == 0;
+        }
+    };
+
+  public:
+    LineHistogram () : mnSorted (0) {}
+
+    void add (unsigned nFileId, int nLine, size_t nSize, size_t nCount = 1)
+    {
+        // consecutive ranges mostly are on the same line
+        if (!maLines.empty() && maLines.back().mnFileId == nFileId &&
+            maLines.back().mnLine == nLine)
+        {
+            maLines.back().mnSize += nSize;
+            maLines.back().mnCount += nCount;
+            return;
+        }
+        LineCount aCount = { nFileId, nLine, nSize, nCount };
+        maLines.push_back (aCount);
+        if (maLines.size() >= 2 * mnSorted + 8)
+            compact();
+    }
+
+    void compact () const
+    {
+        if (mnSorted == maLines.size())
+            return;
+        std::sort (maLines.begin(), maLines.end());
+        size_t nOut = 0;
+        for (size_t i = 0; i < maLines.size(); i++)
+        {
+            if (nOut > 0 && maLines[nOut - 1].sameLine (maLines[i]))
+            {
+                maLines[nOut - 1].mnSize += maLines[i].mnSize;
+                maLines[nOut - 1].mnCount += maLines[i].mnCount;
+            }
+            else
+                maLines[nOut++] = maLines[i];
+        }
+        maLines.resize (nOut);
+        mnSorted = nOut;
+    }
+
+    // Adds the lines of another histogram, or takes them away again.
+    void merge (const LineHistogram &rOther, bool bAdd)
+    {
+        rOther.compact();
+        if (bAdd)
+        {
+            for (size_t i = 0; i < rOther.maLines.size(); i++)
+                add (rOther.maLines[i].mnFileId, rOther.maLines[i].mnLine,
+                     rOther.maLines[i].mnSize, rOther.maLines[i].mnCount);
+            return;
+        }
+        compact();
+        for (size_t i = 0; i < rOther.maLines.size(); i++)
+        {
+            std::vector< LineCount >::iterator it;
+            it = std::lower_bound (maLines.begin(), maLines.end(),
+                                   rOther.maLines[i]);
+            assert (it != maLines.end() && it->sameLine (rOther.maLines[i]));
+            it->mnSize -= rOther.maLines[i].mnSize;
+            it->mnCount -= rOther.maLines[i].mnCount;
+        }
+        maLines.erase (std::remove_if (maLines.begin(), maLines.end(), Empty()),
+                       maLines.end());
+        mnSorted = maLines.size();
+    }
+
+    bool empty () const { return maLines.empty(); }
+
+    // The same lines, with the file ids of rFrom turned into those of rTo.
+    LineHistogram renamed (const NamePool &rFrom, NamePool &rTo) const
+    {
+        LineHistogram aRenamed;
+        const std::vector< LineCount > &rLines = lines();
+        for (size_t i = 0; i < rLines.size(); i++)
+        {
+            const char *pFile = rFrom.name (rLines[i].mnFileId);
+            aRenamed.add (rTo.intern (pFile, strlen (pFile)), rLines[i].mnLine,
+                          rLines[i].mnSize, rLines[i].mnCount);
+        }
+        return aRenamed;
+    }
+
+    const std::vector< LineCount > &lines () const
+    {
+        compact();
+        return maLines;
+    }
+};
+
+struct FileSystemNode;
+struct FileSystemNode {
+    const char     *mpName;
+    unsigned        mnNameId;
+    int             mnNameLen;
+    FileSystemNode *mpParent;
+    NamePool       *mpNames;  // of the whole tree, which must outlive it
+
+    typedef std::vector< FileSystemNode * > ChildsType; // Hamburg nostalgia
+    ChildsType      maChildren;
+
+    // A root, with its names in pNames
+    FileSystemNode (NamePool *pNames)
+    {
+        init (pNames, NULL, "", 0);
+    }
+
+    FileSystemNode (FileSystemNode *pParent,
+                    const char *pName, int nLength)
+    {
+        init (pParent->mpNames, pParent, pName, nLength);
+    }
+
+    void init (NamePool *pNames, FileSystemNode *pParent,
+               const char *pName, int nLength)
+    {
+        mpNames = pNames;
+        mnNameId = mpNames->intern (pName, nLength, &mpName);
+        mnNameLen = nLength;
+        mpParent = pParent;
+        if (mpParent)
+            mpParent->maChildren.push_back(this);
+        mnSize = 0;
+        useCount = 0;
+        mnSamples = 0;
+        mnShown = 0;
+        mpLines = NULL;
+    }
+
+    static FileSystemNode *getNode (FileSystemNode *pRoot, const char *pPath)
+    {
+        assert (pPath != NULL);
+        FileSystemNode *pNode = pRoot;
+        for (int last = 0, i = 0; pPath[i]; i++)
+        {
+            if (pPath[i] == '/')
+            {
+                if (i - last > 0)
+                {
+                    FileSystemNode *pChild;
+                    pChild = pNode->lookupNode(pPath + last, i - last);
+                    assert (pChild != NULL);
+                    pNode = pChild;
+                }
+                last = i + 1;
+            }
+        }
+        return pNode;
+    }
+
+    // Paths come canonical (cf. path_canonical): a name is just a name.
+    FileSystemNode *lookupNode (const char *pName, int nLength)
+    {
+        // slow as you like etc.
+        for (ChildsType::iterator it = maChildren.begin();
+             it != maChildren.end(); ++it)
+        {
+            if ((*it)->mnNameLen == nLength &&
+                !memcmp ((*it)->mpName, pName, nLength))
+                return *it;
+        }
+        return new FileSystemNode(this, pName, nLength);
+    }
+
+    // Payload
+    size_t mnSize;
+
+    size_t useCount;
+
+    // Profile samples hitting the code below (cf. --samples)
+    size_t mnSamples;
+
+    // How many (leading) children the report shows, cf. sortChildren
+    size_t mnShown;
+
+    // Code per source line, of functions and their directories (cf.
+    // --lines: files are no nodes of their own), or NULL
+    LineHistogram *mpLines;
+
+    void addLine (unsigned nFileId, int nLine, size_t nSize)
+    {
+        if (!mpLines)
+            mpLines = new LineHistogram;
+        mpLines->add (nFileId, nLine, nSize);
+    }
+
+    // Size accumulated down the tree
+    void addSize (size_t nSize)
+    {
+        mnSize += nSize;
+        useCount++;
+        if (mpParent != NULL)
+            mpParent->addSize (nSize);
+    }
+
+    void addSamples (size_t nSamples)
+    {
+        for (FileSystemNode *pNode = this; pNode; pNode = pNode->mpParent)
+            pNode->mnSamples += nSamples;
+    }
+
+    // Returns the node the size went to, or NULL.
+    static FileSystemNode *accumulate_size (FileSystemNode *pRoot,
+                                            const char *pName, const char *pFunc,
+                                            int line, int col, size_t size)
+    {
+        if (size == 0)
+        {
+// MJW - checkme - why is this zero so often ? ...
+//            fprintf (stderr, "odd zero size at '%s' '%s'\n", pName, pFunc);
+            return NULL;
+        }
+
+        if (pName == NULL) {
+            return NULL; /* some DIE have no names */
+        }
+        (void)line; (void)col; // later
+        FileSystemNode *pNode = getNode(pRoot, pName);
+        if (pFunc && *pFunc) // nameless variables stay with their file
+            pNode = pNode->lookupNode(pFunc, strlen(pFunc));
+        pNode->addSize (size);
+        return pNode;
+    }
+
+    struct NotEmpty {
+        bool operator() (const FileSystemNode *p) const
+        {
+            return p->mnSize != 0 || p->useCount != 0 || !p->maChildren.empty();
+        }
+    };
+
+    /*
+     * Adds the sizes of another tree (e.g. that of one module) to this
+     * one, or takes them away again; nodes that end up empty are
+     * deleted. Sizes are already accumulated in pOther, so each node is
+     * visited once and nothing is propagated to the parents.
+     */
+    void mergeTree (const FileSystemNode *pOther, bool bAdd)
+    {
+        if (bAdd)
+        {
+            mnSize += pOther->mnSize;
+            useCount += pOther->useCount;
+            mnSamples += pOther->mnSamples;
+        }
+        else
+        {
+            assert (mnSize >= pOther->mnSize && useCount >= pOther->useCount);
+            mnSize -= pOther->mnSize;
+            useCount -= pOther->useCount;
+            mnSamples -= pOther->mnSamples;
+        }
+        if (pOther->mpLines)
+        {
+            if (!mpLines)
+                mpLines = new LineHistogram;
+            if (pOther->mpNames == mpNames)
+                mpLines->merge (*pOther->mpLines, bAdd);
+            else
+                mpLines->merge (pOther->mpLines->renamed (*pOther->mpNames,
+                                                          *mpNames), bAdd);
+        }
+
+        for (ChildsType::const_iterator it = pOther->maChildren.begin();
+             it != pOther->maChildren.end(); ++it)
+            lookupNode ((*it)->mpName, (*it)->mnNameLen)->mergeTree (*it, bAdd);
+
+        if (!bAdd)
+        {
+            ChildsType::iterator itEmpty;
+            itEmpty = std::partition (maChildren.begin(), maChildren.end(),
+                                      NotEmpty());
+            for (ChildsType::iterator it = itEmpty; it != maChildren.end(); ++it)
+                (*it)->deleteTree ();
+            maChildren.erase (itEmpty, maChildren.end());
+            mnShown = std::min (mnShown, maChildren.size());
+        }
+    }
+
+    // Deletes the tree below (and including) this node.
+    void deleteTree ()
+    {
+        for (ChildsType::iterator it = maChildren.begin();
+             it != maChildren.end(); ++it)
+            (*it)->deleteTree ();
+        delete mpLines;
+        delete this;
+    }
+
+    // One requested breakdown depth and the text rendered for it.
+    struct DepthReport {
+        int          mnDepth;
+        bool         mbSamples;   // with a samples column
+        OutputBuffer maOut;
+    };
+
+    // Writes one line, formatting the numbers once for all reports.
+    static void dumpLine (DepthReport **pReports, int nReports, int nLevel,
+                          size_t nSize, size_t nCount, size_t nSamples,
+                          const char *pName, size_t nNameLen)
+    {
+        OutputBuffer &rFirst = pReports[0]->maOut;
+        size_t nStart = rFirst.size();
+        rFirst.appendReportNumbers (nSize, nCount);
+        if (pReports[0]->mbSamples)
+            rFirst.appendReportSamples (nSamples);
+        size_t nNumbers = rFirst.size() - nStart;
+
+        for (int i = 0; i < nReports; i++)
+        {
+            OutputBuffer &rOut = pReports[i]->maOut;
+            if (i > 0)
+                rOut.append (rFirst.data() + nStart, nNumbers);
+            rOut.appendReportIndent (pReports[i]->mnDepth, nLevel);
+            rOut.append (pName, nNameLen);
+            rOut.append ('\n');
+        }
+    }
+
+    /*
+     * Render all requested depths in a single walk: the number columns
+     * are formatted once per node and shared by every depth that shows
+     * it. pReports is sorted deepest first, so the reports still
+     * interested in nLevel are always a prefix of it. Children beyond
+     * mnShown were pruned by sortChildren and get summed up in a
+     * single "(other N entries)" line.
+     */
+    void dumpDepths (DepthReport **pReports, int nReports, int nLevel)
+    {
+        while (nReports > 0 && pReports[nReports - 1]->mnDepth < nLevel)
+            nReports--;
+        if (nReports == 0)
+            return;
+
+        for (size_t i = 0; i < mnShown; i++)
+        {
+            FileSystemNode *pChild = maChildren[i];
+            dumpLine (pReports, nReports, nLevel,
+                      pChild->mnSize, pChild->useCount, pChild->mnSamples,
+                      pChild->mpName, pChild->mnNameLen);
+            pChild->dumpDepths (pReports, nReports, nLevel + 1);
+        }
+
+        if (mnShown < maChildren.size())
+        {
+            size_t nSize = 0, nCount = 0, nSamples = 0;
+            for (size_t i = mnShown; i < maChildren.size(); i++)
+            {
+                nSize += maChildren[i]->mnSize;
+                nCount += maChildren[i]->useCount;
+                nSamples += maChildren[i]->mnSamples;
+            }
+            char aName[64];
+            int nLen = snprintf (aName, sizeof (aName), "(other %lu entries)",
+                                 (unsigned long)(maChildren.size() - mnShown));
+            dumpLine (pReports, nReports, nLevel, nSize, nCount, nSamples,
+                      aName, nLen);
+        }
+    }
+
+    static bool big_first (FileSystemNode *a, FileSystemNode *b)
+    {
+        return a->mnSize > b->mnSize;
+    }
+
+    struct AtLeast {
+        size_t mnMin;
+        AtLeast (size_t nMin) : mnMin (nMin) {}
+        bool operator() (const FileSystemNode *p) const
+        {
+            return p->mnSize >= mnMin;
+        }
+    };
+
+    // Everything sorted, nothing pruned: for saving the whole tree.
+    void sortChildren()
+    {
+        std::sort (maChildren.begin(), maChildren.end(), big_first);
+        mnShown = maChildren.size();
+
+        for (ChildsType::iterator it = maChildren.begin();
+             it != maChildren.end(); ++it)
+            (*it)->sortChildren();
+    }
+
+    /*
+     * Sort just what the report will show: down to nLevels, only the
+     * children of at least nMinSize bytes, and of those only the
+     * biggest nTop (if non-zero). Selection is linear and only the
+     * shown part gets sorted, so the cost follows the report size.
+     */
+    void sortChildren (size_t nTop, size_t nMinSize, int nLevels)
+    {
+        ChildsType::iterator itKept = maChildren.end();
+        if (nMinSize > 0)
+        {
+            itKept = std::partition (maChildren.begin(), maChildren.end(),
+                                     AtLeast (nMinSize));
+        }
+        mnShown = itKept - maChildren.begin();
+
+        if (nTop > 0 && mnShown > nTop)
+        {
+            std::nth_element (maChildren.begin(), maChildren.begin() + nTop,
+                              itKept, big_first);
+            mnShown = nTop;
+        }
+        std::sort (maChildren.begin(), maChildren.begin() + mnShown, big_first);
+
+        if (nLevels > 0)
+            for (size_t i = 0; i < mnShown; i++)
+                maChildren[i]->sortChildren (nTop, nMinSize, nLevels - 1);
+    }
+};
+
+#endif // DWARFPROFILE_FSTREE_HXX
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,279 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * What inlining costs: every inlined instance of a function, summed up
+ * by the function it is an instance of.
+ */
+
+#include <vector>
+#include <string>
+#include <mutex>
+#include <algorithm>
+#include <boost/unordered_map.hpp>
+#include <boost/functional/hash.hpp>
+#include <stdlib.h>
+#include <string.h>
+#include <logging.hxx>
+#include <output.hxx>
+
+/*
+ * An inlined function is known by its name and declaration file and
+ * line: the abstract origin DIEs themselves are per CU, so their
+ * offsets would split one function into one entry per CU using it.
+ * Lookups go by a key pointing at the DIE's strings, so that the
+ * common case - an origin seen before - does not allocate.
+ */
+struct InlineKey {
+    const char *mpName;
+    const char *mpFile;
+    int         mnLine;
+
+    bool operator== (const InlineKey &rOther) const
+    {
+        return mnLine == rOther.mnLine &&
+               !strcmp (mpName, rOther.mpName) &&
+               !strcmp (mpFile, rOther.mpFile);
+    }
+};
+
+struct InlineKeyHash {
+    size_t operator() (const InlineKey &rKey) const
+    {
+        size_t nHash = boost::hash_range (rKey.mpName,
+                                          rKey.mpName + strlen (rKey.mpName));
+        boost::hash_combine (nHash, boost::hash_range (
+                                 rKey.mpFile, rKey.mpFile + strlen (rKey.mpFile)));
+        boost::hash_combine (nHash, rKey.mnLine);
+        return nHash;
+    }
+};
+
+// Callers by name; looked up by plain const char * as well.
+struct CallerHash {
+    size_t operator() (const std::string &rName) const
+    {
+        return boost::hash_range (rName.begin(), rName.end());
+    }
+    size_t operator() (const char *pName) const
+    {
+        return boost::hash_range (pName, pName + strlen (pName));
+    }
+};
+
+struct CallerEqual {
+    bool operator() (const char *pName, const std::string &rName) const
+    {
+        return rName == pName;
+    }
+};
+
+typedef boost::unordered_map< std::string, size_t, CallerHash > CallerMap;
+
+struct InlineStats {
+    size_t    mnBytes;
+    size_t    mnInstances;
+    size_t    mnLargest;     // biggest single instance
+    CallerMap maCallers;     // bytes inlined into each caller
+};
+
+typedef boost::unordered_map< InlineKey, InlineStats, InlineKeyHash > InlineMap;
+
+/*
+ * One table per walker (cf. --batch), so recording never takes a lock;
+ * the report merges them. Keys own copies of their strings.
+ */
+class InlineTable {
+    InlineMap maInlines;
+
+  public:
+    ~InlineTable ()
+    {
+        for (InlineMap::iterator it = maInlines.begin(); it != maInlines.end(); ++it)
+        {
+            free ((char *)it->first.mpName);
+            free ((char *)it->first.mpFile);
+        }
+    }
+
+    InlineStats &find (const InlineKey &rKey)
+    {
+        InlineMap::iterator it = maInlines.find (rKey);
+        if (it != maInlines.end())
+            return it->second;
+
+        InlineKey aOwned = { strdup (rKey.mpName), strdup (rKey.mpFile),
+                             rKey.mnLine };
+        InlineStats &rStats = maInlines[aOwned];
+        rStats.mnBytes = rStats.mnInstances = rStats.mnLargest = 0;
+        return rStats;
+    }
+
+    const InlineMap &inlines () const { return maInlines; }
+};
+
+// The tables of one analysis; they outlive the walkers filling them.
+class InlineReport {
+  public:
+    std::mutex                   maMutex;
+    std::vector< InlineTable * > maTables;
+
+    ~InlineReport ()
+    {
+        for (size_t i = 0; i < maTables.size(); i++)
+            delete maTables[i];
+    }
+};
+
+InlineReport *inline_report_new ()
+{
+    return new InlineReport;
+}
+
+void inline_report_free (InlineReport *report)
+{
+    delete report;
+}
+
+InlineTable *inline_table_new (InlineReport *report)
+{
+    InlineTable *pTable = new InlineTable;
+    std::lock_guard< std::mutex > aGuard (report->maMutex);
+    report->maTables.push_back (pTable);
+    return pTable;
+}
+
+void register_inline (InlineTable *table, const struct what_info *what,
+                      size_t size, const char *caller)
+{
+    InlineKey aKey = { what->name ? what->name : "",
+                       what->file ? what->file : "", what->line };
+    InlineStats &rStats = table->find (aKey);
+    rStats.mnBytes += size;
+    rStats.mnInstances++;
+    rStats.mnLargest = std::max (rStats.mnLargest, size);
+    if (!caller)
+        caller = "?";
+    CallerMap::iterator it = rStats.maCallers.find (caller, CallerHash(),
+                                                    CallerEqual());
+    if (it != rStats.maCallers.end())
+        it->second += size;
+    else
+        rStats.maCallers[caller] = size;
+}
+
+struct InlineEntry {
+    const InlineKey *mpKey;
+    InlineStats      maStats;
+};
+
+static bool most_bytes (const InlineEntry &a, const InlineEntry &b)
+{
+    return a.maStats.mnBytes > b.maStats.mnBytes;
+}
+
+typedef std::pair< size_t, const std::string * > CallerBytes;
+
+static bool biggest_caller (const CallerBytes &a, const CallerBytes &b)
+{
+    return a.first > b.first;
+}
+
+// How many callers to list per inlined function.
+#define INLINE_CALLERS 3
+
+void dump_inlines (InlineReport *report, size_t top)
+{
+    const std::vector< InlineTable * > &aTables = report->maTables;
+
+    // Merge the per walker tables into the first one seen of each key.
+    boost::unordered_map< InlineKey, size_t, InlineKeyHash > aIndex;
+    std::vector< InlineEntry > aEntries;
+    for (size_t i = 0; i < aTables.size(); i++)
+    {
+        const InlineMap &rInlines = aTables[i]->inlines();
+        for (InlineMap::const_iterator it = rInlines.begin();
+             it != rInlines.end(); ++it)
+        {
+            boost::unordered_map< InlineKey, size_t, InlineKeyHash >::iterator itIdx;
+            itIdx = aIndex.find (it->first);
+            if (itIdx == aIndex.end())
+            {
+                aIndex[it->first] = aEntries.size();
+                InlineEntry aEntry = { &it->first, it->second };
+                aEntries.push_back (aEntry);
+                continue;
+            }
+            InlineStats &rStats = aEntries[itIdx->second].maStats;
+            rStats.mnBytes += it->second.mnBytes;
+            rStats.mnInstances += it->second.mnInstances;
+            rStats.mnLargest = std::max (rStats.mnLargest, it->second.mnLargest);
+            for (CallerMap::const_iterator itCaller = it->second.maCallers.begin();
+                 itCaller != it->second.maCallers.end(); ++itCaller)
+                rStats.maCallers[itCaller->first] += itCaller->second;
+        }
+    }
+
+    size_t nShown = aEntries.size();
+    if (top > 0 && nShown > top)
+    {
+        std::nth_element (aEntries.begin(), aEntries.begin() + top,
+                          aEntries.end(), most_bytes);
+        nShown = top;
+    }
+    std::sort (aEntries.begin(), aEntries.begin() + nShown, most_bytes);
+
+    OutputBuffer aOut;
+    aOut.append ("\n---\n\n Inlined functions by origin\n\n"
+                 "Total Size Instances  Average  Largest Function"
+                 " (declared at) <- biggest callers\n");
+    std::vector< CallerBytes > aCallers;
+    for (size_t i = 0; i < nShown; i++)
+    {
+        const InlineKey &rKey = *aEntries[i].mpKey;
+        const InlineStats &rStats = aEntries[i].maStats;
+        aOut.appendNumber (rStats.mnBytes, 10);
+        aOut.append (' ');
+        aOut.appendNumber (rStats.mnInstances, 9);
+        aOut.append (' ');
+        aOut.appendNumber (rStats.mnBytes / rStats.mnInstances, 8);
+        aOut.append (' ');
+        aOut.appendNumber (rStats.mnLargest, 8);
+        aOut.append (' ');
+        aOut.append (rKey.mpName);
+        aOut.append (" (");
+        aOut.append (rKey.mpFile);
+        aOut.append (':');
+        aOut.appendNumber (rKey.mnLine);
+        aOut.append (')');
+
+        aCallers.clear ();
+        for (CallerMap::const_iterator it = rStats.maCallers.begin();
+             it != rStats.maCallers.end(); ++it)
+            aCallers.push_back (CallerBytes (it->second, &it->first));
+        size_t nCallers = std::min (aCallers.size(), (size_t)INLINE_CALLERS);
+        std::partial_sort (aCallers.begin(), aCallers.begin() + nCallers,
+                           aCallers.end(), biggest_caller);
+        for (size_t j = 0; j < nCallers; j++)
+        {
+            aOut.append (j == 0 ? " <- " : ", ");
+            aOut.append (aCallers[j].second->c_str());
+            aOut.append (' ');
+            aOut.appendNumber (aCallers[j].first);
+        }
+        if (aCallers.size() > nCallers)
+        {
+            aOut.append (", ... (");
+            aOut.appendNumber (aCallers.size());
+            aOut.append (" callers)");
+        }
+        aOut.append ('\n');
+        if (aOut.size() > (1 << 20))
+            aOut.write (stdout);
+    }
+    aOut.write (stdout);
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,142 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef DWARFPROFILE_INTERVALS_HXX
+#define DWARFPROFILE_INTERVALS_HXX
+
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * An immutable index of non-overlapping [start, end) ranges, each with
+ * a value, for mapping many addresses at once (cf. --samples).
+ *
+ * The starts are kept in Eytzinger order - the implicit binary tree of
+ * a heap, 1-based, children of k at 2k and 2k+1 - so a search walks the
+ * array front to back and the next four levels of a search fit in one
+ * prefetched cache line. Lookups in a batch advance a group of
+ * searches level by level together, so their cache misses overlap
+ * instead of each waiting for the last. Ends and values are kept in
+ * plain sorted order; maRank leads from a tree slot to its rank.
+ */
+template< typename T >
+class IntervalIndex {
+  public:
+    struct Interval {
+        uint64_t mnStart;
+        uint64_t mnEnd;
+        T        maValue;
+
+        bool operator< (const Interval &rOther) const
+        {
+            return mnStart < rOther.mnStart;
+        }
+    };
+
+  private:
+    std::vector< uint64_t > maTree;   // starts, Eytzinger order, [0] unused
+    std::vector< uint32_t > maRank;   // sorted index of each tree slot
+    std::vector< uint64_t > maEnds;   // sorted order from here on
+    std::vector< T >        maValues;
+    size_t                  mnSize;
+    int                     mnLevels;
+
+    size_t fill (const std::vector< Interval > &rSorted, size_t i, size_t k)
+    {
+        if (k <= mnSize)
+        {
+            i = fill (rSorted, i, 2 * k);
+            maTree[k] = rSorted[i].mnStart;
+            maRank[k] = i++;
+            i = fill (rSorted, i, 2 * k + 1);
+        }
+        return i;
+    }
+
+    // From the slot a search ended in to the interval holding nAddr.
+    const T *resolve (size_t k, uint64_t nAddr) const
+    {
+        // Undo the final right turns: k is then the first start > nAddr.
+        k >>= __builtin_ffsll (~k);
+        size_t nAbove = k ? maRank[k] : mnSize;
+        if (nAbove == 0 || nAddr >= maEnds[nAbove - 1])
+            return NULL;
+        return &maValues[nAbove - 1];
+    }
+
+  public:
+    IntervalIndex () : mnSize (0), mnLevels (0) {}
+
+    // Builds the index from intervals in any order; rIntervals is sorted.
+    void build (std::vector< Interval > &rIntervals)
+    {
+        std::sort (rIntervals.begin(), rIntervals.end());
+        mnSize = rIntervals.size();
+        maTree.assign (mnSize + 1, 0);
+        maRank.assign (mnSize + 1, 0);
+        fill (rIntervals, 0, 1);
+
+        maEnds.resize (mnSize);
+        maValues.clear ();
+        maValues.reserve (mnSize);
+        for (size_t i = 0; i < mnSize; i++)
+        {
+            maEnds[i] = rIntervals[i].mnEnd;
+            maValues.push_back (rIntervals[i].maValue);
+        }
+
+        mnLevels = 0;
+        while (((size_t)1 << mnLevels) <= mnSize)
+            mnLevels++;
+    }
+
+    size_t size () const { return mnSize; }
+
+    const T *lookup (uint64_t nAddr) const
+    {
+        size_t k = 1;
+        while (k <= mnSize)
+            k = 2 * k + (maTree[k] <= nAddr);
+        return resolve (k, nAddr);
+    }
+
+    // Looks up nAddrs addresses, writing the values found (or NULL).
+    void lookup (const uint64_t *pAddrs, size_t nAddrs, const T **ppValues) const
+    {
+        enum { LANES = 16 };
+        size_t aK[LANES];
+        for (size_t nFirst = 0; nFirst < nAddrs; nFirst += LANES)
+        {
+            size_t nLanes = std::min ((size_t)LANES, nAddrs - nFirst);
+            const uint64_t *pLane = pAddrs + nFirst;
+            for (size_t l = 0; l < nLanes; l++)
+                aK[l] = 1;
+
+            for (int nLevel = 0; nLevel < mnLevels; nLevel++)
+            {
+                for (size_t l = 0; l < nLanes; l++)
+                {
+                    size_t k = aK[l];
+                    if (k > mnSize)
+                        continue; // the last level is not full
+                    if (16 * k <= mnSize)
+                        __builtin_prefetch (&maTree[16 * k]);
+                    aK[l] = 2 * k + (maTree[k] <= pLane[l]);
+                }
+            }
+
+            for (size_t l = 0; l < nLanes; l++)
+                ppValues[nFirst + l] = resolve (aK[l], pLane[l]);
+        }
+    }
+};
+
+#endif // DWARFPROFILE_INTERVALS_HXX
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
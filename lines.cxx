@@ -0,0 +1,135 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Line histograms (--lines): which source lines of a function or directory
+ * the code comes from, to find the macro or inline expansion that
+ * blows it up.
+ */
+
+#include <vector>
+#include <algorithm>
+#include <logging.hxx>
+#include <fstree.hxx>
+
+// How many lines to list per function or directory.
+#define LINES_SHOWN 5
+
+/*
+ * Functions are the nodes with a histogram below one that has one
+ * too: their directory (files are no nodes of their own).
+ */
+static void collect (const FileSystemNode *pNode,
+                     std::vector< const FileSystemNode * > &rFunctions,
+                     std::vector< const FileSystemNode * > &rDirs)
+{
+    if (pNode->mpLines && pNode->mpParent)
+        (pNode->mpParent->mpLines ? rFunctions : rDirs).push_back (pNode);
+    for (size_t i = 0; i < pNode->maChildren.size(); i++)
+        collect (pNode->maChildren[i], rFunctions, rDirs);
+}
+
+static bool big_first (const FileSystemNode *a, const FileSystemNode *b)
+{
+    return a->mnSize > b->mnSize;
+}
+
+static bool big_line_first (const LineCount *a, const LineCount *b)
+{
+    return a->mnSize > b->mnSize;
+}
+
+static void append_path (OutputBuffer &rOut, const FileSystemNode *pNode)
+{
+    if (!pNode->mpParent)
+        return;
+    append_path (rOut, pNode->mpParent);
+    rOut.append ('/');
+    rOut.append (pNode->mpName, pNode->mnNameLen);
+}
+
+static void dump_table (OutputBuffer &rOut, const char *pTitle,
+                        std::vector< const FileSystemNode * > &rNodes,
+                        size_t top, bool bFunctions)
+{
+    size_t nShown = rNodes.size();
+    if (top > 0 && nShown > top)
+    {
+        std::nth_element (rNodes.begin(), rNodes.begin() + top,
+                          rNodes.end(), big_first);
+        nShown = top;
+    }
+    std::sort (rNodes.begin(), rNodes.begin() + nShown, big_first);
+
+    rOut.append ("\n---\n\n ");
+    rOut.append (pTitle);
+    rOut.append ("\n\nTotal Size   Ranges Line\n");
+
+    std::vector< const LineCount * > aLines;
+    for (size_t i = 0; i < nShown; i++)
+    {
+        const FileSystemNode *pNode = rNodes[i];
+        rOut.appendNumber (pNode->mnSize, 10);
+        rOut.append (' ');
+        rOut.appendNumber (pNode->useCount, 8);
+        rOut.append (' ');
+        if (bFunctions)
+        {
+            rOut.append (pNode->mpName, pNode->mnNameLen);
+            rOut.append (" (");
+            append_path (rOut, pNode->mpParent);
+            rOut.append (')');
+        }
+        else
+            append_path (rOut, pNode);
+        rOut.append ('\n');
+
+        const std::vector< LineCount > &rCounts = pNode->mpLines->lines();
+        aLines.clear();
+        for (size_t j = 0; j < rCounts.size(); j++)
+            aLines.push_back (&rCounts[j]);
+        size_t nLines = std::min (aLines.size(), (size_t)LINES_SHOWN);
+        std::partial_sort (aLines.begin(), aLines.begin() + nLines,
+                           aLines.end(), big_line_first);
+        for (size_t j = 0; j < nLines; j++)
+        {
+            const LineCount &rLine = *aLines[j];
+            rOut.appendNumber (rLine.mnSize, 10);
+            rOut.append (' ');
+            rOut.appendNumber (rLine.mnCount, 8);
+            rOut.append ("   ");
+            if (rLine.mnLine == 0)
+            {
+                rOut.append ("(no line)\n");
+                continue;
+            }
+            rOut.append (pNode->mpNames->name (rLine.mnFileId));
+            rOut.append (':');
+            rOut.appendNumber (rLine.mnLine);
+            rOut.append ('\n');
+        }
+        if (aLines.size() > nLines)
+        {
+            rOut.append ("                      (other ");
+            rOut.appendNumber (aLines.size() - nLines);
+            rOut.append (" lines)\n");
+        }
+        if (rOut.size() > (1 << 20))
+            rOut.write (stdout);
+    }
+}
+
+void dump_lines (const FileSystemNode *root, size_t top)
+{
+    std::vector< const FileSystemNode * > aFunctions, aDirs;
+    collect (root, aFunctions, aDirs);
+
+    OutputBuffer aOut;
+    dump_table (aOut, "Biggest functions by source line", aFunctions, top, true);
+    dump_table (aOut, "Biggest directories by source line", aDirs, top, false);
+    aOut.write (stdout);
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
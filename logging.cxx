@@ -9,7 +9,8 @@
 
 #include <memory>
 #include <vector>
-#include <set>
+#include <queue>
+#include <map>
 #include <functional>
 #include <string>
 #include <boost/shared_ptr.hpp>
@@ -19,7 +20,10 @@
 #include <malloc.h>
 #include <assert.h>
 #include <string.h>
+#include <gelf.h>
 #include <logging.hxx>
+#include <fstree.hxx>
+#include <workpool.hxx>
 
 typedef boost::shared_ptr< std::string > SharedString;
 
@@ -36,17 +40,17 @@ class SharedStringHashEqual {
 };
 typedef boost::unordered_set< SharedString, SharedStringHashEqual,
                               SharedStringHashEqual> StringHash;
-static StringHash aGlobalNames;
 
-static void globalise_string( SharedString &out, const char *pStr)
+static void globalise_string( StringHash &rNames, SharedString &out,
+                              const char *pStr)
 {
     SharedString str(new std::string(pStr)); // typical C++ / heinous waste
 
     StringHash::const_iterator it;
-    it = aGlobalNames.find (str);
-    if (it == aGlobalNames.end())
+    it = rNames.find (str);
+    if (it == rNames.end())
     {
-        aGlobalNames.insert (str);
+        rNames.insert (str);
         out = str;
     }
     else
@@ -62,13 +66,13 @@ struct AddressRecord {
     AddressRecord()
     {
     }
-    AddressRecord( const char *file, const char *func,
+    AddressRecord( StringHash &rNames, const char *file, const char *func,
                    int line, int col,
                    Dwarf_Addr start_pc, Dwarf_Addr end_pc ) :
         mLine (line), mCol (col), mStart_pc (start_pc), mEnd_pc (end_pc)
     {
-        globalise_string (mFile, file);
-        globalise_string (mFunc, func);
+        globalise_string (rNames, mFile, file);
+        globalise_string (rNames, mFunc, func);
     }
 
     bool operator<(const AddressRecord &cmp) const
@@ -87,9 +91,359 @@ struct AddressRecord {
     }
 };
 
-typedef std::set< AddressRecord > AddressSet;
+/*
+ * The records of a space: those from 0 to mnSettled are sorted by
+ * start, one per start; the rest are as registered, unsorted, until
+ * the next sweep settles them (cf. settle_records).
+ */
+typedef std::vector< AddressRecord > AddressRecords;
+
+// sorting and sweeping go parallel from this many records on, in slices
+// of as many
+#define PARALLEL_RECORDS (1 << 16)
+
+struct RecordKey {
+    Dwarf_Addr mnStart;
+    size_t     mnIndex; // the order they came in
+
+    bool operator< (const RecordKey &rOther) const
+    {
+        return mnStart < rOther.mnStart ||
+            (mnStart == rOther.mnStart && mnIndex < rOther.mnIndex);
+    }
+};
+typedef std::vector< RecordKey > RecordKeys;
+
+/*
+ * Sorts keys by start, stably, a byte at a time from the lowest up;
+ * the bytes all starts share (the top ones, mostly) are skipped. Every
+ * pass counts and then scatters in slices, a worker of pPool (if any)
+ * each: a slice scatters to where the counts of the slices before it
+ * end, so the order comes out the same whatever the number of threads.
+ */
+class RadixSort {
+    struct PassTask : public WorkPool::Task {
+        RadixSort *mpSort;
+        size_t     mnSlice;
+        bool       mbScatter;
+
+        PassTask (RadixSort *pSort, size_t nSlice, bool bScatter)
+            : mpSort (pSort), mnSlice (nSlice), mbScatter (bScatter) {}
+
+        virtual void run (WorkPool &, int)
+        {
+            mpSort->pass (mnSlice, mbScatter);
+        }
+    };
+
+    RecordKeys           &mrKeys;
+    RecordKeys            maOut;
+    WorkPool             *mpPool;
+    size_t                mnSlices;
+    int                   mnShift;
+    std::vector< size_t > maCounts; // by slice, then byte
+
+    void pass (size_t nSlice, bool bScatter)
+    {
+        size_t nFrom = mrKeys.size() * nSlice / mnSlices;
+        size_t nTo = mrKeys.size() * (nSlice + 1) / mnSlices;
+        size_t *pCounts = &maCounts[nSlice * 256];
+        for (size_t i = nFrom; i < nTo; i++)
+        {
+            size_t nByte = (mrKeys[i].mnStart >> mnShift) & 0xff;
+            if (bScatter)
+                maOut[pCounts[nByte]++] = mrKeys[i];
+            else
+                pCounts[nByte]++;
+        }
+    }
+
+    void run (bool bScatter)
+    {
+        if (mnSlices == 1)
+        {
+            pass (0, bScatter);
+            return;
+        }
+        for (size_t i = 0; i < mnSlices; i++)
+            mpPool->push (new PassTask (this, i, bScatter), i);
+        mpPool->run();
+    }
+
+  public:
+    RadixSort (RecordKeys &rKeys, WorkPool *pPool)
+        : mrKeys (rKeys), maOut (rKeys.size()), mpPool (pPool), mnSlices (1),
+          mnShift (0), maCounts (256)
+    {
+        if (mpPool && rKeys.size() >= PARALLEL_RECORDS)
+        {
+            mnSlices = std::min ((size_t)mpPool->workers(),
+                                 rKeys.size() / PARALLEL_RECORDS);
+            maCounts.resize (mnSlices * 256);
+        }
+    }
+
+    void sort ()
+    {
+        Dwarf_Addr nAnd = ~(Dwarf_Addr)0, nOr = 0;
+        for (size_t i = 0; i < mrKeys.size(); i++)
+        {
+            nAnd &= mrKeys[i].mnStart;
+            nOr |= mrKeys[i].mnStart;
+        }
+        for (mnShift = 0; mnShift < 64; mnShift += 8)
+        {
+            if ((((nAnd ^ nOr) >> mnShift) & 0xff) == 0)
+                continue;
+            std::fill (maCounts.begin(), maCounts.end(), 0);
+            run (false);
+            size_t nOffset = 0;
+            for (size_t nByte = 0; nByte < 256; nByte++)
+                for (size_t i = 0; i < mnSlices; i++)
+                {
+                    size_t nCount = maCounts[i * 256 + nByte];
+                    maCounts[i * 256 + nByte] = nOffset;
+                    nOffset += nCount;
+                }
+            run (true);
+            mrKeys.swap (maOut);
+        }
+    }
+};
+
+/*
+ * Variables (--data) don't take part in the sweep: they simply have a
+ * size. Keyed by address, as the same definition can turn up in
+ * several CUs.
+ */
+struct DataRecord {
+    SharedString mPath, mName;
+    size_t mnSize;
+};
+typedef std::map< Dwarf_Addr, DataRecord > DataMap;
+
+/*
+ * The line tables of the CUs walked (--lines), by address: each row
+ * holds up to the next one. The end of a sequence has no file.
+ */
+struct LineRow {
+    SharedString mFile;
+    int          mnLine;
+};
+typedef std::map< Dwarf_Addr, LineRow > LineRows;
+
+/*
+ * Code symbols of the module(s) being swept, to put names on the gaps
+ * between DIEs: CRT and assembly code, PLT stubs, thunks. Loaded for
+ * each module, sorted once per sweep and then binary searched per gap.
+ */
+struct GapSymbol {
+    Dwarf_Addr   mnStart;
+    Dwarf_Addr   mnEnd;    // == mnStart if the symbol has no size
+    SharedString mName;
+
+    bool operator< (const GapSymbol &rOther) const
+    {
+        return mnStart < rOther.mnStart;
+    }
+};
+typedef std::vector< GapSymbol > GapSymbols;
+
+struct GapStats {
+    size_t mnGaps;
+    size_t mnSymbolBytes, mnSymbolPieces;
+    size_t mnPaddingBytes, mnUnknownBytes;
+};
+
+typedef IntervalIndex< FileSystemNode * >::Interval NodeInterval;
+
+// --tree-jobs: the subtrees a module's tree is built in, merged in order
+#define TREE_SHARDS 64
+// ... once this many spans are waiting for them
+#define TREE_SHARD_BATCH (1 << 18)
+
+struct ShardSpan {
+    const char *mpFile;
+    const char *mpFunc;
+    size_t      mnSize;
+};
+
+/*
+ * Builds the tree of a module on several threads (--tree-jobs). Spans
+ * are dealt out to shards by the hash of their file, so that a shard
+ * gets whole files, and each shard is a subtree of its own, with a
+ * name pool of its own: no lock is taken by more than one thread, and
+ * there is no fighting over the sizes of the common ancestors. The
+ * shards get merged into the module's tree in shard order, which
+ * interns their names there, so the tree comes out the same whatever
+ * the number of threads and their timing.
+ */
+class ShardedTree {
+    struct BuildTask : public WorkPool::Task {
+        FileSystemNode           *mpRoot;
+        std::vector< ShardSpan > *mpSpans;
+
+        BuildTask (FileSystemNode *pRoot, std::vector< ShardSpan > *pSpans)
+            : mpRoot (pRoot), mpSpans (pSpans) {}
+
+        virtual void run (WorkPool &, int)
+        {
+            for (size_t i = 0; i < mpSpans->size(); i++)
+            {
+                const ShardSpan &rSpan = (*mpSpans)[i];
+                FileSystemNode::accumulate_size (mpRoot, rSpan.mpFile, rSpan.mpFunc,
+                                                 0, 0, rSpan.mnSize);
+            }
+            mpSpans->clear();
+        }
+    };
+
+    WorkPool                *mpPool;  // the space's
+    NamePool                *maNames[TREE_SHARDS];
+    FileSystemNode          *maRoots[TREE_SHARDS];
+    std::vector< ShardSpan > maSpans[TREE_SHARDS];
+    size_t                   mnWaiting;
+    const char              *mpLastFile; // spans come in runs of a file
+    size_t                   mnLastShard;
+
+  public:
+    ShardedTree (WorkPool *pPool)
+        : mpPool (pPool), mnWaiting (0), mpLastFile (NULL), mnLastShard (0)
+    {
+        for (int i = 0; i < TREE_SHARDS; i++)
+        {
+            maNames[i] = new NamePool;
+            maRoots[i] = new FileSystemNode (maNames[i]);
+        }
+    }
+
+    ~ShardedTree ()
+    {
+        for (int i = 0; i < TREE_SHARDS; i++)
+        {
+            maRoots[i]->deleteTree ();
+            delete maNames[i];
+        }
+    }
 
-static AddressSet space;
+    void span (const char *pFile, const char *pFunc, size_t nSize)
+    {
+        if (pFile != mpLastFile)
+        {
+            mnLastShard = boost::hash_range (pFile, pFile + strlen (pFile)) % TREE_SHARDS;
+            mpLastFile = pFile;
+        }
+        ShardSpan aSpan = { pFile, pFunc, nSize };
+        maSpans[mnLastShard].push_back (aSpan);
+        if (++mnWaiting >= TREE_SHARD_BATCH)
+            build();
+    }
+
+    // Builds what is waiting, before the names it points to may go.
+    void build ()
+    {
+        if (mnWaiting == 0)
+            return;
+        for (int i = 0; i < TREE_SHARDS; i++)
+            if (!maSpans[i].empty())
+                mpPool->push (new BuildTask (maRoots[i], &maSpans[i]), i);
+        mpPool->run();
+        mnWaiting = 0;
+        mpLastFile = NULL;
+    }
+
+    // Moves everything into pRoot, leaving the shards empty.
+    void mergeInto (FileSystemNode *pRoot)
+    {
+        build();
+        for (int i = 0; i < TREE_SHARDS; i++)
+        {
+            if (maRoots[i]->maChildren.empty())
+                continue;
+            pRoot->mergeTree (maRoots[i], true);
+            maRoots[i]->deleteTree ();
+            delete maNames[i];
+            maNames[i] = new NamePool;
+            maRoots[i] = new FileSystemNode (maNames[i]);
+        }
+    }
+};
+
+/*
+ * Everything known about the addresses of what is being walked, until
+ * it is swept into a tree. A space is only ever used by one thread at
+ * a time; batch workers each build their own and merge them.
+ */
+struct address_space {
+    StringHash              maNames;
+    AddressRecords          maRecords;
+    size_t                  mnSettled; // cf. AddressRecords
+    // the starts and ends of the settled records, for the sweep kernel
+    std::vector< Dwarf_Addr > maStarts, maEnds;
+    DataMap                 maData;
+    GapSymbols              maGapSymbols;
+    LineRows                maLines;
+    SharedString            maLastLineFile;
+    int                     mnProgress;
+    // samples of the module to map onto its tree (cf. select_samples)
+    sample_set             *mpSamples;
+    std::vector< uint64_t > maSamples;
+
+    // the sweep so far, when it is done in pieces (cf. flush_addresses_below)
+    bool                    mbSweeping;
+    Dwarf_Addr              mnSweepStart;
+    GapStats                maGaps;
+    FileSystemNode         *mpTree;
+    NamePool               *mpNames;  // ... and where its names go
+    std::vector< NodeInterval > maIntervals;
+    size_t                  mnNamesKept;
+    ShardedTree            *mpShards; // --tree-jobs, or NULL
+    WorkPool               *mpPool;   // to sort and sweep on, or NULL
+    const SweepKernel      *mpKernel; // to sweep with
+
+    address_space (NamePool *pNames)
+        : mnSettled (0), mnProgress (0), mpSamples (NULL),
+          mbSweeping (false), mnSweepStart (0), mpTree (NULL), mpNames (pNames),
+          mnNamesKept (0), mpShards (NULL), mpPool (NULL),
+          mpKernel (sweep_kernel_find (NULL))
+    {
+        memset (&maGaps, 0, sizeof (maGaps));
+    }
+
+    ~address_space ()
+    {
+        delete mpShards;
+        delete mpPool;
+    }
+};
+
+address_space *address_space_new (NamePool *pNames)
+{
+    return new address_space (pNames);
+}
+
+void address_space_free (address_space *pSpace)
+{
+    delete pSpace;
+}
+
+void address_space_tree_jobs (address_space *pSpace, int jobs)
+{
+    if (jobs == 0)
+        jobs = std::thread::hardware_concurrency();
+    delete pSpace->mpShards;
+    delete pSpace->mpPool;
+    pSpace->mpPool = jobs > 1 ? new WorkPool (jobs) : NULL;
+    // the shards are built on the space's threads
+    pSpace->mpShards = jobs > 1 ? new ShardedTree (pSpace->mpPool) : NULL;
+}
+
+void address_space_sweep_kernel (address_space *pSpace, const char *kernel)
+{
+    pSpace->mpKernel = sweep_kernel_find (kernel);
+    if (!pSpace->mpKernel)
+        pSpace->mpKernel = sweep_kernel_find (NULL);
+}
 
 void
 register_compile_unit (const char *name, size_t size)
@@ -98,74 +452,109 @@ register_compile_unit (const char *name, size_t size)
              name, (long)size);
 }
 
-void recursive_splitting_insert (const AddressRecord &ins)
+typedef std::pair< RecordKey, size_t > PieceKey; // (start, when), piece
+struct LaterPiece {
+    bool operator() (const PieceKey &a, const PieceKey &b) const
+    {
+        return b.first < a.first;
+    }
+};
+
+/*
+ * Sorts the records registered since the last sweep in with those it
+ * left, and makes it one record per start, the way inserting them one
+ * by one would have: where two start at the same address, the first
+ * stays if they also end at the same one; else the smaller wins for
+ * its range, which makes some sense at least, and the rest of the
+ * larger is chopped off to start after it - where it may meet the next
+ * one. So every start sees what arrives there in the order it arrives:
+ * records in the order they were registered in, and chopped pieces when
+ * whatever chopped them was.
+ */
+static void settle_records (address_space *pSpace)
 {
-    AddressSet::const_iterator it = space.find(ins);
+    AddressRecords &rRecords = pSpace->maRecords;
+    size_t nSettled = pSpace->mnSettled;
+    if (nSettled == rRecords.size())
+        return;
 
-    if ( it != space.end())
+    RecordKeys aNew (rRecords.size() - nSettled);
+    for (size_t i = 0; i < aNew.size(); i++)
     {
-        assert (it->mStart_pc == ins.mStart_pc);
-        if (it->mEnd_pc == ins.mEnd_pc &&
-            it->mLine == ins.mLine &&
-            it->mCol == ins.mCol)
-        {
-#if 0 // rather an interesting case here - the source of our grief initially I think.
-            if (*it->mFile != what->file)
-                fprintf (stderr, "Duplicate inline record start_pcs for two records !"
-                         "'%s:%d' (0x%lx->0x%lx) vs '%s:%d' (0x%lx->0x%lx)\n",
-                         it->mFile->c_str(), it->mLine, (long)it->mStart_pc, (long)it->mEnd_pc,
-                         ins.mFile->c_str(), ins.mLine, (long)ins.mStart_pc, (long)ins.mEnd_pc);
-#endif
-        }
-        else if (it->mEnd_pc == ins.mEnd_pc)
+        aNew[i].mnStart = rRecords[nSettled + i].mStart_pc;
+        aNew[i].mnIndex = nSettled + i;
+    }
+    RadixSort (aNew, pSpace->mpPool).sort();
+
+    // those settled before are the oldest at their start
+    RecordKeys aKeys (rRecords.size());
+    for (size_t i = 0; i < nSettled; i++)
+    {
+        aKeys[i].mnStart = rRecords[i].mStart_pc;
+        aKeys[i].mnIndex = i;
+    }
+    std::copy (aNew.begin(), aNew.end(), aKeys.begin() + nSettled);
+    std::inplace_merge (aKeys.begin(), aKeys.begin() + nSettled, aKeys.end());
+    RecordKeys().swap (aNew);
+
+    AddressRecords aSettled;
+    aSettled.reserve (rRecords.size());
+    std::vector< Dwarf_Addr > &rStarts = pSpace->maStarts, &rEnds = pSpace->maEnds;
+    rStarts.clear();
+    rEnds.clear();
+    rStarts.reserve (rRecords.size());
+    rEnds.reserve (rRecords.size());
+    AddressRecords aPieces;
+    std::priority_queue< PieceKey, std::vector< PieceKey >, LaterPiece > aChopped;
+    size_t i = 0;
+    while (i < aKeys.size() || !aChopped.empty())
+    {
+        AddressRecord aRecord;
+        RecordKey aWhen;
+        if (!aChopped.empty() && (i == aKeys.size() || aChopped.top().first < aKeys[i]))
         {
-            // ignore - describes the same range : take pot luck
+            aWhen = aChopped.top().first;
+            aRecord = std::move (aPieces[aChopped.top().second]);
+            aChopped.pop();
         }
         else
         {
-#if 0 // happens really a lot as we sub-divide large die's recursively ...
-            fprintf (stderr, "Splitting identical start_pcs for two records !"
-                     "'%s:%d' (0x%lx->0x%lx) vs '%s:%d' (0x%lx->0x%lx)\n",
-                     it->mFile->c_str(), it->mLine, (long)it->mStart_pc, (long)it->mEnd_pc,
-                     ins.mFile->c_str(), ins.mLine, (long)ins.mStart_pc, (long)ins.mEnd_pc);
-#endif
-
-            // Nasty case ... lets let the smaller guy win for his
-            // range: that makes some sense at least.
-            AddressRecord aSmall;
-            AddressRecord aLarge;
+            aWhen = aKeys[i++];
+            aRecord = std::move (rRecords[aWhen.mnIndex]);
+        }
 
-            if (ins.mEnd_pc < it->mEnd_pc)
-            {
-                aSmall = ins;
-                aLarge = *it;
-            }
-            else
-            {
-                aLarge = ins;
-                aSmall = *it;
-            }
-            space.erase(it);
+        if (aSettled.empty() || aSettled.back().mStart_pc != aRecord.mStart_pc)
+        {
+            rStarts.push_back (aRecord.mStart_pc);
+            rEnds.push_back (aRecord.mEnd_pc);
+            aSettled.push_back (std::move (aRecord));
+            continue;
+        }
+        AddressRecord &rFirst = aSettled.back();
+        if (rFirst.mEnd_pc == aRecord.mEnd_pc)
+            continue; // describes the same range: take pot luck
 
-            // chop ...
-            aLarge.mStart_pc = aSmall.mEnd_pc + 1;
-//            fprintf (stderr,"  split into two pieces: sizes 0x%lx and 0x%lx\n",
-//                     aSmall.pcDifference(), aLarge.pcDifference());
-            space.insert (aSmall);
-            if (aLarge.mEnd_pc > aLarge.mStart_pc)
-                recursive_splitting_insert (aLarge);
+        if (aRecord.mEnd_pc < rFirst.mEnd_pc)
+        {
+            std::swap (aRecord, rFirst);
+            rEnds.back() = rFirst.mEnd_pc;
+        }
+        aRecord.mStart_pc = rFirst.mEnd_pc + 1; // chop ...
+        if (aRecord.mEnd_pc > aRecord.mStart_pc)
+        {
+            aWhen.mnStart = aRecord.mStart_pc;
+            aChopped.push (PieceKey (aWhen, aPieces.size()));
+            aPieces.push_back (std::move (aRecord));
         }
     }
-    else // 95% common case
-    {
-        space.insert (ins);
-    }
+    rRecords.swap (aSettled);
+    pSpace->mnSettled = rRecords.size();
 }
 
 /*
  * Build a layered series of spans
  */
-void register_address_span (struct what_info *what,
+void register_address_span (address_space *pSpace, struct what_info *what,
                             Dwarf_Addr start_pc, Dwarf_Addr end_pc)
 {
 //    fprintf (stderr, "start pc 0x%lx end pc 0x%lx\n", start_pc, end_pc);
@@ -175,61 +564,536 @@ void register_address_span (struct what_info *what,
         return;
     }
 
-    static int nProgress = 0;
-    if ((++nProgress % 4096) == 0)
+    if ((++pSpace->mnProgress % 4096) == 0)
         fprintf (stderr, ".");
 
-    recursive_splitting_insert (
-        AddressRecord (what->file, what->name,
+    pSpace->maRecords.push_back (
+        AddressRecord (pSpace->maNames, what->file, what->name,
                        what->line, what->col,
                        start_pc, end_pc));
 }
 
-void scan_addresses_to_fs_tree()
+void register_data (address_space *pSpace, const char *section,
+                    const char *file, const char *name,
+                    Dwarf_Addr addr, size_t size)
 {
-    fprintf (stderr, "* scan address space ...\n");
+    if (pSpace->maData.find (addr) != pSpace->maData.end())
+        return;
 
-    AddressSet::const_iterator it = space.begin();
-    AddressSet::const_iterator prev = space.begin();
-    AddressSet::const_iterator end = space.end();
+    std::string aPath (section);
+    if (!file || file[0] != '/')
+        aPath += '/';
+    aPath += file ? file : "unknown";
 
-    if (it != end)
-        ++it;
+    DataRecord aRecord;
+    globalise_string (pSpace->maNames, aRecord.mPath, aPath.c_str());
+    globalise_string (pSpace->maNames, aRecord.mName, name ? name : "");
+    aRecord.mnSize = size;
+    pSpace->maData[addr] = aRecord;
+}
 
-    for (;it != end; ++it)
+void register_line (address_space *pSpace, Dwarf_Addr addr,
+                    const char *file, int line)
+{
+    LineRow aRow;
+    aRow.mnLine = line;
+    if (!file) // the end of a sequence never hides the start of another
     {
-//        if (prev->mEnd_pc > it->mStart_pc)
-//            fprintf (stderr, "overlapping dies\n"); // these happen.
+        pSpace->maLines.insert (LineRows::value_type (addr, aRow));
+        return;
+    }
+    // rows come in runs of the same file
+    if (!pSpace->maLastLineFile || strcmp (pSpace->maLastLineFile->c_str(), file))
+        globalise_string (pSpace->maNames, pSpace->maLastLineFile, file);
+    aRow.mFile = pSpace->maLastLineFile;
+    pSpace->maLines[addr] = aRow;
+}
 
-        assert (prev->mStart_pc < it->mStart_pc); // check sorted.
+void gap_symbols_load (address_space *pSpace, Dwfl_Module *mod)
+{
+    Dwarf_Addr nBias;
+    if (!dwfl_module_getdwarf (mod, &nBias))
+        return;
+
+    int nSyms = dwfl_module_getsymtab (mod);
+    for (int i = 1; i < nSyms; i++)
+    {
+        GElf_Sym aSym;
+        GElf_Addr nAddr;
+        GElf_Word nShndx;
+        Elf *pElf;
+        Dwarf_Addr nElfBias;
+        const char *pName = dwfl_module_getsym_info (mod, i, &aSym, &nAddr,
+                                                     &nShndx, &pElf, &nElfBias);
+        int nType = GELF_ST_TYPE (aSym.st_info);
+        if (!pName || !*pName || nShndx == SHN_UNDEF ||
+            (nType != STT_FUNC && nType != STT_NOTYPE))
+            continue;
 
-        size_t size = prev->mEnd_pc - prev->mStart_pc;
-        assert (size >= 0);
+        // Only code: skip data symbols that happen to be NOTYPE.
+        GElf_Shdr aShdr;
+        Elf_Scn *pScn = elf_getscn (pElf, nShndx);
+        if (!pScn || !gelf_getshdr (pScn, &aShdr) ||
+            !(aShdr.sh_flags & SHF_EXECINSTR))
+            continue;
 
-        if (prev->mEnd_pc > it->mStart_pc)
-            size = it->mStart_pc - prev->mStart_pc;
-        else if (prev->mEnd_pc < it->mStart_pc)
+        GapSymbol aSymbol;
+        aSymbol.mnStart = nAddr - nBias;
+        aSymbol.mnEnd = aSymbol.mnStart + aSym.st_size;
+        globalise_string (pSpace->maNames, aSymbol.mName, pName);
+        pSpace->maGapSymbols.push_back (aSymbol);
+    }
+}
+
+static const char *gap_file = "/gaps/";
+static const char *gap_symbol_file = "/gaps/symbols/";
+static const char *gap_padding = "padding";
+static const char *gap_unknown = "unknown";
+
+// Fewer bytes than the alignment of the code following them.
+static bool is_padding (Dwarf_Addr nStart, Dwarf_Addr nEnd)
+{
+    Dwarf_Addr nAlign = nEnd & (~nEnd + 1); // lowest bit set
+    return nAlign != 0 && nEnd - nStart < std::min (nAlign, (Dwarf_Addr)64);
+}
+
+/*
+ * Splits a gap into the pieces covered by symbols, which are named
+ * after them, and the rest, which is alignment padding or unknown. A
+ * symbol without a size is taken to reach up to the next one.
+ */
+static void resolve_gap (const GapSymbols &gap_symbols,
+                         struct address_sink *sink, Dwarf_Addr nStart,
+                         Dwarf_Addr nEnd, GapStats &rStats)
+{
+    rStats.mnGaps++;
+    GapSymbol aKey;
+    while (nStart < nEnd)
+    {
+        aKey.mnStart = nStart;
+        GapSymbols::const_iterator itNext;
+        itNext = std::upper_bound (gap_symbols.begin(), gap_symbols.end(), aKey);
+        Dwarf_Addr nNext = itNext != gap_symbols.end() ?
+                           std::min (itNext->mnStart, nEnd) : nEnd;
+
+        if (itNext != gap_symbols.begin())
         {
-            size_t gap = it->mStart_pc - prev->mEnd_pc;
-            if (gap > 4)
-                fprintf (stderr, "unusual large gap between "
-                         "%s(%s) and %s(%s) 0x%lx -> 0x%lx (%ld bytes)\n",
-                         prev->mFile->c_str(), prev->mFunc->c_str(),
-                         it->mFile->c_str(), it->mFunc->c_str(),
-                         (long)prev->mEnd_pc, (long)prev->mStart_pc,
-                         (long)gap);
-            fs_register_size ("/gaps", "gap", 0, 0, gap);
+            GapSymbols::const_iterator it = itNext - 1;
+            Dwarf_Addr nSymEnd = it->mnEnd > it->mnStart ? it->mnEnd : nNext;
+            if (nStart < nSymEnd)
+            {
+                Dwarf_Addr nPieceEnd = std::min (nSymEnd, nEnd);
+                sink->span (gap_symbol_file, it->mName->c_str(), 0, 0,
+                            nStart, nPieceEnd - nStart);
+                rStats.mnSymbolBytes += nPieceEnd - nStart;
+                rStats.mnSymbolPieces++;
+                nStart = nPieceEnd;
+                continue;
+            }
         }
 
-        if (size > 0)
-            fs_register_size (prev->mFile->c_str(), prev->mFunc->c_str(),
-                              prev->mLine, prev->mCol, size);
+        bool bPadding = is_padding (nStart, nNext);
+        sink->span (gap_file, bPadding ? gap_padding : gap_unknown, 0, 0,
+                    nStart, nNext - nStart);
+        (bPadding ? rStats.mnPaddingBytes : rStats.mnUnknownBytes) +=
+            nNext - nStart;
+        nStart = nNext;
+    }
+}
+
+// records to a round of the sweep kernel
+#define SWEEP_BLOCK 256
+
+/*
+ * Sweeps records nFrom to nTo of a settled space: each covers what it
+ * does up to where the next one starts, and a gap before that goes to
+ * the gap symbols. The kernel works that out a block at a time, right
+ * on the arrays of starts and ends; the rest is up to the records.
+ */
+static void sweep_records (const address_space *pSpace,
+                           struct address_sink *sink, size_t nFrom, size_t nTo,
+                           GapStats &rGaps)
+{
+    const AddressRecords &rRecords = pSpace->maRecords;
+    const GapSymbols &gap_symbols = pSpace->maGapSymbols;
+    Dwarf_Addr aSizes[SWEEP_BLOCK];
+    unsigned char aGaps[SWEEP_BLOCK];
+
+    for (size_t nBlock = nFrom; nBlock < nTo; nBlock += SWEEP_BLOCK)
+    {
+        size_t n = std::min ((size_t)SWEEP_BLOCK, nTo - nBlock);
+        // the starts go one further: the start after the last
+        const Dwarf_Addr *aStarts = &pSpace->maStarts[nBlock];
+        const Dwarf_Addr *aEnds = &pSpace->maEnds[nBlock];
+        sweep_kernel (pSpace->mpKernel, aStarts, aEnds, n, aSizes, aGaps);
+
+        for (size_t i = 0; i < n; i++)
+        {
+//            if (aEnds[i] > aStarts[i + 1])
+//                fprintf (stderr, "overlapping dies\n"); // these happen.
+
+            assert (aStarts[i] < aStarts[i + 1]); // check sorted.
+
+            if (aGaps[i])
+                resolve_gap (gap_symbols, sink, aEnds[i], aStarts[i + 1], rGaps);
+
+            if (aSizes[i] > 0)
+            {
+                const AddressRecord &rPrev = rRecords[nBlock + i];
+                sink->span (rPrev.mFile->c_str(), rPrev.mFunc->c_str(),
+                            rPrev.mLine, rPrev.mCol, rPrev.mStart_pc, aSizes[i]);
+            }
+        }
+    }
+}
+
+/*
+ * A slice of a sweep on a thread of its own: as a record only needs the
+ * next one, slices can start anywhere, but the sink wants its spans in
+ * order, so they are kept and passed on after.
+ */
+struct SweepSlice : public address_sink {
+    struct Span {
+        const char *mpFile, *mpFunc;
+        int         mnLine, mnCol;
+        Dwarf_Addr  mnStart;
+        size_t      mnSize;
+    };
+    std::vector< Span > maSpans;
+    GapStats            maGaps;
+
+    virtual void span (const char *file, const char *func, int line, int col,
+                       Dwarf_Addr start, size_t size)
+    {
+        Span aSpan = { file, func, line, col, start, size };
+        maSpans.push_back (aSpan);
+    }
+
+    void passOn (struct address_sink *sink, GapStats &rGaps)
+    {
+        for (size_t i = 0; i < maSpans.size(); i++)
+            sink->span (maSpans[i].mpFile, maSpans[i].mpFunc, maSpans[i].mnLine,
+                        maSpans[i].mnCol, maSpans[i].mnStart, maSpans[i].mnSize);
+        maSpans.clear();
+        rGaps.mnGaps += maGaps.mnGaps;
+        rGaps.mnSymbolBytes += maGaps.mnSymbolBytes;
+        rGaps.mnSymbolPieces += maGaps.mnSymbolPieces;
+        rGaps.mnPaddingBytes += maGaps.mnPaddingBytes;
+        rGaps.mnUnknownBytes += maGaps.mnUnknownBytes;
+    }
+};
+
+struct SweepTask : public WorkPool::Task {
+    const address_space *mpSpace;
+    SweepSlice          *mpSlice;
+    size_t               mnFrom, mnTo;
+
+    SweepTask (const address_space *pSpace, SweepSlice *pSlice,
+               size_t nFrom, size_t nTo)
+        : mpSpace (pSpace), mpSlice (pSlice), mnFrom (nFrom), mnTo (nTo) {}
+
+    virtual void run (WorkPool &, int)
+    {
+        memset (&mpSlice->maGaps, 0, sizeof (mpSlice->maGaps));
+        sweep_records (mpSpace, mpSlice, mnFrom, mnTo, mpSlice->maGaps);
+    }
+};
+
+/*
+ * Sweeps records into the sink in address order, gaps included, and
+ * erases them. What a record covers ends where the next one starts, so
+ * unless bAll it is only swept once the next one starts at or below
+ * nLimit: records still to come all start at nLimit or above, and can
+ * no longer change it. The last record stays for the next sweep.
+ */
+static void sweep (address_space *pSpace, struct address_sink *sink,
+                   Dwarf_Addr nLimit, bool bAll)
+{
+    settle_records (pSpace);
+    AddressRecords &rRecords = pSpace->maRecords;
+    GapSymbols &gap_symbols = pSpace->maGapSymbols;
+
+    if (rRecords.empty())
+        return;
+
+    if (!pSpace->mbSweeping)
+    {
+        std::sort (gap_symbols.begin(), gap_symbols.end());
+        pSpace->mnSweepStart = rRecords[0].mStart_pc;
+        pSpace->mbSweeping = true;
+    }
+
+    // those whose next one starts at or below nLimit
+    size_t nCount = rRecords.size() - 1;
+    if (!bAll)
+    {
+        const std::vector< Dwarf_Addr > &rStarts = pSpace->maStarts;
+        nCount = std::upper_bound (rStarts.begin() + 1, rStarts.end(), nLimit) -
+                 rStarts.begin() - 1;
+    }
+
+    WorkPool *pPool = pSpace->mpPool;
+    if (pPool && nCount >= PARALLEL_RECORDS)
+    {
+        size_t nJobs = pPool->workers();
+        std::vector< SweepSlice > aSlices (nJobs);
+        for (size_t nFrom = 0; nFrom < nCount; )
+        {
+            size_t nSlices = 0;
+            for (; nSlices < nJobs && nFrom < nCount; nSlices++)
+            {
+                size_t nTo = std::min (nFrom + PARALLEL_RECORDS, nCount);
+                pPool->push (new SweepTask (pSpace, &aSlices[nSlices], nFrom, nTo),
+                             nSlices);
+                nFrom = nTo;
+            }
+            pPool->run();
+            for (size_t i = 0; i < nSlices; i++)
+                aSlices[i].passOn (sink, pSpace->maGaps);
+        }
+    }
+    else
+        sweep_records (pSpace, sink, 0, nCount, pSpace->maGaps);
 
-        prev = it;
+    if (!bAll)
+    {
+        rRecords.erase (rRecords.begin(), rRecords.begin() + nCount);
+        pSpace->maStarts.erase (pSpace->maStarts.begin(),
+                                pSpace->maStarts.begin() + nCount);
+        pSpace->maEnds.erase (pSpace->maEnds.begin(),
+                              pSpace->maEnds.begin() + nCount);
+        pSpace->mnSettled = rRecords.size();
+        return;
     }
-    // loose the last element guy, but hey ...
+
+    // nothing left to overlap the last one
+    const AddressRecord &rLast = rRecords.back();
+    if (rLast.mEnd_pc > rLast.mStart_pc)
+        sink->span (rLast.mFile->c_str(), rLast.mFunc->c_str(),
+                    rLast.mLine, rLast.mCol, rLast.mStart_pc,
+                    rLast.mEnd_pc - rLast.mStart_pc);
+
     fprintf (stderr, "check: total size from dies %ld\n",
-             (long)(prev->mEnd_pc - space.begin()->mStart_pc));
+             (long)(rLast.mEnd_pc - pSpace->mnSweepStart));
+    rRecords.clear();
+    pSpace->maStarts.clear();
+    pSpace->maEnds.clear();
+    pSpace->mnSettled = 0;
+}
+
+void scan_addresses (address_space *pSpace, struct address_sink *sink)
+{
+    fprintf (stderr, "* scan address space ...\n");
+
+    sweep (pSpace, sink, 0, true);
+
+    const GapStats &aGaps = pSpace->maGaps;
+    if (pSpace->mbSweeping)
+        fprintf (stderr, "* %lu gaps: %lu bytes in %lu pieces of symbols,"
+                 " %lu bytes padding, %lu bytes unknown\n",
+                 (unsigned long)aGaps.mnGaps,
+                 (unsigned long)aGaps.mnSymbolBytes,
+                 (unsigned long)aGaps.mnSymbolPieces,
+                 (unsigned long)aGaps.mnPaddingBytes,
+                 (unsigned long)aGaps.mnUnknownBytes);
+    if (pSpace->mpShards) // they point at the names of the gap symbols
+        pSpace->mpShards->build();
+    pSpace->maGapSymbols.clear();
+    pSpace->mbSweeping = false;
+    memset (&pSpace->maGaps, 0, sizeof (pSpace->maGaps));
+}
+
+struct fs_tree_sink : public address_sink
+{
+    FileSystemNode *mpRoot;
+    std::vector< NodeInterval > *mpIntervals; // where each span went, or NULL
+    const LineRows *mpLines;                  // to split spans by, or NULL
+    const std::string *mpLastFile;            // ... the last file they were
+    unsigned mnLastFileId;                    // in, and its id
+    ShardedTree *mpShards;                    // to build the tree, or NULL
+
+    /* The shards know nothing of nodes until they are merged, so
+       intervals (--samples) and lines are built here. */
+    fs_tree_sink (FileSystemNode *pRoot, std::vector< NodeInterval > *pIntervals,
+                  const LineRows *pLines, ShardedTree *pShards)
+        : mpRoot (pRoot), mpIntervals (pIntervals),
+          mpLines (pLines && !pLines->empty() ? pLines : NULL),
+          mpLastFile (NULL), mnLastFileId (0),
+          mpShards (pIntervals || mpLines ? NULL : pShards) {}
+
+    unsigned fileId (const std::string &rFile)
+    {
+        if (&rFile != mpLastFile)
+        {
+            mnLastFileId = mpRoot->mpNames->intern (rFile.c_str(),
+                                                    rFile.size());
+            mpLastFile = &rFile;
+        }
+        return mnLastFileId;
+    }
+
+    /*
+     * Splits a span over the line table rows covering it, for the
+     * function and its directory. Lines go by file and line, as the
+     * code of a function may come from other files too: macros and
+     * inlines of headers without a DIE of their own.
+     */
+    void lines (FileSystemNode *pNode, FileSystemNode *pDir,
+                Dwarf_Addr start, size_t size)
+    {
+        Dwarf_Addr nFrom = start, nEnd = start + size;
+        LineRows::const_iterator itNext = mpLines->upper_bound (start);
+        LineRows::const_iterator itRow = itNext;
+        bool bRow = itRow != mpLines->begin();
+        if (bRow)
+            --itRow;
+        while (nFrom < nEnd)
+        {
+            Dwarf_Addr nTo = itNext != mpLines->end() ?
+                             std::min (itNext->first, nEnd) : nEnd;
+            unsigned nFileId = 0;
+            int nLine = 0;
+            if (bRow && itRow->second.mFile)
+            {
+                nLine = itRow->second.mnLine;
+                nFileId = fileId (*itRow->second.mFile);
+            }
+            pNode->addLine (nFileId, nLine, nTo - nFrom);
+            if (pDir)
+                pDir->addLine (nFileId, nLine, nTo - nFrom);
+
+            nFrom = nTo;
+            itRow = itNext;
+            bRow = true;
+            if (itNext != mpLines->end())
+                ++itNext;
+        }
+    }
+
+    virtual void span (const char *file, const char *func, int line, int col,
+                       Dwarf_Addr start, size_t size)
+    {
+        if (mpShards)
+        {
+            mpShards->span (file, func, size);
+            return;
+        }
+        FileSystemNode *pNode;
+        pNode = FileSystemNode::accumulate_size (mpRoot, file, func, line, col, size);
+        if (mpIntervals && pNode)
+        {
+            NodeInterval aInterval = { start, start + size, pNode };
+            mpIntervals->push_back (aInterval);
+        }
+        // Gaps are no function's code; and without a function name
+        // pNode is the directory already (cf. accumulate_size).
+        if (mpLines && pNode && file != gap_file && file != gap_symbol_file)
+            lines (pNode, func && *func ? pNode->mpParent : NULL, start, size);
+    }
+};
+
+void merge_address_space (address_space *pInto, address_space *pSpace)
+{
+    // settled, they come as if inserted in order, after pInto's
+    settle_records (pSpace);
+    if (pInto->maRecords.empty())
+    {
+        pInto->maRecords.swap (pSpace->maRecords);
+        pInto->maStarts.swap (pSpace->maStarts);
+        pInto->maEnds.swap (pSpace->maEnds);
+        pInto->mnSettled = pInto->maRecords.size();
+    }
+    else
+        pInto->maRecords.insert (pInto->maRecords.end(),
+                                 pSpace->maRecords.begin(),
+                                 pSpace->maRecords.end());
+    pInto->maData.insert (pSpace->maData.begin(), pSpace->maData.end());
+    // by the rule of register_line: a row with a file wins
+    for (LineRows::iterator it = pSpace->maLines.begin();
+         it != pSpace->maLines.end(); ++it)
+    {
+        if (it->second.mFile)
+            pInto->maLines[it->first] = it->second;
+        else
+            pInto->maLines.insert (*it);
+    }
+    delete pSpace;
+}
+
+void select_samples (address_space *pSpace, sample_set *samples,
+                     const char *module, Dwarf_Addr low, Dwarf_Addr high,
+                     Dwarf_Addr bias)
+{
+    pSpace->mpSamples = samples;
+    samples_select (samples, module, low, high, bias, pSpace->maSamples);
+}
+
+static FileSystemNode *module_tree (address_space *pSpace)
+{
+    if (!pSpace->mpTree)
+        pSpace->mpTree = new FileSystemNode (pSpace->mpNames);
+    return pSpace->mpTree;
+}
+
+void flush_addresses_below (address_space *pSpace, Dwarf_Addr limit)
+{
+    bool bSamples = !pSpace->maSamples.empty();
+    fs_tree_sink sink (module_tree (pSpace),
+                       bSamples ? &pSpace->maIntervals : NULL, &pSpace->maLines,
+                       pSpace->mpShards);
+    sweep (pSpace, &sink, limit, false);
+
+    // keep the line row the first record left starts in
+    LineRows &rLines = pSpace->maLines;
+    if (!rLines.empty() && !pSpace->maRecords.empty())
+    {
+        LineRows::iterator itKeep;
+        itKeep = rLines.upper_bound (pSpace->maRecords[0].mStart_pc);
+        if (itKeep != rLines.begin())
+            rLines.erase (rLines.begin(), --itKeep);
+    }
+
+    // Names only the hash still holds went with their records; look
+    // for them whenever it has doubled.
+    StringHash &rNames = pSpace->maNames;
+    if (rNames.size() < 2 * pSpace->mnNamesKept + 1024)
+        return;
+    if (pSpace->mpShards)
+        pSpace->mpShards->build();
+    for (StringHash::iterator it = rNames.begin(); it != rNames.end(); )
+    {
+        if (it->use_count() == 1)
+            it = rNames.erase (it);
+        else
+            ++it;
+    }
+    pSpace->mnNamesKept = rNames.size();
+}
+
+FileSystemNode *scan_addresses_to_module_tree (address_space *pSpace)
+{
+    FileSystemNode *pRoot = module_tree (pSpace);
+    pSpace->mpTree = NULL;
+    bool bSamples = !pSpace->maSamples.empty();
+    fs_tree_sink sink (pRoot, bSamples ? &pSpace->maIntervals : NULL,
+                       &pSpace->maLines, pSpace->mpShards);
+    scan_addresses (pSpace, &sink);
+    if (pSpace->mpShards)
+        pSpace->mpShards->mergeInto (pRoot);
+    pSpace->maLines.clear();
+    pSpace->maLastLineFile.reset();
+    if (bSamples)
+        samples_map (pSpace->mpSamples, pSpace->maIntervals, pSpace->maSamples);
+    pSpace->maIntervals.clear();
+    pSpace->maSamples.clear();
+
+    for (DataMap::const_iterator it = pSpace->maData.begin();
+         it != pSpace->maData.end(); ++it)
+        FileSystemNode::accumulate_size (pRoot, it->second.mPath->c_str(),
+                                         it->second.mName->c_str(), 0, 0,
+                                         it->second.mnSize);
+    pSpace->maData.clear();
+    return pRoot;
 }
 
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -5,10 +5,19 @@
  * file, You can obtain one at http://mozilla.org/MPL/2.0/.
  */
 
+#ifndef DWARFPROFILE_LOGGING_HXX
+#define DWARFPROFILE_LOGGING_HXX
+
 #include <dwarf.h>
 #include <elfutils/libdw.h>
 #include <elfutils/libdwfl.h>
 #include <stddef.h>
+#include <stdio.h>
+#include <string>
+#include <utility>
+#include <vector>
+#include <intervals.hxx>
+#include <dwarfprofile.hxx>
 
 /* Note that DIE offsets are only unique for a specific Dwfl module or
    file. We do keep them around for debugging (or to generate a name
@@ -22,14 +31,16 @@
    refer to the definition of the code location, not where or how much
    of the code is used, see where_info. The die_off is only used for
    debugging or when the name is unknown. */
+struct template_instance;
 struct what_info
 {
   int tag;
   Dwarf_Off die_off;
   const char *name;
-  char *file;
+  const char *file;
   int line;
   int col;
+  struct template_instance *instance; // --group-templates, else NULL
 };
 
 /* Where (and how) was the code used? The tag, file, line and col can
@@ -43,7 +54,7 @@ struct where_info
 {
   int tag;
   Dwarf_Off die_off;
-  char *file;
+  const char *file;
   int line;
   int col;
   Dwarf_Word size;
@@ -52,15 +63,157 @@ struct where_info
 // Not a beautiful API
 extern void register_compile_unit (const char *name, size_t size);
 
+/* what is known about the addresses of what is being walked; the trees
+   swept out of it have their names in names */
+struct address_space;
+class NamePool;
+extern address_space *address_space_new (NamePool *names);
+extern void address_space_free (address_space *space);
+/* sort, sweep and build the trees of the modules on this many threads
+   (0: one per CPU, 1: in the sweep itself) */
+extern void address_space_tree_jobs (address_space *space, int jobs);
+/* sweep with the kernel of this name (cf. dwarfprofile_options), the
+   best the CPU has if there is none such */
+extern void address_space_sweep_kernel (address_space *space,
+                                        const char *kernel);
+
 // build map of which address does what
-extern void register_address_span (struct what_info *what,
+extern void register_address_span (address_space *space, struct what_info *what,
                                    Dwarf_Addr start_pc, Dwarf_Addr end_pc);
-extern void scan_addresses_to_fs_tree ();
+// a variable (--data), filed below its section in the tree
+extern void register_data (address_space *space, const char *section,
+                           const char *file, const char *name,
+                           Dwarf_Addr addr, size_t size);
+/* a row of a CU's line table (--lines), to split the sweep by source
+   line with; a NULL file ends a sequence */
+extern void register_line (address_space *space, Dwarf_Addr addr,
+                           const char *file, int line);
+// the code symbols of a module, to name the gaps of the next sweep with
+extern void gap_symbols_load (address_space *space, Dwfl_Module *mod);
+// the samples of a module, to map onto the tree of the next sweep
+struct sample_set;
+extern void select_samples (address_space *space, sample_set *samples,
+                            const char *module, Dwarf_Addr low,
+                            Dwarf_Addr high, Dwarf_Addr bias);
+
+/* streaming: sweep what lies below limit, which nothing still to be
+   walked may start below, into the module's tree already */
+extern void flush_addresses_below (address_space *space, Dwarf_Addr limit);
+// sweep the module just walked into a tree of its own, emptying the space
+extern FileSystemNode *scan_addresses_to_module_tree (address_space *space);
+
+// move the records of one space into another, freeing it
+extern void merge_address_space (address_space *into, address_space *space);
+
+/* Receives the resolved, non-overlapping pieces of the address space
+   in address order, gaps included. File and function names are
+   interned, so equal names are always passed as the same pointer. */
+struct address_sink
+{
+  virtual ~address_sink () {}
+  virtual void span (const char *file, const char *func, int line, int col,
+                     Dwarf_Addr start, size_t size) = 0;
+};
+extern void scan_addresses (address_space *space, struct address_sink *sink);
+
+/* the sweep's arithmetic for n ranges sorted by start (starts has one
+   more, the start after the last): how much each covers up to the
+   next start, and whether a gap follows; by name as in the options,
+   NULL if there is no such kernel for this CPU */
+struct SweepKernel;
+extern const SweepKernel *sweep_kernel_find (const char *name);
+extern void sweep_kernel (const SweepKernel *kernel, const Dwarf_Addr *starts,
+                          const Dwarf_Addr *ends, size_t n,
+                          Dwarf_Addr *sizes, unsigned char *gaps);
+
+/* --prefix-map OLD=NEW, in the order given; false if it has no OLD */
+typedef std::vector< std::pair< std::string, std::string > > PrefixMap;
+extern bool prefix_map_add (PrefixMap &map, const char *mapping);
+
+/* the canonical (absolute, resolved, remapped, escaped) form of the
+   file paths of the DIEs: one cache per walker, set to the comp_dir of
+   each CU; the strings live as long as the cache */
+class PathCache;
+extern PathCache *path_cache_new (const PrefixMap &map);
+extern void path_cache_free (PathCache *cache);
+extern void path_cache_set_dir (PathCache *cache, const char *comp_dir);
+extern const char *path_canonical (PathCache *cache, const char *path);
+
+/* dwz alt files (.gnu_debugaltlink), each opened once and set as the
+   alt of every Dwarf referring to it; a cache is for one thread */
+class AltFiles;
+extern AltFiles *alt_files_new ();
+extern void alt_files_free (AltFiles *files);
+extern void alt_files_attach (AltFiles *files, Dwarf *dwarf,
+                              const char *debug_file);
+
+/* the debug sections of a module in file path, read ahead on a thread
+   of their own if readahead, and the walk of it timed from here until
+   the end, which reports as much for name (unless NULL) */
+class ModuleIO;
+extern ModuleIO *module_io_begin (Dwarf *dwarf, const char *path,
+                                  bool readahead);
+extern void module_io_end (ModuleIO *io, const char *name);
+
+/* the trees a context serves (cf. serve_tree_add) */
+class ServedTrees;
+extern void served_trees_free (ServedTrees *trees);
+
+/* inlined instances, summed up by what they are an instance of: one
+   table per walker, all of an analysis in its report */
+class InlineReport;
+class InlineTable;
+extern InlineReport *inline_report_new ();
+extern void inline_report_free (InlineReport *report);
+extern InlineTable *inline_table_new (InlineReport *report);
+extern void register_inline (InlineTable *table, const struct what_info *what,
+                             size_t size, const char *caller);
+extern void dump_inlines (InlineReport *report, size_t top);
+
+/* template instances, by mangled name, and the families they belong
+   to: one cache per walker, all of an analysis in its report */
+class TemplateReport;
+class TemplateCache;
+extern TemplateReport *template_report_new ();
+extern void template_report_free (TemplateReport *report);
+extern TemplateCache *template_cache_new (TemplateReport *report);
+extern template_instance *template_lookup (TemplateCache *cache,
+                                           const char *linkage_name,
+                                           const char *name);
+extern const char *template_family (const template_instance *instance);
+extern void template_add_size (template_instance *instance, size_t size);
+extern void dump_templates (TemplateReport *report, size_t top);
+
+// the biggest functions and files, each with its biggest lines
+extern void dump_lines (const FileSystemNode *root, size_t top);
+
+/* profile samples: PCs, selected per module before its sweep and
+   mapped onto the nodes the sweep created */
+extern sample_set *samples_load (const char *path);
+extern void samples_free (sample_set *samples);
+extern void samples_select (sample_set *samples, const char *module,
+                            Dwarf_Addr low, Dwarf_Addr high, Dwarf_Addr bias,
+                            std::vector< uint64_t > &selected);
+extern void samples_map (sample_set *samples,
+                         std::vector< IntervalIndex< FileSystemNode * >::Interval > &intervals,
+                         const std::vector< uint64_t > &selected);
+extern void samples_summary (const sample_set *samples);
+
+// the per-module trees, keyed by build-id, merged into the main tree
+extern bool fs_module_seen (dwarfprofile_context *ctx, const char *key);
+extern void fs_add_module (dwarfprofile_context *ctx, const char *key,
+                           FileSystemNode *tree);
+extern void fs_begin_modules (dwarfprofile_context *ctx);
+extern int fs_drop_unseen_modules (dwarfprofile_context *ctx);
+
+// several processes: which modules each one uses
+extern void fs_begin_process (dwarfprofile_context *ctx, int pid,
+                              const char *name);
 
-// when parsing map - map it to file system free
-extern void fs_register_size (const char *path, const char *func,
-                              int line, int col, size_t size);
+// batch: add an object's tree below a node of its own (thread safe)
+extern void fs_add_object (dwarfprofile_context *ctx, const char *name,
+                           FileSystemNode *tree);
 
-extern void dump_results ();
+#endif // DWARFPROFILE_LOGGING_HXX
 
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,159 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef DWARFPROFILE_OUTPUT_HXX
+#define DWARFPROFILE_OUTPUT_HXX
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * A growable character buffer with hand-rolled number formatting:
+ * printf's format parsing is a measurable cost when writing millions
+ * of report lines, so we build the text here and write it out in
+ * large chunks.
+ */
+class OutputBuffer {
+    char  *mpBuf;
+    size_t mnUsed;
+    size_t mnAlloc;
+
+    void grow (size_t nExtra)
+    {
+        size_t nNew = mnAlloc ? mnAlloc : 65536;
+        while (nNew < mnUsed + nExtra)
+            nNew *= 2;
+        char *pNew = (char *)realloc (mpBuf, nNew);
+        if (pNew == NULL)
+        {
+            fprintf (stderr, "out of memory growing output to %lu bytes\n",
+                     (unsigned long)nNew);
+            abort ();
+        }
+        mpBuf = pNew;
+        mnAlloc = nNew;
+    }
+
+    OutputBuffer (const OutputBuffer &); // not copyable
+    OutputBuffer &operator= (const OutputBuffer &);
+
+  public:
+    OutputBuffer () : mpBuf (NULL), mnUsed (0), mnAlloc (0) {}
+    ~OutputBuffer ()
+    {
+        free (mpBuf);
+    }
+
+    size_t size () const { return mnUsed; }
+    const char *data () const { return mpBuf; }
+
+    void append (const char *pStr, size_t nLen)
+    {
+        if (mnUsed + nLen > mnAlloc)
+            grow (nLen);
+        memcpy (mpBuf + mnUsed, pStr, nLen);
+        mnUsed += nLen;
+    }
+
+    void append (const char *pStr)
+    {
+        append (pStr, strlen (pStr));
+    }
+
+    void append (char c)
+    {
+        if (mnUsed + 1 > mnAlloc)
+            grow (1);
+        mpBuf[mnUsed++] = c;
+    }
+
+    void appendRepeat (char c, size_t nCount)
+    {
+        if (mnUsed + nCount > mnAlloc)
+            grow (nCount);
+        memset (mpBuf + mnUsed, c, nCount);
+        mnUsed += nCount;
+    }
+
+    // Like "%*lu": right aligned in nWidth, never truncated.
+    void appendNumber (unsigned long nValue, int nWidth = 0)
+    {
+        char aDigits[24];
+        int  nLen = formatNumber (aDigits, nValue);
+        if (nLen < nWidth)
+            appendRepeat (' ', nWidth - nLen);
+        append (aDigits, nLen);
+    }
+
+    // Writes digits into pOut (no terminator), returning their count.
+    static int formatNumber (char *pOut, unsigned long nValue)
+    {
+        char aTmp[24];
+        int  nLen = 0;
+        do {
+            aTmp[nLen++] = '0' + (nValue % 10);
+            nValue /= 10;
+        } while (nValue);
+        for (int i = 0; i < nLen; i++)
+            pOut[i] = aTmp[nLen - 1 - i];
+        return nLen;
+    }
+
+    // The "Breakdown at depth" report: a header per depth, then
+    // "%10lu %8lu %4lu " size, count and average, indent and name.
+    void appendReportHeader (int nDepth, bool bSamples = false)
+    {
+        append ("\n---\n\n Breakdown at depth ");
+        appendNumber (nDepth);
+        append (bSamples ? "\n\nTotal Size    Count   Av. M  Samples Element\n"
+                         : "\n\nTotal Size    Count   Av. M Element\n");
+    }
+
+    void appendReportNumbers (unsigned long nSize, unsigned long nCount)
+    {
+        appendNumber (nSize, 10);
+        append (' ');
+        appendNumber (nCount, 8);
+        append (' ');
+        appendNumber (nCount > 0 ? nSize / nCount : 0, 4);
+        append (' ');
+    }
+
+    // With --samples, "%8lu " profile samples after the numbers.
+    void appendReportSamples (unsigned long nSamples)
+    {
+        appendNumber (nSamples, 8);
+        append (' ');
+    }
+
+    // We used to index "|                " by the remaining depth; keep
+    // that layout for shallow depths, but without a maximum depth.
+    void appendReportIndent (int nDepth, int nLevel)
+    {
+        int nWidth = (nDepth < 17 ? 17 - nDepth : 0) + nLevel;
+        if (nLevel == nDepth)
+        {
+            append ('|');
+            nWidth--;
+        }
+        appendRepeat (' ', nWidth);
+    }
+
+    void clear () { mnUsed = 0; }
+
+    bool write (FILE *pFile)
+    {
+        bool bOk = fwrite (mpBuf, 1, mnUsed, pFile) == mnUsed;
+        mnUsed = 0;
+        return bOk;
+    }
+};
+
+#endif // DWARFPROFILE_OUTPUT_HXX
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
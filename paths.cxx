@@ -0,0 +1,182 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * The file paths of the DWARF, made canonical once: joined with the
+ * comp_dir of their CU, "." and ".." resolved, remapped (--prefix-map)
+ * and escaped. Every DIE names its file, but a program has few of them.
+ */
+
+#include <string.h>
+#include <string>
+#include <vector>
+#include <boost/functional/hash.hpp>
+#include <boost/unordered_map.hpp>
+#include <logging.hxx>
+
+struct PathHash {
+    size_t operator() (const std::string &rPath) const
+    {
+        return boost::hash_range (rPath.begin(), rPath.end());
+    }
+    size_t operator() (const char *pPath) const
+    {
+        return boost::hash_range (pPath, pPath + strlen (pPath));
+    }
+};
+
+struct PathEqual {
+    bool operator() (const char *pPath, const std::string &rPath) const
+    {
+        return rPath == pPath;
+    }
+};
+
+// raw path -> canonical one
+typedef boost::unordered_map< std::string, std::string, PathHash > PathMap;
+
+/*
+ * Drops empty and "." components, and ".." with the one before it;
+ * ".." at the root stays there, like the kernel has it.
+ */
+static std::string normalise (const std::string &rPath)
+{
+    bool bAbsolute = !rPath.empty() && rPath[0] == '/';
+    std::vector< std::string > aParts;
+    size_t nStart = 0;
+    while (nStart <= rPath.size())
+    {
+        size_t nEnd = rPath.find ('/', nStart);
+        if (nEnd == std::string::npos)
+            nEnd = rPath.size();
+        std::string aPart (rPath, nStart, nEnd - nStart);
+        nStart = nEnd + 1;
+
+        if (aPart.empty() || aPart == ".")
+            continue;
+        if (aPart == "..")
+        {
+            if (!aParts.empty() && aParts.back() != "..")
+                aParts.pop_back();
+            else if (!bAbsolute)
+                aParts.push_back (aPart); // nothing to resolve it against
+            continue;
+        }
+        aParts.push_back (aPart);
+    }
+
+    std::string aResult;
+    for (size_t i = 0; i < aParts.size(); i++)
+    {
+        if (i > 0 || bAbsolute)
+            aResult += '/';
+        aResult += aParts[i];
+    }
+    if (aResult.empty())
+        aResult = bAbsolute ? "/" : ".";
+    return aResult;
+}
+
+// whole components only: /src/foo is no prefix of /src/foobar
+static bool has_prefix (const std::string &rPath, const std::string &rPrefix)
+{
+    if (rPath.compare (0, rPrefix.size(), rPrefix))
+        return false;
+    return rPath.size() == rPrefix.size() || rPrefix == "/" ||
+        rPath[rPrefix.size()] == '/';
+}
+
+bool prefix_map_add (PrefixMap &rMap, const char *pMapping)
+{
+    const char *pEquals = strchr (pMapping, '=');
+    if (!pEquals || pEquals == pMapping)
+        return false;
+    std::string aOld (pMapping, pEquals - pMapping);
+    rMap.push_back (PrefixMap::value_type (normalise (aOld), pEquals + 1));
+    return true;
+}
+
+class PathCache {
+    const PrefixMap &mrMap;
+    boost::unordered_map< std::string, PathMap > maDirs; // by comp_dir
+    PathMap    *mpAbsolute; // the same whatever the comp_dir
+    PathMap    *mpDir;      // of the current CU
+    std::string maDir;
+
+    std::string canonical (const char *pPath) const
+    {
+        // We have a pseudo-main that contains all the data
+        if (!strcmp (pPath, "main"))
+            return "__main__";
+
+        std::string aPath;
+        if (pPath[0] != '/' && !maDir.empty())
+        {
+            aPath = maDir;
+            aPath += '/';
+        }
+        aPath = normalise (aPath + pPath);
+
+        // the last mapping given wins, like with -fdebug-prefix-map
+        for (size_t i = mrMap.size(); i-- > 0; )
+        {
+            if (!has_prefix (aPath, mrMap[i].first))
+                continue;
+            aPath = normalise (mrMap[i].second + '/' +
+                               aPath.substr (mrMap[i].first.size()));
+            break;
+        }
+
+        for (size_t i = 0; i < aPath.size(); i++)
+            if (aPath[i] == '<' || aPath[i] == '>' || aPath[i] == '&')
+                aPath[i] = '_';
+        return aPath;
+    }
+
+  public:
+    PathCache (const PrefixMap &rMap)
+        : mrMap (rMap)
+    {
+        mpAbsolute = &maDirs[std::string()];
+        mpDir = mpAbsolute;
+    }
+
+    void setDir (const char *pDir)
+    {
+        maDir = pDir ? pDir : "";
+        mpDir = &maDirs[maDir];
+    }
+
+    const char *lookup (const char *pPath)
+    {
+        PathMap &rPaths = pPath[0] == '/' ? *mpAbsolute : *mpDir;
+        PathMap::iterator it = rPaths.find (pPath, PathHash(), PathEqual());
+        if (it == rPaths.end())
+            it = rPaths.insert (PathMap::value_type (pPath, canonical (pPath))).first;
+        return it->second.c_str();
+    }
+};
+
+PathCache *path_cache_new (const PrefixMap &map)
+{
+    return new PathCache (map);
+}
+
+void path_cache_free (PathCache *cache)
+{
+    delete cache;
+}
+
+void path_cache_set_dir (PathCache *cache, const char *comp_dir)
+{
+    cache->setDir (comp_dir);
+}
+
+const char *path_canonical (PathCache *cache, const char *path)
+{
+    return path ? cache->lookup (path) : NULL;
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
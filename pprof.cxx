@@ -0,0 +1,230 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Writes the tree as a gzipped pprof profile.proto, see:
+ *     https://github.com/google/pprof/blob/master/proto/profile.proto
+ */
+
+#include <vector>
+#include <string>
+#include <stdint.h>
+#include <zlib.h>
+#include <logging.hxx>
+#include <fstree.hxx>
+
+/*
+ * Just enough of the protobuf wire format for profile.proto: varints
+ * and length delimited fields. Nested messages are built in a small
+ * scratch buffer and then copied in with their length prefix.
+ */
+class ProtoBuffer {
+    std::string maBuf;
+
+  public:
+    enum { VARINT = 0, LENGTH_DELIMITED = 2 };
+
+    const std::string &data () const { return maBuf; }
+    size_t size () const { return maBuf.size(); }
+    void clear () { maBuf.clear(); }
+
+    void varint (uint64_t nValue)
+    {
+        while (nValue >= 0x80)
+        {
+            maBuf += (char)(nValue | 0x80);
+            nValue >>= 7;
+        }
+        maBuf += (char)nValue;
+    }
+
+    void key (int nField, int nWireType)
+    {
+        varint (((uint64_t)nField << 3) | nWireType);
+    }
+
+    // proto3 semantics: zero is the default and is not written
+    void uint64Field (int nField, uint64_t nValue)
+    {
+        if (nValue == 0)
+            return;
+        key (nField, VARINT);
+        varint (nValue);
+    }
+
+    void bytesField (int nField, const char *pData, size_t nLength)
+    {
+        key (nField, LENGTH_DELIMITED);
+        varint (nLength);
+        maBuf.append (pData, nLength);
+    }
+
+    void messageField (int nField, const ProtoBuffer &rMessage)
+    {
+        bytesField (nField, rMessage.maBuf.data(), rMessage.maBuf.size());
+    }
+
+    void packedField (int nField, const std::vector< uint64_t > &rValues)
+    {
+        ProtoBuffer aPacked;
+        for (size_t i = 0; i < rValues.size(); i++)
+            aPacked.varint (rValues[i]);
+        messageField (nField, aPacked);
+    }
+};
+
+// Field numbers from profile.proto
+enum {
+    PROFILE_SAMPLE_TYPE = 1,
+    PROFILE_SAMPLE = 2,
+    PROFILE_LOCATION = 4,
+    PROFILE_FUNCTION = 5,
+    PROFILE_STRING_TABLE = 6,
+
+    VALUE_TYPE_TYPE = 1,
+    VALUE_TYPE_UNIT = 2,
+
+    SAMPLE_LOCATION_ID = 1,
+    SAMPLE_VALUE = 2,
+
+    LOCATION_ID = 1,
+    LOCATION_LINE = 4,
+
+    LINE_FUNCTION_ID = 1,
+
+    FUNCTION_ID = 1,
+    FUNCTION_NAME = 2,
+    FUNCTION_SYSTEM_NAME = 3
+};
+
+class PprofWriter {
+    gzFile      mpFile;
+    ProtoBuffer maOut;
+    ProtoBuffer maScratch;
+    ProtoBuffer maLine;
+    uint64_t    mnNextId;
+    std::vector< uint64_t > maStack; // location ids, root first
+    std::vector< uint64_t > maLocations;
+    std::vector< uint64_t > maValues;
+
+    void flush (bool bForce)
+    {
+        if (!bForce && maOut.size() < (1 << 20))
+            return;
+        if (maOut.size() > 0)
+            gzwrite (mpFile, maOut.data().data(), maOut.size());
+        maOut.clear ();
+    }
+
+    /*
+     * One function and location per node, with the node's own bytes
+     * and count as a sample whose stack is its path. Usually only the
+     * leaves have any bytes of their own.
+     */
+    void writeNode (const FileSystemNode *pNode)
+    {
+        uint64_t nId = mnNextId++;
+
+        maScratch.clear ();
+        maScratch.uint64Field (FUNCTION_ID, nId);
+        maScratch.uint64Field (FUNCTION_NAME, pNode->mnNameId);
+        maScratch.uint64Field (FUNCTION_SYSTEM_NAME, pNode->mnNameId);
+        maOut.messageField (PROFILE_FUNCTION, maScratch);
+
+        maLine.clear ();
+        maLine.uint64Field (LINE_FUNCTION_ID, nId);
+        maScratch.clear ();
+        maScratch.uint64Field (LOCATION_ID, nId);
+        maScratch.messageField (LOCATION_LINE, maLine);
+        maOut.messageField (PROFILE_LOCATION, maScratch);
+
+        maStack.push_back (nId);
+
+        size_t nSelfSize = pNode->mnSize;
+        size_t nSelfCount = pNode->useCount;
+        for (FileSystemNode::ChildsType::const_iterator it = pNode->maChildren.begin();
+             it != pNode->maChildren.end(); ++it)
+        {
+            nSelfSize -= (*it)->mnSize;
+            nSelfCount -= (*it)->useCount;
+        }
+        if (nSelfSize > 0)
+        {
+            maLocations.assign (maStack.rbegin(), maStack.rend()); // leaf first
+            maValues.clear ();
+            maValues.push_back (nSelfSize);
+            maValues.push_back (nSelfCount);
+
+            maScratch.clear ();
+            maScratch.packedField (SAMPLE_LOCATION_ID, maLocations);
+            maScratch.packedField (SAMPLE_VALUE, maValues);
+            maOut.messageField (PROFILE_SAMPLE, maScratch);
+        }
+        flush (false);
+
+        for (FileSystemNode::ChildsType::const_iterator it = pNode->maChildren.begin();
+             it != pNode->maChildren.end(); ++it)
+            writeNode (*it);
+
+        maStack.pop_back ();
+    }
+
+    void valueType (unsigned nType, unsigned nUnit)
+    {
+        maScratch.clear ();
+        maScratch.uint64Field (VALUE_TYPE_TYPE, nType);
+        maScratch.uint64Field (VALUE_TYPE_UNIT, nUnit);
+        maOut.messageField (PROFILE_SAMPLE_TYPE, maScratch);
+    }
+
+  public:
+    PprofWriter (gzFile pFile) : mpFile (pFile), mnNextId (1) {}
+
+    void write (const FileSystemNode *pRoot, const NamePool &rNames)
+    {
+        // The interned node names are the string table, as is.
+        for (size_t i = 0; i < rNames.size(); i++)
+        {
+            const char *pName = rNames.name (i);
+            maOut.bytesField (PROFILE_STRING_TABLE, pName, strlen (pName));
+            flush (false);
+        }
+        static const char *aExtra[] = { "size", "bytes", "entries", "count" };
+        unsigned nExtra = rNames.size();
+        for (size_t i = 0; i < sizeof (aExtra) / sizeof (aExtra[0]); i++)
+            maOut.bytesField (PROFILE_STRING_TABLE, aExtra[i], strlen (aExtra[i]));
+
+        valueType (nExtra, nExtra + 1);
+        valueType (nExtra + 2, nExtra + 3);
+
+        for (FileSystemNode::ChildsType::const_iterator it = pRoot->maChildren.begin();
+             it != pRoot->maChildren.end(); ++it)
+            writeNode (*it);
+
+        flush (true);
+    }
+};
+
+bool write_pprof (const FileSystemNode *root, const char *path)
+{
+    gzFile pFile = gzopen (path, "wb");
+    if (!pFile)
+    {
+        fprintf (stderr, "failed to open '%s' for writing\n", path);
+        return false;
+    }
+
+    PprofWriter aWriter (pFile);
+    aWriter.write (root, *root->mpNames);
+
+    if (gzclose (pFile) != Z_OK)
+    {
+        fprintf (stderr, "failed to write '%s'\n", path);
+        return false;
+    }
+    return true;
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
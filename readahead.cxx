@@ -0,0 +1,188 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * The debug sections of a module, read ahead of the walk: a first run
+ * over debuginfo on network storage otherwise spends most of its time
+ * faulting them in a page at a time. A thread of its own reads them in
+ * the order the walk needs them, while the walk gets going on what is
+ * there already; and the walk gets timed, so that cold and warm runs
+ * can be told apart.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <gelf.h>
+#include <logging.hxx>
+
+// what the reader asks for at a time, so that it can be stopped
+#define READAHEAD_CHUNK (8 << 20)
+
+// the order the walk reads them in: the CUs, their names, lines, ranges
+static const char *aSectionOrder[] = {
+    ".debug_abbrev", ".debug_info", ".debug_str", ".debug_str_offsets",
+    ".debug_line", ".debug_line_str", ".debug_addr", ".debug_rnglists",
+    ".debug_ranges", ".debug_aranges"
+};
+#define SECTION_KINDS (sizeof (aSectionOrder) / sizeof (aSectionOrder[0]))
+
+struct FileRange {
+    off_t  mnOffset;
+    size_t mnSize;
+};
+
+static double seconds (clockid_t nClock)
+{
+    struct timespec aNow;
+    clock_gettime (nClock, &aNow);
+    return aNow.tv_sec + aNow.tv_nsec * 1e-9;
+}
+
+static long major_faults ()
+{
+    struct rusage aUsage;
+    getrusage (RUSAGE_THREAD, &aUsage);
+    return aUsage.ru_majflt;
+}
+
+class ModuleIO {
+    int                       mnFd;
+    std::vector< FileRange >  maSections; // in reading order
+    size_t                    mnBytes;
+    size_t                    mnCached;   // of those, before we started
+    bool                      mbReadahead;
+    std::thread               maReader;
+    std::atomic< bool >       mbStop;
+    double                    mfWall, mfCpu; // at the start
+    long                      mnFaults;
+
+    void findSections (Elf *pElf)
+    {
+        size_t nStrndx;
+        if (elf_getshdrstrndx (pElf, &nStrndx) != 0)
+            return;
+        std::vector< FileRange > aKinds[SECTION_KINDS];
+        Elf_Scn *pScn = NULL;
+        while ((pScn = elf_nextscn (pElf, pScn)) != NULL)
+        {
+            GElf_Shdr aShdr;
+            if (gelf_getshdr (pScn, &aShdr) == NULL || aShdr.sh_type == SHT_NOBITS)
+                continue;
+            const char *pName = elf_strptr (pElf, nStrndx, aShdr.sh_name);
+            for (size_t i = 0; pName && i < SECTION_KINDS; i++)
+                if (!strcmp (pName, aSectionOrder[i]))
+                {
+                    FileRange aRange = { (off_t)aShdr.sh_offset, (size_t)aShdr.sh_size };
+                    aKinds[i].push_back (aRange);
+                }
+        }
+        for (size_t i = 0; i < SECTION_KINDS; i++)
+            maSections.insert (maSections.end(), aKinds[i].begin(), aKinds[i].end());
+    }
+
+    // How much of a range is in the page cache already.
+    size_t cached (const FileRange &rRange) const
+    {
+        size_t nPage = sysconf (_SC_PAGESIZE);
+        off_t nStart = rRange.mnOffset & ~(off_t)(nPage - 1);
+        size_t nLength = rRange.mnOffset + rRange.mnSize - nStart;
+        void *pMap = mmap (NULL, nLength, PROT_READ, MAP_SHARED, mnFd, nStart);
+        if (pMap == MAP_FAILED)
+            return 0;
+        std::vector< unsigned char > aResident ((nLength + nPage - 1) / nPage);
+        size_t nCached = 0;
+        if (mincore (pMap, nLength, &aResident[0]) == 0)
+            for (size_t i = 0; i < aResident.size(); i++)
+            {
+                if (!(aResident[i] & 1))
+                    continue;
+                // the first and last page may be some other section's too
+                off_t nFrom = std::max (nStart + (off_t)(i * nPage), rRange.mnOffset);
+                off_t nTo = std::min (nStart + (off_t)((i + 1) * nPage),
+                                      (off_t)(rRange.mnOffset + rRange.mnSize));
+                nCached += nTo - nFrom;
+            }
+        munmap (pMap, nLength);
+        return nCached;
+    }
+
+    void readAhead ()
+    {
+        for (size_t i = 0; i < maSections.size(); i++)
+            for (size_t nDone = 0; nDone < maSections[i].mnSize; nDone += READAHEAD_CHUNK)
+            {
+                if (mbStop)
+                    return;
+                readahead (mnFd, maSections[i].mnOffset + nDone,
+                           std::min ((size_t)READAHEAD_CHUNK,
+                                     maSections[i].mnSize - nDone));
+            }
+    }
+
+  public:
+    ModuleIO (Dwarf *pDwarf, const char *pPath, bool bReadahead)
+        : mnFd (-1), mnBytes (0), mnCached (0), mbReadahead (bReadahead),
+          mbStop (false)
+    {
+        mfWall = seconds (CLOCK_MONOTONIC);
+        mfCpu = seconds (CLOCK_THREAD_CPUTIME_ID);
+        mnFaults = major_faults();
+
+        Elf *pElf = pDwarf ? dwarf_getelf (pDwarf) : NULL;
+        if (!pElf || !pPath || (mnFd = open (pPath, O_RDONLY)) < 0)
+            return;
+        findSections (pElf);
+        for (size_t i = 0; i < maSections.size(); i++)
+        {
+            mnBytes += maSections[i].mnSize;
+            mnCached += cached (maSections[i]);
+        }
+        if (mbReadahead && mnCached < mnBytes)
+            maReader = std::thread (&ModuleIO::readAhead, this);
+    }
+
+    ~ModuleIO ()
+    {
+        mbStop = true;
+        if (maReader.joinable())
+            maReader.join();
+        if (mnFd >= 0)
+            close (mnFd);
+    }
+
+    void report (const char *pName) const
+    {
+        double fWall = seconds (CLOCK_MONOTONIC) - mfWall;
+        double fCpu = seconds (CLOCK_THREAD_CPUTIME_ID) - mfCpu;
+        fprintf (stderr, "* io: %s: %.1f MB of debug sections, %.0f%% cached%s;"
+                 " %ld major faults, %.2fs of %.2fs off CPU\n",
+                 pName, mnBytes / (1024.0 * 1024.0),
+                 mnBytes ? 100.0 * mnCached / mnBytes : 100.0,
+                 mnCached < mnBytes ? (mbReadahead ? ", read ahead" : ", cold") : "",
+                 major_faults() - mnFaults, std::max (fWall - fCpu, 0.0), fWall);
+    }
+};
+
+ModuleIO *module_io_begin (Dwarf *dwarf, const char *path, bool readahead)
+{
+    return new ModuleIO (dwarf, path, readahead);
+}
+
+void module_io_end (ModuleIO *io, const char *name)
+{
+    if (io && name)
+        io->report (name);
+    delete io;
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
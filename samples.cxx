@@ -0,0 +1,163 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Profile samples on the size tree: how much of the code is hot.
+ */
+
+#include <vector>
+#include <string>
+#include <atomic>
+#include <algorithm>
+#include <boost/unordered_set.hpp>
+#include <boost/unordered_map.hpp>
+#include <stdlib.h>
+#include <string.h>
+#include <logging.hxx>
+#include <fstree.hxx>
+
+struct Sample {
+    uint64_t    mnPC;
+    const char *mpDso;   // interned basename, NULL if not given
+
+    bool operator< (const Sample &rOther) const
+    {
+        return mnPC < rOther.mnPC;
+    }
+};
+
+/*
+ * All the samples of a profile, by PC; read-only once loaded, apart
+ * from the counts of how many of them were mapped, which the sweeps of
+ * any thread add to.
+ */
+struct sample_set {
+    std::vector< Sample >               maSamples;
+    boost::unordered_set< std::string > maDsoNames;
+    std::atomic< size_t >               mnInModules;
+    std::atomic< size_t >               mnInCode;
+
+    sample_set () : mnInModules (0), mnInCode (0) {}
+};
+
+static const char *basename_of (const char *pPath, size_t nLen)
+{
+    const char *pSlash = (const char *)memrchr (pPath, '/', nLen);
+    return pSlash ? pSlash + 1 : pPath;
+}
+
+/*
+ * Reads one PC per line, in hex with or without 0x, optionally
+ * followed by the object it is in, in parentheses - which is what
+ * 'perf script -F ip,dso' writes. Anything else on a line is ignored.
+ */
+sample_set *samples_load (const char *path)
+{
+    FILE *pFile = fopen (path, "r");
+    if (!pFile)
+    {
+        fprintf (stderr, "cannot read samples from '%s'\n", path);
+        return NULL;
+    }
+
+    sample_set *pSet = new sample_set;
+    std::vector< Sample > &aSamples = pSet->maSamples;
+    char *pLine = NULL;
+    size_t nLen = 0;
+    while (getline (&pLine, &nLen, pFile) != -1)
+    {
+        char *pEnd;
+        Sample aSample;
+        aSample.mnPC = strtoull (pLine, &pEnd, 16);
+        if (pEnd == pLine)
+            continue;
+
+        aSample.mpDso = NULL;
+        char *pOpen = strchr (pEnd, '(');
+        char *pClose = pOpen ? strrchr (pOpen, ')') : NULL;
+        if (pClose && pClose > pOpen + 1)
+        {
+            const char *pName = basename_of (pOpen + 1, pClose - pOpen - 1);
+            aSample.mpDso = pSet->maDsoNames.insert (
+                std::string (pName, pClose - pName)).first->c_str();
+        }
+        aSamples.push_back (aSample);
+    }
+    free (pLine);
+    fclose (pFile);
+
+    std::sort (aSamples.begin(), aSamples.end());
+    fprintf (stderr, "* %lu samples\n", (unsigned long)aSamples.size());
+    return pSet;
+}
+
+void samples_free (sample_set *samples)
+{
+    delete samples;
+}
+
+void samples_select (sample_set *samples, const char *module,
+                     Dwarf_Addr low, Dwarf_Addr high, Dwarf_Addr bias,
+                     std::vector< uint64_t > &selected)
+{
+    const std::vector< Sample > &aSamples = samples->maSamples;
+    const boost::unordered_set< std::string > &aDsoNames = samples->maDsoNames;
+    selected.clear ();
+
+    // Samples naming an object only go to a module of that name.
+    const char *pBase = basename_of (module, strlen (module));
+    boost::unordered_set< std::string >::const_iterator itDso;
+    itDso = aDsoNames.find (pBase);
+    const char *pDso = itDso != aDsoNames.end() ? itDso->c_str() : NULL;
+
+    Sample aKey;
+    aKey.mnPC = low;
+    std::vector< Sample >::const_iterator it;
+    it = std::lower_bound (aSamples.begin(), aSamples.end(), aKey);
+    for (; it != aSamples.end() && it->mnPC < high; ++it)
+    {
+        if (!it->mpDso || it->mpDso == pDso)
+            selected.push_back (it->mnPC - bias);
+    }
+    samples->mnInModules += selected.size();
+}
+
+void samples_map (sample_set *samples,
+                  std::vector< IntervalIndex< FileSystemNode * >::Interval > &intervals,
+                  const std::vector< uint64_t > &selected)
+{
+    IntervalIndex< FileSystemNode * > aIndex;
+    aIndex.build (intervals);
+
+    std::vector< FileSystemNode * const * > aHits (selected.size());
+    aIndex.lookup (&selected[0], selected.size(), &aHits[0]);
+
+    // Count per node first, so each node propagates up just once.
+    boost::unordered_map< FileSystemNode *, size_t > aCounts;
+    size_t nHits = 0;
+    for (size_t i = 0; i < aHits.size(); i++)
+    {
+        if (aHits[i])
+        {
+            aCounts[*aHits[i]]++;
+            nHits++;
+        }
+    }
+    for (boost::unordered_map< FileSystemNode *, size_t >::iterator it = aCounts.begin();
+         it != aCounts.end(); ++it)
+        it->first->addSamples (it->second);
+
+    samples->mnInCode += nHits;
+}
+
+void samples_summary (const sample_set *samples)
+{
+    fprintf (stderr, "* samples: %lu, %lu in the modules analysed,"
+             " %lu in their code\n", (unsigned long)samples->maSamples.size(),
+             (unsigned long)samples->mnInModules,
+             (unsigned long)samples->mnInCode);
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,744 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Keeps trees resident and answers line-delimited JSON queries on a
+ * local socket, one thread per connection. The trees are immutable
+ * snapshots, so the connections share them without any locking.
+ *
+ * Requests, one JSON object per line:
+ *   {"op":"trees"}
+ *   {"op":"subtree",  "tree":"t", "path":"/a/b"}
+ *   {"op":"children", "tree":"t", "path":"/a/b", "top":10}
+ *   {"op":"lookup",   "tree":"t", "path":"/a/b/c"}
+ *   {"op":"depth",    "tree":"t", "path":"/a", "depth":2, "top":10}
+ * "tree" defaults to the first tree loaded, "path" to the root.
+ */
+
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <logging.hxx>
+#include <fstree.hxx>
+#include <snapshot.hxx>
+#include <context.hxx>
+
+/*
+ * A snapshot plus an open addressing hash of (parent, name) -> node,
+ * so path lookups cost one probe per component however many children
+ * a directory has. Built once at load time and read-only afterwards.
+ */
+class ServedTree {
+    std::string             maName;
+    OutputBuffer            maImage; // for trees that are not mmapped
+    Snapshot                maSnap;
+    std::vector< uint32_t > maSlots; // node index + 1, 0 is empty
+    size_t                  mnMask;
+
+    static size_t hash (uint32_t nParent, const char *pName, size_t nLen)
+    {
+        size_t nHash = 14695981039346656037ULL ^ nParent; // FNV-1a
+        for (size_t i = 0; i < nLen; i++)
+            nHash = (nHash ^ (unsigned char)pName[i]) * 1099511628211ULL;
+        return nHash;
+    }
+
+    void buildIndex ()
+    {
+        size_t nSlots = 16;
+        while (nSlots < (size_t)maSnap.nodeCount() * 2)
+            nSlots *= 2;
+        maSlots.assign (nSlots, 0);
+        mnMask = nSlots - 1;
+
+        for (uint32_t i = 1; i < maSnap.nodeCount(); i++)
+        {
+            const SnapshotNode &rNode = maSnap.node (i);
+            size_t nSlot = hash (rNode.mnParent, maSnap.name (rNode),
+                                 rNode.mnNameLen) & mnMask;
+            while (maSlots[nSlot])
+                nSlot = (nSlot + 1) & mnMask;
+            maSlots[nSlot] = i + 1;
+        }
+    }
+
+    ServedTree (const ServedTree &); // not copyable
+    ServedTree &operator= (const ServedTree &);
+
+  public:
+    ServedTree (const char *pName) : maName (pName), mnMask (0) {}
+
+    bool open (const char *pPath)
+    {
+        if (!maSnap.open (pPath))
+            return false;
+        buildIndex ();
+        return true;
+    }
+
+    bool build (const FileSystemNode *pRoot, const NamePool &rNames)
+    {
+        build_snapshot (pRoot, rNames, maImage);
+        if (!maSnap.attach (maImage.data(), maImage.size()))
+            return false;
+        buildIndex ();
+        return true;
+    }
+
+    const std::string &name () const { return maName; }
+    const Snapshot &snapshot () const { return maSnap; }
+
+    uint32_t child (uint32_t nParent, const char *pName, size_t nLen) const
+    {
+        size_t nSlot = hash (nParent, pName, nLen) & mnMask;
+        for (; maSlots[nSlot]; nSlot = (nSlot + 1) & mnMask)
+        {
+            const SnapshotNode &rNode = maSnap.node (maSlots[nSlot] - 1);
+            if (rNode.mnParent == nParent && rNode.mnNameLen == nLen &&
+                !memcmp (maSnap.name (rNode), pName, nLen))
+                return maSlots[nSlot] - 1;
+        }
+        return 0;
+    }
+
+    // Resolves a path, filling in the nodes along it (root first).
+    bool lookup (const char *pPath, size_t nLen,
+                 std::vector< uint32_t > &rTrail) const
+    {
+        rTrail.clear ();
+        rTrail.push_back (0);
+        const char *pEnd = pPath + nLen;
+        while (pPath < pEnd)
+        {
+            if (*pPath == '/')
+            {
+                pPath++;
+                continue;
+            }
+            const char *pSep = (const char *)memchr (pPath, '/', pEnd - pPath);
+            size_t nComp = (pSep ? pSep : pEnd) - pPath;
+            uint32_t nChild = child (rTrail.back(), pPath, nComp);
+            if (nChild == 0)
+                return false;
+            rTrail.push_back (nChild);
+            pPath += nComp;
+        }
+        return true;
+    }
+};
+
+/*
+ * The trees served on a socket, and the connections they are served
+ * to: those get ended before the trees go.
+ */
+class ServedTrees {
+    std::vector< ServedTree * > maTrees;
+    std::mutex                  maMutex;   // for maClients
+    std::vector< int >          maClients; // open connections
+    std::atomic< int >          mnConnections;
+
+  public:
+    ServedTrees () : mnConnections (0) {}
+
+    ~ServedTrees ()
+    {
+        for (size_t i = 0; i < maTrees.size(); i++)
+            delete maTrees[i];
+    }
+
+    void add (ServedTree *pTree) { maTrees.push_back (pTree); }
+    size_t size () const { return maTrees.size(); }
+    const ServedTree &operator[] (size_t i) const { return *maTrees[i]; }
+    int connections () const { return mnConnections; }
+
+    void connected (int fd)
+    {
+        std::lock_guard< std::mutex > aGuard (maMutex);
+        maClients.push_back (fd);
+        mnConnections++;
+    }
+
+    // Closes a connection; not before it is out of maClients, so that
+    // hangUp never gets at an fd that has been reused.
+    void disconnected (int fd)
+    {
+        {
+            std::lock_guard< std::mutex > aGuard (maMutex);
+            maClients.erase (std::find (maClients.begin(), maClients.end(), fd));
+            close (fd);
+        }
+        mnConnections--;
+    }
+
+    // Ends all connections, and waits for their threads to finish.
+    void hangUp ()
+    {
+        {
+            std::lock_guard< std::mutex > aGuard (maMutex);
+            for (size_t i = 0; i < maClients.size(); i++)
+                shutdown (maClients[i], SHUT_RDWR);
+        }
+        while (mnConnections > 0)
+            usleep (10000);
+    }
+};
+
+void served_trees_free (ServedTrees *trees)
+{
+    delete trees;
+}
+
+/*
+ * Just enough JSON for our requests: a flat object whose members are
+ * strings or integers. Strings are unescaped in place in the line.
+ */
+class JsonRequest {
+    struct Member {
+        const char *mpKey;
+        size_t      mnKeyLen;
+        const char *mpStr;
+        size_t      mnStrLen;
+        long        mnNumber;
+        bool        mbString;
+    };
+    Member maMembers[16];
+    int    mnMembers;
+
+    static char *skipSpace (char *p, char *pEnd)
+    {
+        while (p < pEnd && (*p == ' ' || *p == '\t' || *p == '\r'))
+            p++;
+        return p;
+    }
+
+    // Parses a string starting at the opening quote; returns its end.
+    static char *parseString (char *p, char *pEnd, const char *&rStr,
+                              size_t &rLen)
+    {
+        char *pOut = ++p;
+        rStr = pOut;
+        while (p < pEnd && *p != '"')
+        {
+            if (*p == '\\' && p + 1 < pEnd)
+            {
+                p++;
+                switch (*p)
+                {
+                case 'n': *pOut++ = '\n'; break;
+                case 't': *pOut++ = '\t'; break;
+                default:  *pOut++ = *p;   break; // \" \\ \/
+                }
+                p++;
+            }
+            else
+                *pOut++ = *p++;
+        }
+        if (p >= pEnd)
+            return NULL;
+        rLen = pOut - rStr;
+        return p + 1;
+    }
+
+    const Member *find (const char *pKey) const
+    {
+        size_t nLen = strlen (pKey);
+        for (int i = 0; i < mnMembers; i++)
+            if (maMembers[i].mnKeyLen == nLen &&
+                !memcmp (maMembers[i].mpKey, pKey, nLen))
+                return &maMembers[i];
+        return NULL;
+    }
+
+  public:
+    JsonRequest () : mnMembers (0) {}
+
+    bool parse (char *p, char *pEnd)
+    {
+        mnMembers = 0;
+        p = skipSpace (p, pEnd);
+        if (p >= pEnd || *p != '{')
+            return false;
+        p = skipSpace (p + 1, pEnd);
+        if (p < pEnd && *p == '}')
+            return true;
+
+        while (p < pEnd && mnMembers < (int)(sizeof (maMembers) / sizeof (maMembers[0])))
+        {
+            Member &rMember = maMembers[mnMembers];
+            if (*p != '"' ||
+                !(p = parseString (p, pEnd, rMember.mpKey, rMember.mnKeyLen)))
+                return false;
+            p = skipSpace (p, pEnd);
+            if (p >= pEnd || *p != ':')
+                return false;
+            p = skipSpace (p + 1, pEnd);
+            if (p >= pEnd)
+                return false;
+            if (*p == '"')
+            {
+                rMember.mbString = true;
+                if (!(p = parseString (p, pEnd, rMember.mpStr, rMember.mnStrLen)))
+                    return false;
+            }
+            else
+            {
+                char *pNumEnd;
+                rMember.mbString = false;
+                rMember.mnNumber = strtol (p, &pNumEnd, 10);
+                if (pNumEnd == p)
+                    return false;
+                p = pNumEnd;
+            }
+            mnMembers++;
+
+            p = skipSpace (p, pEnd);
+            if (p < pEnd && *p == ',')
+                p = skipSpace (p + 1, pEnd);
+            else if (p < pEnd && *p == '}')
+                return true;
+            else
+                return false;
+        }
+        return false;
+    }
+
+    bool isString (const char *pKey, const char *pValue) const
+    {
+        const Member *pMember = find (pKey);
+        return pMember && pMember->mbString &&
+               pMember->mnStrLen == strlen (pValue) &&
+               !memcmp (pMember->mpStr, pValue, pMember->mnStrLen);
+    }
+
+    bool getString (const char *pKey, const char *&rStr, size_t &rLen) const
+    {
+        const Member *pMember = find (pKey);
+        if (!pMember || !pMember->mbString)
+            return false;
+        rStr = pMember->mpStr;
+        rLen = pMember->mnStrLen;
+        return true;
+    }
+
+    long getNumber (const char *pKey, long nDefault) const
+    {
+        const Member *pMember = find (pKey);
+        return (pMember && !pMember->mbString) ? pMember->mnNumber : nDefault;
+    }
+};
+
+static void appendJsonString (OutputBuffer &rOut, const char *pStr, size_t nLen)
+{
+    rOut.append ('"');
+    for (size_t i = 0; i < nLen; i++)
+    {
+        unsigned char c = pStr[i];
+        if (c == '"' || c == '\\')
+        {
+            rOut.append ('\\');
+            rOut.append ((char)c);
+        }
+        else if (c < 0x20)
+        {
+            static const char aHex[] = "0123456789abcdef";
+            rOut.append ("\\u00");
+            rOut.append (aHex[c >> 4]);
+            rOut.append (aHex[c & 0xf]);
+        }
+        else
+            rOut.append ((char)c);
+    }
+    rOut.append ('"');
+}
+
+static void appendError (OutputBuffer &rOut, const char *pMessage)
+{
+    rOut.append ("{\"ok\":false,\"error\":");
+    appendJsonString (rOut, pMessage, strlen (pMessage));
+    rOut.append ("}\n");
+}
+
+// "size":..,"count":.. members for a node
+static void appendSizes (OutputBuffer &rOut, const SnapshotNode &rNode)
+{
+    rOut.append ("\"size\":");
+    rOut.appendNumber (rNode.mnSize);
+    rOut.append (",\"count\":");
+    rOut.appendNumber (rNode.mnCount);
+}
+
+// rBuf is scratch space, grown to whatever the path needs
+static void appendPath (OutputBuffer &rOut, const Snapshot &rSnap, uint32_t nIdx,
+                        std::vector< char > &rBuf)
+{
+    size_t nNeed = rSnap.pathLength (nIdx) + 1;
+    if (rBuf.size() < nNeed)
+        rBuf.resize (nNeed);
+    size_t nLen = rSnap.path (nIdx, &rBuf[0], rBuf.size());
+    appendJsonString (rOut, &rBuf[0], nLen);
+}
+
+static bool bigger_node (const std::pair< uint64_t, uint32_t > &a,
+                         const std::pair< uint64_t, uint32_t > &b)
+{
+    return a.first > b.first || (a.first == b.first && a.second < b.second);
+}
+
+/* Per connection scratch space, reused between requests. */
+struct QueryState {
+    std::vector< uint32_t >                       maTrail;
+    std::vector< std::pair< uint64_t, uint32_t > > maCandidates;
+    std::vector< char >                           maPath;
+};
+
+static void answer (const ServedTrees &rTrees, const JsonRequest &rReq,
+                    QueryState &rState, OutputBuffer &rOut)
+{
+    if (rReq.isString ("op", "trees"))
+    {
+        rOut.append ("{\"ok\":true,\"trees\":[");
+        for (size_t i = 0; i < rTrees.size(); i++)
+        {
+            const Snapshot &rSnap = rTrees[i].snapshot();
+            if (i > 0)
+                rOut.append (',');
+            rOut.append ("{\"name\":");
+            appendJsonString (rOut, rTrees[i].name().data(),
+                              rTrees[i].name().size());
+            rOut.append (",\"nodes\":");
+            rOut.appendNumber (rSnap.nodeCount());
+            rOut.append (',');
+            appendSizes (rOut, rSnap.node (0));
+            rOut.append ('}');
+        }
+        rOut.append ("]}\n");
+        return;
+    }
+
+    const ServedTree *pTree = NULL;
+    const char *pName = NULL;
+    size_t nNameLen = 0;
+    if (!rReq.getString ("tree", pName, nNameLen))
+        pTree = rTrees.size() == 0 ? NULL : &rTrees[0];
+    for (size_t i = 0; !pTree && i < rTrees.size(); i++)
+        if (rTrees[i].name().size() == nNameLen &&
+            !memcmp (rTrees[i].name().data(), pName, nNameLen))
+            pTree = &rTrees[i];
+    if (!pTree)
+    {
+        appendError (rOut, "no such tree");
+        return;
+    }
+    const Snapshot &rSnap = pTree->snapshot();
+
+    const char *pPath = "";
+    size_t nPathLen = 0;
+    rReq.getString ("path", pPath, nPathLen);
+    bool bFound = pTree->lookup (pPath, nPathLen, rState.maTrail);
+    long nTop = rReq.getNumber ("top", 0);
+
+    if (rReq.isString ("op", "lookup"))
+    {
+        // Every component that resolved, and whether all of them did.
+        rOut.append ("{\"ok\":true,\"found\":");
+        rOut.append (bFound ? "true" : "false");
+        rOut.append (",\"trail\":[");
+        for (size_t i = 1; i < rState.maTrail.size(); i++)
+        {
+            const SnapshotNode &rNode = rSnap.node (rState.maTrail[i]);
+            if (i > 1)
+                rOut.append (',');
+            rOut.append ("{\"name\":");
+            appendJsonString (rOut, rSnap.name (rNode), rNode.mnNameLen);
+            rOut.append (',');
+            appendSizes (rOut, rNode);
+            rOut.append ('}');
+        }
+        rOut.append ("]}\n");
+        return;
+    }
+
+    if (!bFound)
+    {
+        appendError (rOut, "no such path");
+        return;
+    }
+    uint32_t nIdx = rState.maTrail.back();
+    const SnapshotNode &rNode = rSnap.node (nIdx);
+
+    if (rReq.isString ("op", "subtree"))
+    {
+        rOut.append ("{\"ok\":true,\"path\":");
+        appendPath (rOut, rSnap, nIdx, rState.maPath);
+        rOut.append (',');
+        appendSizes (rOut, rNode);
+        rOut.append (",\"children\":");
+        rOut.appendNumber (rNode.mnChildren);
+        rOut.append ("}\n");
+    }
+    else if (rReq.isString ("op", "children"))
+    {
+        // Children are stored biggest first already.
+        uint32_t nChildren = rNode.mnChildren;
+        if (nTop > 0 && nChildren > (uint32_t)nTop)
+            nChildren = nTop;
+        rOut.append ("{\"ok\":true,\"path\":");
+        appendPath (rOut, rSnap, nIdx, rState.maPath);
+        rOut.append (",\"children\":[");
+        for (uint32_t i = 0; i < nChildren; i++)
+        {
+            const SnapshotNode &rChild = rSnap.node (rNode.mnFirstChild + i);
+            if (i > 0)
+                rOut.append (',');
+            rOut.append ("{\"name\":");
+            appendJsonString (rOut, rSnap.name (rChild), rChild.mnNameLen);
+            rOut.append (',');
+            appendSizes (rOut, rChild);
+            rOut.append ('}');
+        }
+        rOut.append ("]}\n");
+    }
+    else if (rReq.isString ("op", "depth"))
+    {
+        /* The layout is breadth first, so the descendants of a node at
+           any given depth below it form one contiguous range. */
+        long nDepth = rReq.getNumber ("depth", 1);
+        if (nDepth < 0)
+        {
+            appendError (rOut, "negative depth");
+            return;
+        }
+        uint32_t nLo = nIdx, nHi = nIdx + 1;
+        for (long d = 0; d < nDepth && nLo < nHi; d++)
+        {
+            const SnapshotNode &rLast = rSnap.node (nHi - 1);
+            nLo = rSnap.node (nLo).mnFirstChild;
+            nHi = rLast.mnFirstChild + rLast.mnChildren;
+        }
+
+        rState.maCandidates.clear ();
+        for (uint32_t i = nLo; i < nHi; i++)
+            rState.maCandidates.push_back (std::make_pair (rSnap.node (i).mnSize, i));
+        size_t nShow = rState.maCandidates.size();
+        if (nTop > 0 && nShow > (size_t)nTop)
+            nShow = nTop;
+        std::partial_sort (rState.maCandidates.begin(),
+                           rState.maCandidates.begin() + nShow,
+                           rState.maCandidates.end(), bigger_node);
+
+        rOut.append ("{\"ok\":true,\"path\":");
+        appendPath (rOut, rSnap, nIdx, rState.maPath);
+        rOut.append (",\"depth\":");
+        rOut.appendNumber (nDepth);
+        rOut.append (",\"total\":");
+        rOut.appendNumber (rState.maCandidates.size());
+        rOut.append (",\"nodes\":[");
+        for (size_t i = 0; i < nShow; i++)
+        {
+            uint32_t nNode = rState.maCandidates[i].second;
+            if (i > 0)
+                rOut.append (',');
+            rOut.append ("{\"path\":");
+            appendPath (rOut, rSnap, nNode, rState.maPath);
+            rOut.append (',');
+            appendSizes (rOut, rSnap.node (nNode));
+            rOut.append ('}');
+        }
+        rOut.append ("]}\n");
+    }
+    else
+        appendError (rOut, "unknown op");
+}
+
+static bool write_all (int fd, const char *pData, size_t nLen)
+{
+    while (nLen > 0)
+    {
+        ssize_t nWritten = write (fd, pData, nLen);
+        if (nWritten < 0 && errno == EINTR)
+            continue;
+        if (nWritten <= 0)
+            return false;
+        pData += nWritten;
+        nLen -= nWritten;
+    }
+    return true;
+}
+
+// The longest request line read; longer ones are answered with an error
+// and skipped up to their newline.
+#define MAX_REQUEST (1 << 20)
+// Connections served at once; more wait in the listen backlog.
+#define MAX_CONNECTIONS 64
+
+static void serve_connection (ServedTrees *pTrees, int fd)
+{
+    std::vector< char > aIn (65536);
+    size_t nUsed = 0;
+    bool bSkipping = false; // the rest of a line too long to answer
+    OutputBuffer aOut;
+    QueryState aState;
+    JsonRequest aReq;
+
+    for (;;)
+    {
+        if (nUsed == aIn.size())
+        {
+            if (aIn.size() < MAX_REQUEST)
+                aIn.resize (aIn.size() * 2);
+            else
+            {
+                if (!bSkipping)
+                    appendError (aOut, "request too long");
+                bSkipping = true;
+                nUsed = 0;
+            }
+        }
+        ssize_t nRead = read (fd, &aIn[nUsed], aIn.size() - nUsed);
+        if (nRead < 0 && errno == EINTR)
+            continue;
+        if (nRead <= 0)
+            break;
+        nUsed += nRead;
+
+        // Answer every complete line; keep the rest for later.
+        char *pStart = &aIn[0];
+        char *pEnd = pStart + nUsed;
+        char *pNewline;
+        while ((pNewline = (char *)memchr (pStart, '\n', pEnd - pStart)))
+        {
+            if (bSkipping)
+                bSkipping = false;
+            else if (aReq.parse (pStart, pNewline))
+                answer (*pTrees, aReq, aState, aOut);
+            else
+                appendError (aOut, "malformed request");
+            pStart = pNewline + 1;
+        }
+        nUsed = bSkipping ? 0 : pEnd - pStart;
+        memmove (&aIn[0], pStart, nUsed);
+
+        if (aOut.size() > 0)
+        {
+            bool bOk = write_all (fd, aOut.data(), aOut.size());
+            aOut.clear ();
+            if (!bOk)
+                break;
+        }
+    }
+    pTrees->disconnected (fd);
+}
+
+static int run_server (ServedTrees &rTrees, const char *socket_path)
+{
+    struct sockaddr_un aAddr;
+    if (strlen (socket_path) >= sizeof (aAddr.sun_path))
+    {
+        fprintf (stderr, "socket path '%s' is too long\n", socket_path);
+        return 1;
+    }
+
+    int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        perror ("socket");
+        return 1;
+    }
+
+    memset (&aAddr, 0, sizeof (aAddr));
+    aAddr.sun_family = AF_UNIX;
+    strcpy (aAddr.sun_path, socket_path);
+    unlink (socket_path);
+    if (bind (fd, (struct sockaddr *)&aAddr, sizeof (aAddr)) != 0 ||
+        listen (fd, 64) != 0)
+    {
+        perror (socket_path);
+        close (fd);
+        return 1;
+    }
+
+    // A client going away mid-answer must not take the server down.
+    signal (SIGPIPE, SIG_IGN);
+
+    fprintf (stderr, "* serving %d tree(s) on %s\n",
+             (int)rTrees.size(), socket_path);
+    for (;;)
+    {
+        while (rTrees.connections() >= MAX_CONNECTIONS)
+            usleep (10000);
+        int nClient = accept (fd, NULL, NULL);
+        if (nClient < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror ("accept");
+            break;
+        }
+        rTrees.connected (nClient);
+        std::thread (serve_connection, &rTrees, nClient).detach ();
+    }
+    close (fd);
+    unlink (socket_path);
+    rTrees.hangUp ();
+    return 1;
+}
+
+// The name a snapshot is served as: its file name without ".dwp".
+static std::string tree_name (const char *path)
+{
+    const char *pBase = strrchr (path, '/');
+    std::string aName (pBase ? pBase + 1 : path);
+    if (aName.size() > 4 && !aName.compare (aName.size() - 4, 4, ".dwp"))
+        aName.resize (aName.size() - 4);
+    return aName;
+}
+
+int serve_snapshots (const char *socket_path, char **files, int n_files)
+{
+    ServedTrees aTrees;
+    for (int i = 0; i < n_files; i++)
+    {
+        ServedTree *pTree = new ServedTree (tree_name (files[i]).c_str());
+        if (!pTree->open (files[i]))
+        {
+            fprintf (stderr, "'%s' is not a valid snapshot\n", files[i]);
+            delete pTree;
+            return 1;
+        }
+        aTrees.add (pTree);
+    }
+    return run_server (aTrees, socket_path);
+}
+
+bool serve_tree_add (dwarfprofile_context *ctx, const FileSystemNode *root)
+{
+    ServedTree *pTree = new ServedTree ("default");
+    if (!pTree->build (root, *root->mpNames))
+    {
+        delete pTree;
+        return false;
+    }
+    if (!ctx->mpServed)
+        ctx->mpServed = new ServedTrees;
+    ctx->mpServed->add (pTree);
+    return true;
+}
+
+int serve_trees (dwarfprofile_context *ctx, const char *socket_path)
+{
+    if (!ctx->mpServed)
+        ctx->mpServed = new ServedTrees;
+    return run_server (*ctx->mpServed, socket_path);
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,283 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Saving the tree, and answering queries from saved trees.
+ */
+
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <logging.hxx>
+#include <fstree.hxx>
+#include <snapshot.hxx>
+
+/*
+ * Lays the tree out breadth first, so the children of every node end
+ * up next to each other. The names are the interned node names, so
+ * each distinct name is stored once.
+ */
+void build_snapshot (const FileSystemNode *pRoot, const NamePool &rNames,
+                     OutputBuffer &rOut)
+{
+    std::vector< uint32_t > aNameOffsets (rNames.size());
+    uint64_t nNamesSize = 0;
+    for (size_t i = 0; i < rNames.size(); i++)
+    {
+        aNameOffsets[i] = nNamesSize;
+        nNamesSize += strlen (rNames.name (i)) + 1;
+    }
+
+    std::vector< const FileSystemNode * > aOrder;
+    aOrder.push_back (pRoot);
+    std::vector< uint32_t > aParents;
+    aParents.push_back (0);
+    for (size_t i = 0; i < aOrder.size(); i++)
+    {
+        const FileSystemNode::ChildsType &rChildren = aOrder[i]->maChildren;
+        for (size_t j = 0; j < rChildren.size(); j++)
+        {
+            aOrder.push_back (rChildren[j]);
+            aParents.push_back (i);
+        }
+    }
+
+    SnapshotHeader aHeader;
+    memset (&aHeader, 0, sizeof (aHeader));
+    memcpy (aHeader.maMagic, SNAPSHOT_MAGIC, sizeof (SNAPSHOT_MAGIC));
+    aHeader.mnVersion = SNAPSHOT_VERSION;
+    aHeader.mnNodes = aOrder.size();
+    aHeader.mnNamesOffset = sizeof (SnapshotHeader) +
+                            aOrder.size() * sizeof (SnapshotNode);
+    aHeader.mnNamesSize = nNamesSize;
+    rOut.append ((const char *)&aHeader, sizeof (aHeader));
+
+    uint32_t nNextChild = 1;
+    for (size_t i = 0; i < aOrder.size(); i++)
+    {
+        const FileSystemNode *pNode = aOrder[i];
+        SnapshotNode aNode;
+        aNode.mnSize = pNode->mnSize;
+        aNode.mnCount = pNode->useCount;
+        aNode.mnName = aNameOffsets[pNode->mnNameId];
+        aNode.mnNameLen = pNode->mnNameLen;
+        aNode.mnParent = aParents[i];
+        aNode.mnFirstChild = nNextChild;
+        aNode.mnChildren = pNode->maChildren.size();
+        aNode.mnPad = 0;
+        nNextChild += aNode.mnChildren;
+        rOut.append ((const char *)&aNode, sizeof (aNode));
+    }
+
+    for (size_t i = 0; i < rNames.size(); i++)
+    {
+        const char *pName = rNames.name (i);
+        rOut.append (pName, strlen (pName) + 1);
+    }
+}
+
+bool save_snapshot (const FileSystemNode *root, const char *path)
+{
+    FILE *pFile = fopen (path, "wb");
+    if (!pFile)
+    {
+        fprintf (stderr, "failed to open '%s' for writing\n", path);
+        return false;
+    }
+
+    OutputBuffer aOut;
+    build_snapshot (root, *root->mpNames, aOut);
+    bool bOk = aOut.write (pFile);
+    if (fclose (pFile) != 0 || !bOk)
+    {
+        fprintf (stderr, "failed to write '%s'\n", path);
+        return false;
+    }
+    return true;
+}
+
+Snapshot::Snapshot ()
+    : mpMap (NULL), mnMapSize (0), mpNodes (NULL), mnNodes (0), mpNames (NULL)
+{
+}
+
+Snapshot::~Snapshot ()
+{
+    if (mpMap)
+        munmap (mpMap, mnMapSize);
+}
+
+bool Snapshot::attach (const void *pData, size_t nSize)
+{
+    const SnapshotHeader *pHeader = (const SnapshotHeader *)pData;
+    if (nSize < sizeof (SnapshotHeader) ||
+        memcmp (pHeader->maMagic, SNAPSHOT_MAGIC, sizeof (SNAPSHOT_MAGIC)) ||
+        pHeader->mnVersion != SNAPSHOT_VERSION || pHeader->mnNodes == 0)
+        return false;
+
+    uint64_t nNodesEnd = sizeof (SnapshotHeader) +
+                         (uint64_t)pHeader->mnNodes * sizeof (SnapshotNode);
+    if (pHeader->mnNamesOffset != nNodesEnd ||
+        pHeader->mnNamesOffset + pHeader->mnNamesSize > nSize)
+        return false;
+
+    mpNodes = (const SnapshotNode *)(pHeader + 1);
+    mnNodes = pHeader->mnNodes;
+    mpNames = (const char *)pData + pHeader->mnNamesOffset;
+
+    // Cheap sanity checks, so that lookups can trust the indices.
+    for (uint32_t i = 0; i < mnNodes; i++)
+    {
+        const SnapshotNode &rNode = mpNodes[i];
+        if ((uint64_t)rNode.mnName + rNode.mnNameLen >= pHeader->mnNamesSize ||
+            (i > 0 && rNode.mnParent >= i) ||
+            (uint64_t)rNode.mnFirstChild + rNode.mnChildren > mnNodes)
+        {
+            mnNodes = 0;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Snapshot::open (const char *pPath)
+{
+    int fd = ::open (pPath, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat aStat;
+    if (fstat (fd, &aStat) != 0 || aStat.st_size == 0)
+    {
+        close (fd);
+        return false;
+    }
+
+    void *pMap = mmap (NULL, aStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (pMap == MAP_FAILED)
+        return false;
+
+    mpMap = pMap;
+    mnMapSize = aStat.st_size;
+    return attach (mpMap, mnMapSize);
+}
+
+bool Snapshot::lookup (const char *pPath, uint32_t &rIdx) const
+{
+    uint32_t nIdx = 0;
+    while (*pPath)
+    {
+        while (*pPath == '/')
+            pPath++;
+        size_t nLen = strcspn (pPath, "/");
+        if (nLen == 0)
+            break;
+
+        const SnapshotNode &rNode = mpNodes[nIdx];
+        uint32_t nEnd = rNode.mnFirstChild + rNode.mnChildren;
+        uint32_t nChild;
+        for (nChild = rNode.mnFirstChild; nChild < nEnd; nChild++)
+        {
+            const SnapshotNode &rChild = mpNodes[nChild];
+            if (rChild.mnNameLen == nLen &&
+                !memcmp (mpNames + rChild.mnName, pPath, nLen))
+                break;
+        }
+        if (nChild == nEnd)
+            return false;
+        nIdx = nChild;
+        pPath += nLen;
+    }
+    rIdx = nIdx;
+    return true;
+}
+
+size_t Snapshot::pathLength (uint32_t nIdx) const
+{
+    size_t nLen = 0;
+    for (uint32_t i = nIdx; i != 0; i = mpNodes[i].mnParent)
+        nLen += mpNodes[i].mnNameLen + 1;
+    return nLen;
+}
+
+size_t Snapshot::path (uint32_t nIdx, char *pBuf, size_t nBufLen) const
+{
+    // Measure first, then fill in from the end backwards.
+    size_t nLen = pathLength (nIdx);
+    if (nLen + 1 > nBufLen)
+        return 0;
+
+    size_t nPos = nLen;
+    pBuf[nLen] = '\0';
+    for (uint32_t i = nIdx; i != 0; i = mpNodes[i].mnParent)
+    {
+        nPos -= mpNodes[i].mnNameLen;
+        memcpy (pBuf + nPos, mpNames + mpNodes[i].mnName, mpNodes[i].mnNameLen);
+        pBuf[--nPos] = '/';
+    }
+    return nLen;
+}
+
+// Writes the breakdown below nIdx the same way dump_results does.
+static void dump_snapshot (const Snapshot &rSnap, uint32_t nIdx,
+                           int nDepth, int nLevel, int nTop,
+                           OutputBuffer &rOut)
+{
+    const SnapshotNode &rNode = rSnap.node (nIdx);
+    uint32_t nChildren = rNode.mnChildren;
+    if (nTop > 0 && nChildren > (uint32_t)nTop)
+        nChildren = nTop;
+
+    for (uint32_t i = 0; i < nChildren; i++)
+    {
+        uint32_t nChild = rNode.mnFirstChild + i;
+        const SnapshotNode &rChild = rSnap.node (nChild);
+        rOut.appendReportNumbers (rChild.mnSize, rChild.mnCount);
+        rOut.appendReportIndent (nDepth, nLevel);
+        rOut.append (rSnap.name (rChild), rChild.mnNameLen);
+        rOut.append ('\n');
+        if (rOut.size() > (1 << 20))
+            rOut.write (stdout);
+        if (nLevel < nDepth)
+            dump_snapshot (rSnap, nChild, nDepth, nLevel + 1, nTop, rOut);
+    }
+}
+
+int query_snapshot (const char *file, const char *path, int depth, int top)
+{
+    Snapshot aSnap;
+    if (!aSnap.open (file))
+    {
+        fprintf (stderr, "'%s' is not a valid snapshot\n", file);
+        return 1;
+    }
+
+    uint32_t nIdx;
+    if (!aSnap.lookup (path ? path : "", nIdx))
+    {
+        fprintf (stderr, "no such path '%s'\n", path);
+        return 1;
+    }
+
+    OutputBuffer aOut;
+    const SnapshotNode &rNode = aSnap.node (nIdx);
+    aOut.append ("Total ");
+    aOut.appendNumber (rNode.mnSize);
+    aOut.append (" bytes in ");
+    aOut.appendNumber (rNode.mnCount);
+    aOut.append (" entries below '");
+    aOut.append (path ? path : "/");
+    aOut.append ("'\n");
+    aOut.appendReportHeader (depth);
+    dump_snapshot (aSnap, nIdx, depth, 0, top, aOut);
+    aOut.write (stdout);
+
+    return 0;
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
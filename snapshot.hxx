@@ -0,0 +1,98 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef DWARFPROFILE_SNAPSHOT_HXX
+#define DWARFPROFILE_SNAPSHOT_HXX
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * On-disk layout of a saved tree (.dwp), designed to be mmapped and
+ * used in place:
+ *
+ *   SnapshotHeader
+ *   SnapshotNode[mnNodes]  - breadth first, node 0 is the root, the
+ *                            children of a node are contiguous and
+ *                            sorted biggest first
+ *   char[mnNamesSize]      - NUL terminated names
+ *
+ * All fields are fixed width and in host byte order.
+ */
+#define SNAPSHOT_MAGIC   "DWPSNAP"
+#define SNAPSHOT_VERSION 1
+
+struct SnapshotHeader {
+    char     maMagic[8];
+    uint32_t mnVersion;
+    uint32_t mnNodes;
+    uint64_t mnNamesOffset;
+    uint64_t mnNamesSize;
+};
+
+struct SnapshotNode {
+    uint64_t mnSize;
+    uint64_t mnCount;
+    uint32_t mnName;       // offset into the names
+    uint32_t mnNameLen;
+    uint32_t mnParent;     // the root is its own parent
+    uint32_t mnFirstChild;
+    uint32_t mnChildren;
+    uint32_t mnPad;
+};
+
+/*
+ * A read-only view of a snapshot, either mmapped from a file or
+ * pointing at memory owned by someone else. Lookups never allocate,
+ * so a single instance can be shared by any number of threads.
+ */
+class Snapshot {
+    void                 *mpMap;
+    size_t                mnMapSize;
+    const SnapshotNode   *mpNodes;
+    uint32_t              mnNodes;
+    const char           *mpNames;
+
+    Snapshot (const Snapshot &); // not copyable
+    Snapshot &operator= (const Snapshot &);
+
+  public:
+    Snapshot ();
+    ~Snapshot ();
+
+    bool open (const char *pPath);
+    // Uses (and validates) a snapshot image already in memory.
+    bool attach (const void *pData, size_t nSize);
+
+    uint32_t nodeCount () const { return mnNodes; }
+    const SnapshotNode &node (uint32_t nIdx) const { return mpNodes[nIdx]; }
+    const char *name (const SnapshotNode &rNode) const
+    {
+        return mpNames + rNode.mnName;
+    }
+
+    // Finds the node for a '/' separated path, or returns false.
+    bool lookup (const char *pPath, uint32_t &rIdx) const;
+
+    // The length of the path of a node, without the NUL.
+    size_t pathLength (uint32_t nIdx) const;
+    // Writes the path of a node (no trailing '/') into pBuf; 0 if it
+    // needs more than nBufLen with the NUL.
+    size_t path (uint32_t nIdx, char *pBuf, size_t nBufLen) const;
+};
+
+struct FileSystemNode;
+class NamePool;
+class OutputBuffer;
+
+// Appends the snapshot image of the tree below pRoot to rOut.
+extern void build_snapshot (const FileSystemNode *pRoot, const NamePool &rNames,
+                            OutputBuffer &rOut);
+
+#endif // DWARFPROFILE_SNAPSHOT_HXX
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
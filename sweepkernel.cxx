@@ -0,0 +1,211 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * The arithmetic of the sweep, on arrays of starts and ends: what each
+ * range covers up to where the next one starts, and whether there is
+ * a gap before that. Without the branches of doing it record by record
+ * that vectorises; the CPU is asked once which vectors it has.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <vector>
+#include <logging.hxx>
+#include <dwarfprofile.hxx>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+typedef void (*SweepKernelFn) (const Dwarf_Addr *pStarts, const Dwarf_Addr *pEnds,
+                               size_t n, Dwarf_Addr *pSizes, unsigned char *pGaps);
+
+static void sweep_scalar (const Dwarf_Addr *pStarts, const Dwarf_Addr *pEnds,
+                          size_t n, Dwarf_Addr *pSizes, unsigned char *pGaps)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        Dwarf_Addr nNext = pStarts[i + 1];
+        pSizes[i] = (pEnds[i] > nNext ? nNext : pEnds[i]) - pStarts[i];
+        pGaps[i] = pEnds[i] < nNext;
+    }
+}
+
+#if defined(__x86_64__)
+// four bits of a compare mask as four bytes of 0 or 1, lowest first
+static const uint32_t aMaskBytes[16] = {
+    0x00000000, 0x00000001, 0x00000100, 0x00000101,
+    0x00010000, 0x00010001, 0x00010100, 0x00010101,
+    0x01000000, 0x01000001, 0x01000100, 0x01000101,
+    0x01010000, 0x01010001, 0x01010100, 0x01010101
+};
+
+/* AVX2 only compares signed: flipping the top bits makes that
+   unsigned. */
+__attribute__ ((target ("avx2")))
+static void sweep_avx2 (const Dwarf_Addr *pStarts, const Dwarf_Addr *pEnds,
+                        size_t n, Dwarf_Addr *pSizes, unsigned char *pGaps)
+{
+    const __m256i aSign = _mm256_set1_epi64x ((long long)1 << 63);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256i aStart = _mm256_loadu_si256 ((const __m256i *)(pStarts + i));
+        __m256i aNext = _mm256_loadu_si256 ((const __m256i *)(pStarts + i + 1));
+        __m256i aEnd = _mm256_loadu_si256 ((const __m256i *)(pEnds + i));
+        __m256i aEndS = _mm256_xor_si256 (aEnd, aSign);
+        __m256i aNextS = _mm256_xor_si256 (aNext, aSign);
+        __m256i aOver = _mm256_cmpgt_epi64 (aEndS, aNextS);
+        __m256i aGap = _mm256_cmpgt_epi64 (aNextS, aEndS);
+        __m256i aTo = _mm256_blendv_epi8 (aEnd, aNext, aOver);
+        _mm256_storeu_si256 ((__m256i *)(pSizes + i), _mm256_sub_epi64 (aTo, aStart));
+        int nGaps = _mm256_movemask_pd (_mm256_castsi256_pd (aGap));
+        memcpy (pGaps + i, &aMaskBytes[nGaps], 4);
+    }
+    sweep_scalar (pStarts + i, pEnds + i, n - i, pSizes + i, pGaps + i);
+}
+
+__attribute__ ((target ("avx512f")))
+static void sweep_avx512 (const Dwarf_Addr *pStarts, const Dwarf_Addr *pEnds,
+                          size_t n, Dwarf_Addr *pSizes, unsigned char *pGaps)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m512i aStart = _mm512_loadu_si512 (pStarts + i);
+        __m512i aNext = _mm512_loadu_si512 (pStarts + i + 1);
+        __m512i aEnd = _mm512_loadu_si512 (pEnds + i);
+        _mm512_storeu_si512 (pSizes + i,
+                             _mm512_sub_epi64 (_mm512_min_epu64 (aEnd, aNext), aStart));
+        __mmask8 nGaps = _mm512_cmplt_epu64_mask (aEnd, aNext);
+        memcpy (pGaps + i, &aMaskBytes[nGaps & 0xf], 4);
+        memcpy (pGaps + i + 4, &aMaskBytes[nGaps >> 4], 4);
+    }
+    sweep_scalar (pStarts + i, pEnds + i, n - i, pSizes + i, pGaps + i);
+}
+#endif
+
+struct SweepKernel {
+    const char   *mpName;
+    SweepKernelFn mpFn;
+};
+
+static const SweepKernel aKernels[] = {
+#if defined(__x86_64__)
+    { "avx512", sweep_avx512 },
+    { "avx2", sweep_avx2 },
+#endif
+    { "scalar", sweep_scalar }
+};
+static const size_t nKernels = sizeof (aKernels) / sizeof (aKernels[0]);
+
+static bool kernel_supported (const SweepKernel &rKernel)
+{
+#if defined(__x86_64__)
+    if (rKernel.mpFn == sweep_avx512)
+        return __builtin_cpu_supports ("avx512f");
+    if (rKernel.mpFn == sweep_avx2)
+        return __builtin_cpu_supports ("avx2");
+#endif
+    return true;
+}
+
+// the best the CPU has, to start with
+static const SweepKernel *best_kernel ()
+{
+    for (size_t i = 0; i < nKernels; i++)
+        if (kernel_supported (aKernels[i]))
+            return &aKernels[i];
+    return &aKernels[nKernels - 1];
+}
+
+const SweepKernel *sweep_kernel_find (const char *name)
+{
+    if (!name || !strcmp (name, "auto"))
+        return best_kernel();
+    for (size_t i = 0; i < nKernels; i++)
+        if (!strcmp (name, aKernels[i].mpName))
+            return kernel_supported (aKernels[i]) ? &aKernels[i] : NULL;
+    return NULL;
+}
+
+void sweep_kernel (const SweepKernel *kernel, const Dwarf_Addr *starts,
+                   const Dwarf_Addr *ends, size_t n,
+                   Dwarf_Addr *sizes, unsigned char *gaps)
+{
+    kernel->mpFn (starts, ends, n, sizes, gaps);
+}
+
+bool dwarfprofile_sweep_kernel_ok (const char *name)
+{
+    return sweep_kernel_find (name) != NULL;
+}
+
+static double seconds ()
+{
+    struct timespec aNow;
+    clock_gettime (CLOCK_MONOTONIC, &aNow);
+    return aNow.tv_sec + aNow.tv_nsec * 1e-9;
+}
+
+/*
+ * Times the kernels the CPU has on records like those of a module:
+ * mostly adjacent, some overlapping, some with a gap after them. Each
+ * has to come out as the scalar one does.
+ */
+int bench_sweep_kernels (size_t records, int rounds)
+{
+    std::vector< Dwarf_Addr > aStarts (records + 1), aEnds (records);
+    Dwarf_Addr nPc = 0x400000;
+    srand (42);
+    for (size_t i = 0; i < records; i++)
+    {
+        aStarts[i] = nPc;
+        nPc += 1 + rand() % 64;
+        int nSpill = rand() % 8;
+        aEnds[i] = nSpill == 0 ? nPc + rand() % 32 :      // overlaps the next
+                   nSpill == 1 ? nPc - rand() % (nPc - aStarts[i]) : // gap
+                   nPc;
+    }
+    aStarts[records] = nPc;
+
+    std::vector< Dwarf_Addr > aWant (records), aSizes (records);
+    std::vector< unsigned char > aWantGaps (records), aGaps (records);
+    sweep_scalar (&aStarts[0], &aEnds[0], records, &aWant[0], &aWantGaps[0]);
+
+    const SweepKernel *pAuto = best_kernel();
+    int nRet = 0;
+    for (size_t k = nKernels; k-- > 0; )
+    {
+        const SweepKernel &rKernel = aKernels[k];
+        if (!kernel_supported (rKernel))
+        {
+            printf ("%-8s not supported by this CPU\n", rKernel.mpName);
+            continue;
+        }
+        double fBest = 0;
+        for (int r = 0; r < rounds; r++)
+        {
+            double fStart = seconds();
+            rKernel.mpFn (&aStarts[0], &aEnds[0], records, &aSizes[0], &aGaps[0]);
+            double fTime = seconds() - fStart;
+            if (r == 0 || fTime < fBest)
+                fBest = fTime;
+        }
+        bool bSame = aSizes == aWant && aGaps == aWantGaps;
+        printf ("%-8s %8.3f records/ns%s%s\n", rKernel.mpName,
+                fBest > 0 ? records / (fBest * 1e9) : 0.0,
+                &rKernel == pAuto ? " (auto)" : "",
+                bSame ? "" : " MISMATCH");
+        if (!bSame)
+            nRet = 1;
+    }
+    return nRet;
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,282 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Template families: all instantiations of a template, whatever their
+ * arguments, as one function (--group-templates).
+ */
+
+#include <vector>
+#include <string>
+#include <mutex>
+#include <algorithm>
+#include <boost/unordered_map.hpp>
+#include <boost/unordered_set.hpp>
+#include <boost/functional/hash.hpp>
+#include <cxxabi.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <logging.hxx>
+#include <output.hxx>
+
+static bool is_ident (char c)
+{
+    return isalnum ((unsigned char)c) || c == '_';
+}
+
+/*
+ * Appends the family of a (demangled) function name to rFamily: the
+ * name with every template argument list emptied to "<>", and no
+ * parameters or return type. Returns false if there were no template
+ * arguments, i.e. the function is not a template instance.
+ */
+static bool strip_templates (const char *pName, std::string &rFamily)
+{
+    bool bTemplate = false;
+    int nAngle = 0, nBrace = 0;
+    for (const char *p = pName; *p; p++)
+    {
+        if (nAngle == 0 && nBrace == 0 && !strncmp (p, "operator", 8) &&
+            (p == pName || !is_ident (p[-1])) && !is_ident (p[8]))
+        {
+            // operator<, operator<<=, operator() etc. are no templates
+            const char *pOp = p + 8;
+            size_t nLen = (!strncmp (pOp, "()", 2) || !strncmp (pOp, "[]", 2)) ?
+                          2 : strspn (pOp, "<>=!+-*/%^&|~,");
+            // nLen is 0 for operator new, operator bool etc., whose rest
+            // is scanned like any other name
+            rFamily.append (p, 8 + nLen);
+            p = pOp + nLen - 1;  // the loop steps to what follows
+            continue;
+        }
+        if (nAngle == 0 && (*p == '{' || nBrace > 0))
+        {
+            // {lambda(int)#1} etc. are kept as they are
+            nBrace += (*p == '{') - (*p == '}');
+            rFamily += *p;
+            continue;
+        }
+        if (*p == '<')
+        {
+            if (nAngle++ == 0)
+            {
+                rFamily += "<>";
+                bTemplate = true;
+            }
+            continue;
+        }
+        if (*p == '>' && nAngle > 0)
+        {
+            nAngle--;
+            continue;
+        }
+        if (nAngle > 0)
+            continue;
+        if (*p == '(')
+        {
+            if (strncmp (p, "(anonymous namespace)", 21))
+                break; // the parameters
+            rFamily.append (p, 21);
+            p += 20;
+            continue;
+        }
+        rFamily += *p;
+    }
+
+    // Drop the return type of function templates ("void foo<>").
+    size_t nLimit = std::min (rFamily.find ("operator"), rFamily.size());
+    size_t nStart = 0;
+    int nParen = 0;
+    for (size_t i = 0; i < nLimit; i++)
+    {
+        nParen += (rFamily[i] == '(') - (rFamily[i] == ')');
+        if (rFamily[i] == ' ' && nParen == 0)
+            nStart = i + 1;
+    }
+    rFamily.erase (0, nStart);
+
+    return bTemplate;
+}
+
+/*
+ * One instantiation: a mangled linkage name (or a DIE name, for code
+ * without one), its family and the bytes of code it has. The family is
+ * worked out - demangling included - only the first time a name is
+ * seen.
+ */
+struct template_instance {
+    std::string maFamily;   // empty if not a template instance
+    size_t      mnBytes;
+};
+
+struct NameHash {
+    size_t operator() (const std::string &rName) const
+    {
+        return boost::hash_range (rName.begin(), rName.end());
+    }
+    size_t operator() (const char *pName) const
+    {
+        return boost::hash_range (pName, pName + strlen (pName));
+    }
+};
+
+struct NameEqual {
+    bool operator() (const char *pName, const std::string &rName) const
+    {
+        return rName == pName;
+    }
+};
+
+typedef boost::unordered_map< std::string, template_instance, NameHash >
+    InstanceMap;
+
+// One cache per walker (cf. --batch), so lookups never take a lock.
+class TemplateCache {
+  public:
+    InstanceMap maInstances;
+};
+
+// The caches of one analysis; the report merges them.
+class TemplateReport {
+  public:
+    std::mutex                     maMutex;
+    std::vector< TemplateCache * > maCaches;
+
+    ~TemplateReport ()
+    {
+        for (size_t i = 0; i < maCaches.size(); i++)
+            delete maCaches[i];
+    }
+};
+
+TemplateReport *template_report_new ()
+{
+    return new TemplateReport;
+}
+
+void template_report_free (TemplateReport *report)
+{
+    delete report;
+}
+
+TemplateCache *template_cache_new (TemplateReport *report)
+{
+    TemplateCache *pCache = new TemplateCache;
+    std::lock_guard< std::mutex > aGuard (report->maMutex);
+    report->maCaches.push_back (pCache);
+    return pCache;
+}
+
+template_instance *template_lookup (TemplateCache *cache,
+                                    const char *linkage_name, const char *name)
+{
+    const char *pKey = linkage_name ? linkage_name : name;
+    if (!pKey)
+        return NULL;
+
+    InstanceMap &rCache = cache->maInstances;
+    InstanceMap::iterator it = rCache.find (pKey, NameHash(), NameEqual());
+    if (it == rCache.end())
+    {
+        template_instance &rInstance = rCache[pKey];
+        rInstance.mnBytes = 0;
+
+        int nStatus = -1;
+        char *pDemangled = linkage_name ?
+            abi::__cxa_demangle (linkage_name, NULL, NULL, &nStatus) : NULL;
+        if (!strip_templates (nStatus == 0 ? pDemangled : pKey,
+                              rInstance.maFamily))
+            rInstance.maFamily.clear ();
+        free (pDemangled);
+        return rInstance.maFamily.empty() ? NULL : &rInstance;
+    }
+    return it->second.maFamily.empty() ? NULL : &it->second;
+}
+
+const char *template_family (const template_instance *instance)
+{
+    return instance->maFamily.c_str();
+}
+
+void template_add_size (template_instance *instance, size_t size)
+{
+    instance->mnBytes += size;
+}
+
+struct FamilyStats {
+    const std::string *mpFamily;
+    size_t             mnBytes;
+    size_t             mnInstances;
+};
+
+static bool most_bytes (const FamilyStats &a, const FamilyStats &b)
+{
+    return a.mnBytes > b.mnBytes;
+}
+
+void dump_templates (TemplateReport *report, size_t top)
+{
+    const std::vector< TemplateCache * > &aCaches = report->maCaches;
+
+    // An instantiation can have been seen by several threads.
+    boost::unordered_set< std::string, NameHash > aSeen;
+    boost::unordered_map< std::string, size_t, NameHash > aIndex;
+    std::vector< FamilyStats > aFamilies;
+    for (size_t i = 0; i < aCaches.size(); i++)
+    {
+        for (InstanceMap::const_iterator it = aCaches[i]->maInstances.begin();
+             it != aCaches[i]->maInstances.end(); ++it)
+        {
+            const template_instance &rInstance = it->second;
+            if (rInstance.maFamily.empty() || rInstance.mnBytes == 0)
+                continue;
+
+            boost::unordered_map< std::string, size_t, NameHash >::iterator itIdx;
+            itIdx = aIndex.find (rInstance.maFamily);
+            if (itIdx == aIndex.end())
+            {
+                aIndex[rInstance.maFamily] = aFamilies.size();
+                FamilyStats aStats = { &rInstance.maFamily, 0, 0 };
+                aFamilies.push_back (aStats);
+                itIdx = aIndex.find (rInstance.maFamily);
+            }
+            FamilyStats &rStats = aFamilies[itIdx->second];
+            rStats.mnBytes += rInstance.mnBytes;
+            if (aSeen.insert (it->first).second)
+                rStats.mnInstances++;
+        }
+    }
+
+    size_t nShown = aFamilies.size();
+    if (top > 0 && nShown > top)
+    {
+        std::nth_element (aFamilies.begin(), aFamilies.begin() + top,
+                          aFamilies.end(), most_bytes);
+        nShown = top;
+    }
+    std::sort (aFamilies.begin(), aFamilies.begin() + nShown, most_bytes);
+
+    OutputBuffer aOut;
+    aOut.append ("\n---\n\n Template families\n\n"
+                 "Total Size Instantiations  Average Family\n");
+    for (size_t i = 0; i < nShown; i++)
+    {
+        const FamilyStats &rStats = aFamilies[i];
+        aOut.appendNumber (rStats.mnBytes, 10);
+        aOut.append (' ');
+        aOut.appendNumber (rStats.mnInstances, 14);
+        aOut.append (' ');
+        aOut.appendNumber (rStats.mnBytes / rStats.mnInstances, 8);
+        aOut.append (' ');
+        aOut.append (rStats.mpFamily->c_str());
+        aOut.append ('\n');
+        if (aOut.size() > (1 << 20))
+            aOut.write (stdout);
+    }
+    aOut.write (stdout);
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,426 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Writes the tree as a self-contained HTML page with a squarified
+ * treemap (Bruls, Huizing, van Wijk) in SVG, see:
+ *     https://www.win.tue.nl/~vanwijk/stm.pdf
+ */
+
+#include <vector>
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include <boost/unordered_map.hpp>
+#include <logging.hxx>
+#include <fstree.hxx>
+
+#define TREEMAP_WIDTH  1600
+#define TREEMAP_HEIGHT 1000
+
+// A rectangle gets a label (and its children go below it) if it is
+// at least this big, in pixels.
+#define LABEL_WIDTH    30
+#define LABEL_HEIGHT   14
+#define LABEL_CHAR     6
+
+static const char *treemap_head =
+    "<!DOCTYPE html>\n<html><head><meta charset=\"utf-8\">"
+    "<title>dwarfprofile</title><style>\n"
+    "body{margin:0;font:12px sans-serif}"
+    "#i{padding:4px;height:16px;white-space:nowrap;overflow:hidden}"
+    "svg{display:block;width:100%;height:auto}"
+    "path{fill-opacity:.45;stroke:#fff;stroke-width:.5}"
+    ".o{fill:#999}"
+    "text{font:10px sans-serif}\n"
+    "</style></head><body><div id=\"i\">&nbsp;</div>\n";
+
+/*
+ * Shows what the mouse is over. G has parent, x, y, width, height,
+ * size and name of each rectangle: an index into N, or minus the
+ * number of entries lumped together. Parents come before children, so
+ * the last rectangle under the mouse is the innermost one.
+ */
+static const char *treemap_tail =
+    "];\nvar S=document.querySelector('svg'),I=document.getElementById('i');\n"
+    "S.addEventListener('mousemove',function(e){"
+    "var r=S.getBoundingClientRect(),x=(e.clientX-r.left)*W/r.width,"
+    "y=(e.clientY-r.top)*H/r.height,n=G.length/7-1,k,v;"
+    "for(;n>0;n--){k=7*n;if(x>=G[k+1]&&x<G[k+1]+G[k+3]&&"
+    "y>=G[k+2]&&y<G[k+2]+G[k+4])break;}"
+    "var s=G[7*n+5],p=[];for(var m=n;m>0;m=G[7*m]){v=G[7*m+6];"
+    "p.unshift(v<0?'(other '+(-v)+' entries)':N[v]);}"
+    "I.textContent='/'+p.join('/')+'  '+s+' bytes ('+"
+    "(100*s/G[5]).toFixed(2)+'%)';});\n"
+    "</script></body></html>\n";
+
+struct TreemapRect {
+    double mfX, mfY, mfW, mfH;
+};
+
+/*
+ * Something to lay out: a node, the children too small to show
+ * (drawn as one grey "other" rectangle), or what the node's own size
+ * and rounding leave over, which is not drawn at all.
+ */
+struct TreemapItem {
+    double                mfArea;
+    const FileSystemNode *mpNode;   // or NULL
+    size_t                mnOther;  // number of children lumped together
+    size_t                mnSize;
+};
+
+/*
+ * The rectangles of one depth of a top level entry, as a single path
+ * each: nested ones are drawn over their parents, deeper ones later.
+ */
+struct TreemapLevel {
+    OutputBuffer maNodes;
+    OutputBuffer maOther;
+};
+
+class TreemapWriter {
+    FILE        *mpFile;
+    std::vector< TreemapLevel * > maLevels; // of the current top level entry
+    OutputBuffer maText;   // the labels, drawn over everything
+    OutputBuffer maGeom;   // what the rectangles are, for the script
+    OutputBuffer maNames;  // ... and their distinct names
+    boost::unordered_map< unsigned, unsigned > maNameIndex; // by pool id
+    unsigned     mnRects;
+    size_t       mnPruned;
+    unsigned     mnTop;    // top level entries so far
+
+    void appendEscaped (OutputBuffer &rOut, const char *pStr, size_t nLen,
+                        bool bScript)
+    {
+        for (size_t i = 0; i < nLen; i++)
+        {
+            char c = pStr[i];
+            if (bScript && (c == '"' || c == '\\'))
+            {
+                rOut.append ('\\');
+                rOut.append (c);
+            }
+            else if (bScript && c == '<') // no "</script>" in a string
+                rOut.append ("\\x3c");
+            else if (!bScript && c == '<')
+                rOut.append ("&lt;");
+            else if (!bScript && c == '>')
+                rOut.append ("&gt;");
+            else if (!bScript && c == '&')
+                rOut.append ("&amp;");
+            else if ((unsigned char)c >= ' ')
+                rOut.append (c);
+        }
+    }
+
+    /*
+     * Draws a rectangle, rounded to whole pixels so that neighbours
+     * share their edges exactly, and records it for the script.
+     * Returns false if nothing of it is left to draw.
+     */
+    bool emit (const TreemapRect &rRect, unsigned nParent, int nDepth,
+               const FileSystemNode *pNode, size_t nOther, size_t nSize,
+               TreemapRect &rInner)
+    {
+        long nX0 = lround (rRect.mfX), nX1 = lround (rRect.mfX + rRect.mfW);
+        long nY0 = lround (rRect.mfY), nY1 = lround (rRect.mfY + rRect.mfH);
+        if (nX1 <= nX0 || nY1 <= nY0)
+        {
+            mnPruned++;
+            return false;
+        }
+
+        while ((int)maLevels.size() <= nDepth)
+            maLevels.push_back (new TreemapLevel);
+        OutputBuffer &rPath = pNode ? maLevels[nDepth]->maNodes
+                                    : maLevels[nDepth]->maOther;
+        rPath.append ('M');
+        rPath.appendNumber (nX0);
+        rPath.append (' ');
+        rPath.appendNumber (nY0);
+        rPath.append ('h');
+        rPath.appendNumber (nX1 - nX0);
+        rPath.append ('v');
+        rPath.appendNumber (nY1 - nY0);
+        rPath.append ("h-");
+        rPath.appendNumber (nX1 - nX0);
+        rPath.append ('z');
+
+        rInner.mfX = rRect.mfX + 1;
+        rInner.mfY = rRect.mfY + 1;
+        rInner.mfW = rRect.mfW - 2;
+        rInner.mfH = rRect.mfH - 2;
+        char aOther[64];
+        const char *pName = aOther;
+        size_t nNameLen = 0;
+        if (pNode)
+        {
+            pName = pNode->mpName;
+            nNameLen = pNode->mnNameLen;
+        }
+        else if (nOther > 0)
+            nNameLen = snprintf (aOther, sizeof (aOther), "(other %lu entries)",
+                                 (unsigned long)nOther);
+        if (nNameLen > 0 && nX1 - nX0 >= LABEL_WIDTH &&
+            nY1 - nY0 >= LABEL_HEIGHT)
+        {
+            size_t nChars = (nX1 - nX0 - 4) / LABEL_CHAR;
+            maText.append ("<text x=\"");
+            maText.appendNumber (nX0 + 2);
+            maText.append ("\" y=\"");
+            maText.appendNumber (nY0 + 11);
+            maText.append ("\">");
+            appendEscaped (maText, pName, std::min (nNameLen, nChars), false);
+            maText.append ("</text>\n");
+            rInner.mfY += LABEL_HEIGHT - 1;
+            rInner.mfH -= LABEL_HEIGHT - 1;
+        }
+
+        const long aGeom[6] = { nParent, nX0, nY0, nX1 - nX0, nY1 - nY0,
+                                (long)nSize };
+        for (int i = 0; i < 6; i++)
+        {
+            if (mnRects > 0 || i > 0)
+                maGeom.append (',');
+            maGeom.appendNumber (aGeom[i]);
+        }
+        maGeom.append (',');
+        if (!pNode)
+        {
+            maGeom.append ('-');
+            maGeom.appendNumber (nOther);
+        }
+        else
+        {
+            // Most names (of methods, of directories) turn up many times.
+            unsigned nIndex = maNameIndex.size();
+            std::pair< boost::unordered_map< unsigned, unsigned >::iterator,
+                       bool > aIns;
+            aIns = maNameIndex.insert (std::make_pair (pNode->mnNameId, nIndex));
+            if (aIns.second)
+            {
+                maNames.append (nIndex > 0 ? ",\"" : "\"");
+                appendEscaped (maNames, pName, nNameLen, true);
+                maNames.append ('"');
+            }
+            maGeom.appendNumber (aIns.first->second);
+        }
+
+        mnRects++;
+        return true;
+    }
+
+    // Writes out the paths of a top level entry, in one colour.
+    void flushLevels (const char *pFill)
+    {
+        fprintf (mpFile, "<g fill=\"%s\">\n", pFill);
+        for (size_t i = 0; i < maLevels.size(); i++)
+        {
+            if (maLevels[i]->maNodes.size())
+            {
+                fputs ("<path d=\"", mpFile);
+                maLevels[i]->maNodes.write (mpFile);
+                fputs ("\"/>\n", mpFile);
+            }
+            if (maLevels[i]->maOther.size())
+            {
+                fputs ("<path class=\"o\" d=\"", mpFile);
+                maLevels[i]->maOther.write (mpFile);
+                fputs ("\"/>\n", mpFile);
+            }
+        }
+        fputs ("</g>\n", mpFile);
+    }
+
+    void place (const TreemapItem &rItem, const TreemapRect &rRect,
+                unsigned nParent, int nDepth)
+    {
+        TreemapRect aInner;
+        if (rItem.mpNode)
+        {
+            const FileSystemNode *pNode = rItem.mpNode;
+            unsigned nIndex = mnRects;
+            if (emit (rRect, nParent, nDepth, pNode, 0, pNode->mnSize, aInner))
+                layout (pNode, nIndex, nDepth, aInner);
+        }
+        else if (rItem.mnOther > 0)
+            emit (rRect, nParent, nDepth, NULL, rItem.mnOther, rItem.mnSize,
+                  aInner);
+
+        // Each top level entry gets a colour of its own, which nesting
+        // (cf. fill-opacity) makes darker further down.
+        if (nDepth == 1)
+        {
+            char aFill[32];
+            snprintf (aFill, sizeof (aFill), "hsl(%u,60%%,50%%)",
+                      (mnTop++ * 137) % 360); // golden angle apart
+            flushLevels (aFill);
+        }
+    }
+
+    // The worst aspect ratio of a row of areas along a side.
+    static double worst (double fSum, double fMax, double fMin, double fSide)
+    {
+        double fSide2 = fSide * fSide, fSum2 = fSum * fSum;
+        return std::max (fSide2 * fMax / fSum2, fSum2 / (fSide2 * fMin));
+    }
+
+    /*
+     * Lays the children of a node out in its rectangle. Children are
+     * sorted biggest first, so the ones below a pixel are a tail of
+     * them: that is cut off here and shown as one rectangle, rather
+     * than laid out and dropped later. Squarifying then fills rows
+     * along the shorter side for as long as that makes the row's
+     * worst aspect ratio no worse.
+     */
+    void layout (const FileSystemNode *pNode, unsigned nIndex, int nDepth,
+                 TreemapRect aRect)
+    {
+        if (aRect.mfW < 1 || aRect.mfH < 1 || pNode->mnSize == 0 ||
+            pNode->maChildren.empty())
+            return;
+        double fScale = aRect.mfW * aRect.mfH / pNode->mnSize;
+
+        std::vector< TreemapItem > aItems;
+        size_t nRest = pNode->mnSize, nChildren = pNode->maChildren.size();
+        size_t i = 0;
+        for (; i < nChildren; i++)
+        {
+            const FileSystemNode *pChild = pNode->maChildren[i];
+            if (pChild->mnSize * fScale < 1)
+                break;
+            TreemapItem aItem = { pChild->mnSize * fScale, pChild, 0,
+                                  pChild->mnSize };
+            aItems.push_back (aItem);
+            nRest -= std::min (nRest, pChild->mnSize);
+        }
+        size_t nOther = 0;
+        for (size_t j = i; j < nChildren; j++)
+            if (pNode->maChildren[j]->mnSize > 0)
+                nOther++;
+        mnPruned += nOther;
+        if (nRest > 0)
+        {
+            TreemapItem aItem = { nRest * fScale, NULL, nOther, nRest };
+            aItems.push_back (aItem);
+        }
+
+        for (size_t nFirst = 0; nFirst < aItems.size(); )
+        {
+            double fSide = std::min (aRect.mfW, aRect.mfH);
+            if (fSide <= 0) // rounding ate the rest
+                break;
+            double fSum = 0, fMax = 0, fMin = 0, fWorst = 0;
+            size_t nLast = nFirst;
+            for (; nLast < aItems.size(); nLast++)
+            {
+                double fArea = aItems[nLast].mfArea;
+                double fNewMax = nLast > nFirst ? std::max (fMax, fArea) : fArea;
+                double fNewMin = nLast > nFirst ? std::min (fMin, fArea) : fArea;
+                double fNew = worst (fSum + fArea, fNewMax, fNewMin, fSide);
+                if (nLast > nFirst && fNew > fWorst)
+                    break;
+                fSum += fArea;
+                fMax = fNewMax;
+                fMin = fNewMin;
+                fWorst = fNew;
+            }
+
+            double fThick = fSum / fSide;
+            double fPos = aRect.mfW >= aRect.mfH ? aRect.mfY : aRect.mfX;
+            for (size_t j = nFirst; j < nLast; j++)
+            {
+                double fLength = aItems[j].mfArea / fThick;
+                TreemapRect aPiece;
+                if (aRect.mfW >= aRect.mfH) // a column on the left
+                {
+                    aPiece.mfX = aRect.mfX;
+                    aPiece.mfY = fPos;
+                    aPiece.mfW = fThick;
+                    aPiece.mfH = fLength;
+                }
+                else // a row at the top
+                {
+                    aPiece.mfX = fPos;
+                    aPiece.mfY = aRect.mfY;
+                    aPiece.mfW = fLength;
+                    aPiece.mfH = fThick;
+                }
+                place (aItems[j], aPiece, nIndex, nDepth + 1);
+                fPos += fLength;
+            }
+            if (aRect.mfW >= aRect.mfH)
+            {
+                aRect.mfX += fThick;
+                aRect.mfW -= fThick;
+            }
+            else
+            {
+                aRect.mfY += fThick;
+                aRect.mfH -= fThick;
+            }
+            nFirst = nLast;
+        }
+    }
+
+  public:
+    TreemapWriter (FILE *pFile) : mpFile (pFile), mnRects (0), mnPruned (0),
+                                  mnTop (0) {}
+    ~TreemapWriter ()
+    {
+        for (size_t i = 0; i < maLevels.size(); i++)
+            delete maLevels[i];
+    }
+
+    void write (const FileSystemNode *pRoot)
+    {
+        fputs (treemap_head, mpFile);
+        fprintf (mpFile, "<svg xmlns=\"http://www.w3.org/2000/svg\""
+                 " viewBox=\"0 0 %d %d\">\n<rect class=\"o\" width=\"%d\""
+                 " height=\"%d\"/>\n", TREEMAP_WIDTH, TREEMAP_HEIGHT,
+                 TREEMAP_WIDTH, TREEMAP_HEIGHT);
+
+        TreemapRect aRect = { 0, 0, TREEMAP_WIDTH, TREEMAP_HEIGHT }, aInner;
+        if (emit (aRect, 0, 0, pRoot, 0, pRoot->mnSize, aInner))
+        {
+            maLevels[0]->maNodes.clear(); // the root is the background
+            layout (pRoot, 0, 0, aInner);
+        }
+        maText.write (mpFile);
+        fprintf (mpFile, "</svg>\n<script>\nvar W=%d,H=%d,N=[",
+                 TREEMAP_WIDTH, TREEMAP_HEIGHT);
+        maNames.write (mpFile);
+        fputs ("],\nG=[", mpFile);
+        maGeom.write (mpFile);
+        fputs (treemap_tail, mpFile);
+
+        fprintf (stderr, "treemap: %u rectangles, %lu below a pixel left out\n",
+                 mnRects, (unsigned long)mnPruned);
+    }
+};
+
+bool write_treemap (const FileSystemNode *root, const char *path)
+{
+    FILE *pFile = fopen (path, "w");
+    if (!pFile)
+    {
+        fprintf (stderr, "failed to open '%s' for writing\n", path);
+        return false;
+    }
+
+    TreemapWriter aWriter (pFile);
+    aWriter.write (root);
+
+    bool bFailed = ferror (pFile);
+    if (fclose (pFile) != 0 || bFailed)
+    {
+        fprintf (stderr, "failed to write '%s'\n", path);
+        return false;
+    }
+    return true;
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,202 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef DWARFPROFILE_WORKPOOL_HXX
+#define DWARFPROFILE_WORKPOOL_HXX
+
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+/*
+ * A small work-stealing pool. Every worker has a deque of its own:
+ * it pushes and pops at the back (so the work it just split off stays
+ * warm), and idle workers steal from the front of the others' deques,
+ * which is where the oldest - and usually biggest - work sits. Tasks
+ * may push more tasks while they run; run() returns once every task,
+ * including those, is done. A pool can run again and again: its
+ * threads are started by the first run() and wait for the next one
+ * until the pool goes.
+ */
+class WorkPool {
+  public:
+    struct Task {
+        virtual ~Task () {}
+        // Runs the task on worker nWorker; the pool deletes it after.
+        virtual void run (WorkPool &rPool, int nWorker) = 0;
+    };
+
+  private:
+    struct Queue {
+        std::mutex          maMutex;
+        std::deque< Task * > maTasks;
+    };
+
+    std::vector< Queue * >  maQueues;
+    std::mutex              maIdleMutex;
+    std::condition_variable maIdle;
+    size_t                  mnPending;   // pushed but not finished
+    size_t                  mnPushes;    // wakes up idle workers
+
+    std::vector< std::thread > maThreads; // workers 1 and up
+    std::condition_variable maRound;
+    size_t                  mnRound;     // run() calls so far
+    size_t                  mnBusy;      // threads still in this round
+    bool                    mbQuit;
+
+    WorkPool (const WorkPool &); // not copyable
+    WorkPool &operator= (const WorkPool &);
+
+    Task *pop (int nWorker)
+    {
+        Queue *pOwn = maQueues[nWorker];
+        {
+            std::lock_guard< std::mutex > aGuard (pOwn->maMutex);
+            if (!pOwn->maTasks.empty())
+            {
+                Task *pTask = pOwn->maTasks.back();
+                pOwn->maTasks.pop_back ();
+                return pTask;
+            }
+        }
+        for (size_t i = 1; i < maQueues.size(); i++)
+        {
+            Queue *pVictim = maQueues[(nWorker + i) % maQueues.size()];
+            std::lock_guard< std::mutex > aGuard (pVictim->maMutex);
+            if (!pVictim->maTasks.empty())
+            {
+                Task *pTask = pVictim->maTasks.front();
+                pVictim->maTasks.pop_front ();
+                return pTask;
+            }
+        }
+        return NULL;
+    }
+
+    void work (int nWorker)
+    {
+        for (;;)
+        {
+            size_t nPushes;
+            {
+                std::lock_guard< std::mutex > aGuard (maIdleMutex);
+                nPushes = mnPushes;
+            }
+
+            Task *pTask = pop (nWorker);
+            if (pTask)
+            {
+                pTask->run (*this, nWorker);
+                delete pTask;
+
+                std::lock_guard< std::mutex > aGuard (maIdleMutex);
+                if (--mnPending == 0)
+                    maIdle.notify_all ();
+                continue;
+            }
+
+            // Nothing to steal: wait for a push, or for the end.
+            std::unique_lock< std::mutex > aLock (maIdleMutex);
+            while (mnPending > 0 && mnPushes == nPushes)
+                maIdle.wait (aLock);
+            if (mnPending == 0)
+                return;
+        }
+    }
+
+    // A thread of the pool: works each round, and waits for the next.
+    void serve (int nWorker)
+    {
+        size_t nRound = 0;
+        for (;;)
+        {
+            {
+                std::unique_lock< std::mutex > aLock (maIdleMutex);
+                while (!mbQuit && mnRound == nRound)
+                    maRound.wait (aLock);
+                if (mbQuit)
+                    return;
+                nRound = mnRound;
+            }
+            work (nWorker);
+
+            std::lock_guard< std::mutex > aGuard (maIdleMutex);
+            if (--mnBusy == 0)
+                maRound.notify_all ();
+        }
+    }
+
+  public:
+    WorkPool (int nWorkers)
+        : mnPending (0), mnPushes (0), mnRound (0), mnBusy (0), mbQuit (false)
+    {
+        if (nWorkers < 1)
+            nWorkers = 1;
+        for (int i = 0; i < nWorkers; i++)
+            maQueues.push_back (new Queue);
+    }
+
+    ~WorkPool ()
+    {
+        {
+            std::lock_guard< std::mutex > aGuard (maIdleMutex);
+            mbQuit = true;
+        }
+        maRound.notify_all ();
+        for (size_t i = 0; i < maThreads.size(); i++)
+            maThreads[i].join ();
+        for (size_t i = 0; i < maQueues.size(); i++)
+            delete maQueues[i];
+    }
+
+    int workers () const { return maQueues.size(); }
+
+    // Queues a task on worker nWorker's deque; takes ownership.
+    void push (Task *pTask, int nWorker)
+    {
+        {
+            std::lock_guard< std::mutex > aGuard (maIdleMutex);
+            mnPending++;
+        }
+        Queue *pQueue = maQueues[nWorker % maQueues.size()];
+        {
+            std::lock_guard< std::mutex > aGuard (pQueue->maMutex);
+            pQueue->maTasks.push_back (pTask);
+        }
+        // Only now that it can be found, or a waiter might miss it.
+        {
+            std::lock_guard< std::mutex > aGuard (maIdleMutex);
+            mnPushes++;
+        }
+        maIdle.notify_one ();
+    }
+
+    // Runs everything queued (and queued meanwhile) to completion.
+    void run ()
+    {
+        if (maThreads.empty())
+            for (size_t i = 1; i < maQueues.size(); i++)
+                maThreads.push_back (std::thread (&WorkPool::serve, this, (int)i));
+        {
+            std::lock_guard< std::mutex > aGuard (maIdleMutex);
+            mnRound++;
+            mnBusy = maThreads.size();
+        }
+        maRound.notify_all ();
+        work (0);
+
+        std::unique_lock< std::mutex > aLock (maIdleMutex);
+        while (mnBusy > 0)
+            maRound.wait (aLock);
+    }
+};
+
+#endif // DWARFPROFILE_WORKPOOL_HXX
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */